@@ -1,15 +1,54 @@
 #ifndef APP_H
 #define APP_H
 
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/epoll.h>
 #include <linux/input.h>
 
 typedef int (*send_t)(void*, struct input_event);
+// like send_t, for an array of events such as a macro's
+typedef int (*send_many_t)(void*, const struct input_event*, size_t);
+
+/* every fd in the serve_loop's epoll set carries a tag in the upper half of
+   its epoll_data.u64 which says who registered it.  The lower half belongs to
+   whoever registered the fd (usually the fd itself or an index). */
+typedef enum {
+    EPOLL_TAG_INPUT = 1,
+    EPOLL_TAG_INOTIFY,
+    EPOLL_TAG_TIMER,
+    EPOLL_TAG_APP,
+    EPOLL_TAG_URING,
+    EPOLL_TAG_RING,
+} epoll_tag_t;
+
+#define EPOLL_DATA(tag, val) (((uint64_t)(tag) << 32) | (uint32_t)(val))
+#define EPOLL_DATA_TAG(data) ((epoll_tag_t)((data) >> 32))
+#define EPOLL_DATA_VAL(data) ((uint32_t)(data))
+
+// wrapper around epoll_ctl() for tagged fds; returns 0 or -1
+static inline int epoll_watch(int epfd, int op, int fd, uint32_t events,
+        epoll_tag_t tag, uint32_t val){
+    struct epoll_event ev = {
+        .events = events,
+        .data = { .u64 = EPOLL_DATA(tag, val) },
+    };
+    return epoll_ctl(epfd, op, fd, &ev);
+}
 
 typedef struct {
     send_t send;
-    // returns a max_fd value
-    int (*prep_select)(void*, fd_set *rd_fds, fd_set *w_fds);
-    void (*handle_select)(void*, fd_set *rd_fds, fd_set *w_fds);
+    // optional; without it, arrays of events are passed to send one by one
+    send_many_t send_many;
+    /* if set, events passed to send may be buffered until flush is called;
+       the serve_loop calls it once per wakeup, after resolving everything */
+    void (*flush)(void*);
+    /* register the app's fds with the epoll set, tagged with EPOLL_TAG_APP.
+       Called once before looping; the app may keep epfd to update its own
+       interest list later.  Returns 0 on success or -1 on error. */
+    int (*epoll_register)(void*, int epfd);
+    // called for each ready fd which was registered with EPOLL_TAG_APP
+    void (*epoll_handle)(void*, uint32_t val, uint32_t events);
 } app_t;
 
 #endif // APP_H
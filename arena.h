@@ -0,0 +1,31 @@
+#ifndef ARENA_H
+#define ARENA_H
+
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+/* A bump allocator over one contiguous block, for data which is built once
+   and freed all at once.  An arena with a NULL base only counts: running the
+   same allocations against it first gives the exact size to allocate. */
+typedef struct {
+    char *base;
+    size_t used;
+    size_t size;
+} arena_t;
+
+// returns NULL while measuring
+static inline void *arena_alloc(arena_t *a, size_t size){
+    size_t align = _Alignof(max_align_t);
+    size_t start = (a->used + align - 1) & ~(align - 1);
+    a->used = start + size;
+    if(!a->base) return NULL;
+    if(a->used > a->size){
+        // the measuring pass and the filling pass disagree
+        fprintf(stderr, "arena overflow\n");
+        abort();
+    }
+    return a->base + start;
+}
+
+#endif // ARENA_H
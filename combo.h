@@ -0,0 +1,34 @@
+#ifndef COMBO_H
+#define COMBO_H
+
+#include <stdint.h>
+#include <linux/input.h>
+
+#include "key_action.h"
+#include "time_util.h"
+
+// combos are tracked as bits in a uint64_t
+#define COMBO_MAX 64
+#define COMBO_KEYS_MAX 16
+
+// a chord of keys which, pressed together, act as a single key
+struct combo {
+    // a KT_SIMPLE or KT_MACRO
+    key_action_t action;
+    // every key must be pressed within this long of the first
+    nstime_t timeout;
+    uint8_t n_keys;
+};
+
+/* every combo in the config, compiled so that the combos a key press could
+   be part of are a single load */
+typedef struct {
+    size_t n;
+    struct combo combos[COMBO_MAX];
+    // the combos each key belongs to
+    uint64_t key_masks[KEY_MAX];
+    // the combos with each number of keys
+    uint64_t size_masks[COMBO_KEYS_MAX + 1];
+} combos_t;
+
+#endif // COMBO_H
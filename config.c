@@ -1,5 +1,7 @@
+#include <ctype.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <sys/mman.h>
 #include <sys/types.h>
 #include <stdbool.h>
 #include <string.h>
@@ -14,6 +16,7 @@ static int non_negative_idx(lua_State *L, int idx){
 }
 
 int copy_to_key_action(lua_State *L, int idx, key_action_t *ka);
+int lua_new_key_action(lua_State *L);
 
 // An example lua allocator.
 // from https://www.lua.org/manual/5.3/manual.html#lua_Alloc
@@ -36,55 +39,90 @@ int lua_key_action_gc(lua_State *L){
     return 0;
 }
 
-// fill maps of values based on other maps
-void fill_map(key_action_t *tgt, key_action_t *base);
-
-// fill individual values based on a map and a default value
-void fill_action(key_action_t *tgt, key_action_t *base, key_action_t filler){
-    switch(tgt->type){
-        case KT_NONE:
-            *tgt = filler;
-            break;
-        case KT_SIMPLE: break;
-        case KT_MACRO: break;
-        case KT_DUAL:
-            fill_action(tgt->key.dual.tap, base, filler);
-            fill_action(tgt->key.dual.hold, base, filler);
-            break;
-        case KT_MAP:
-            fill_map(tgt, base);
-            break;
+/* what key i does under the keymaps in ancestors (outermost first) if the
+   keymap nested in them doesn't map it, or NULL for the plain key */
+static const key_action_t *fall_through(const key_map_t **ancestors,
+        int n, int i){
+    while(n-- > 0){
+        const key_action_t *ka = key_map_find(ancestors[n], i);
+        if(ka && ka->type != KT_NONE) return ka;
     }
+    return NULL;
 }
 
-void fill_map(key_action_t *tgt, key_action_t *base){
-    if(tgt->type != KT_MAP){
-        fprintf(stderr, "fill_map: tgt is not a KT_MAP\n");
-        return;
-    }
-    if(base && base->type != KT_MAP){
-        fprintf(stderr, "fill_map: base is not a KT_MAP\n");
-        return;
+/* Check a keymap the way it will be compiled: KT_NONE keys and a dual_key's
+   nil tap or hold fall through to the keymaps containing it, which are
+   ancestors[0..depth-1].  Keymaps are shared between every place they are
+   used, so the compiled lookup tables are only built when the config is
+   compacted, but this catches the errors while lua can still report them.
+   *max_depth is the deepest keymap seen so far.  Return 0/-1 on
+   success/error. */
+static int check_map(const key_map_t *map, const key_map_t **ancestors,
+        int depth, int *max_depth){
+    if(depth > KEYMAP_MAX_DEPTH){
+        fprintf(stderr, "keymaps nested deeper than %d\n", KEYMAP_MAX_DEPTH);
+        return -1;
     }
+    if(depth > *max_depth) *max_depth = depth;
+    ancestors[depth] = map;
 
-    // fill all KT_NONE's with references (or KT_SIMPLE's for the root map)
-    for(size_t i = 0; i < KEY_MAX; i++){
-        key_action_t filler;
-        if(base == NULL){
-            filler.type = KT_SIMPLE;
-            filler.key.simple = (int)i;
-        }else{
-            filler.type = KT_NONE;
-            filler.key.ref = &base->key.map[i];
+    for(size_t j = 0; j < map->n; j++){
+        int i = map->keys[j].code;
+        const key_action_t *ka = &map->keys[j].action;
+        const key_action_t *fall;
+        switch(ka->type){
+            case KT_NONE:   break;
+            case KT_SIMPLE: break;
+            case KT_MACRO:  break;
+            case KT_DUAL:
+                fall = fall_through(ancestors, depth, i);
+                if((ka->key.dual.tap->type == KT_NONE
+                            || ka->key.dual.hold->type == KT_NONE)
+                        && fall && fall->type == KT_DUAL){
+                    fprintf(stderr, "dual_key() with a nil argument cannot "
+                            "fall through to another dual_key\n");
+                    return -1;
+                }
+                if(ka->key.dual.hold->type == KT_MAP){
+                    if(check_map(ka->key.dual.hold->key.map, ancestors,
+                                depth + 1, max_depth)){
+                        return -1;
+                    }
+                }
+                break;
+            case KT_MAP:
+                if(check_map(ka->key.map, ancestors, depth + 1, max_depth)){
+                    return -1;
+                }
+                break;
+            case KT_DANCE:
+                for(size_t j = 0; j < ka->key.dance->n; j++){
+                    key_action_t *hold = &ka->key.dance->holds[j];
+                    if(hold->type != KT_MAP) continue;
+                    if(check_map(hold->key.map, ancestors, depth + 1,
+                                max_depth)){
+                        return -1;
+                    }
+                }
+                break;
         }
-
-        fill_action(&tgt->key.map[i], base, filler);
     }
+
+    return 0;
 }
 
+/* the registry key of a table from each lua table already converted to a
+   keymap to a key_action userdata sharing the result */
+static const char converted_keymaps = 0;
 
-// return 0/-1 on success/error
-int extract_table_to_key_map(lua_State *L, int table_idx, key_action_t *map){
+/* the lua tables being copied by copy_to_key_action(), outermost first, so
+   that a table which contains itself is an error instead of a stack overflow */
+static const void *copying[KEYMAP_MAX_DEPTH];
+static int n_copying;
+
+/* map needs room for every entry of the table; the bindings are added
+   unsorted.  Return 0/-1 on success/error */
+int extract_table_to_key_map(lua_State *L, int table_idx, key_map_t *map){
     // first key
     lua_pushnil(L);
     table_idx = non_negative_idx(L, table_idx);
@@ -94,7 +132,9 @@ int extract_table_to_key_map(lua_State *L, int table_idx, key_action_t *map){
 
         // get the key we will use in our internal hashmap
         int key;
-        if(lua_isstring(L, -2)){
+        /* not lua_isstring(), which is also true for numbers; lua_tostring()
+           on a number key would convert it in place and confuse lua_next() */
+        if(lua_type(L, -2) == LUA_TSTRING){
             const char *name = lua_tostring(L, -2);
             key = get_input_value(name);
             if(!key){
@@ -103,6 +143,10 @@ int extract_table_to_key_map(lua_State *L, int table_idx, key_action_t *map){
             }
         }else if(lua_isinteger(L, -2)){
             lua_Integer n = lua_tointeger(L, -2);
+            if(n < 0 || n >= KEY_MAX){
+                fprintf(stderr, "Invalid key code: %d\n", (int)n);
+                return -1;
+            }
             key = (int)n;
         }else{
             fprintf(stderr,
@@ -111,9 +155,12 @@ int extract_table_to_key_map(lua_State *L, int table_idx, key_action_t *map){
         }
 
         // duplicate the key action (this is a recursion)
-        if(copy_to_key_action(L, -1, &map[key])){
+        struct key_binding *b = &map->keys[map->n];
+        b->code = key;
+        if(copy_to_key_action(L, -1, &b->action)){
             return -1;
         }
+        map->n++;
 
         // remove the value
         lua_pop(L, 1);
@@ -152,27 +199,67 @@ int copy_to_key_action(lua_State *L, int idx, key_action_t *ka){
 
     // key map?
     if(lua_istable(L, idx)){
-        // alloc the map
-        key_action_t *map = malloc(sizeof(*map) * KEY_MAX);
-        if(!map) return -1;
+        idx = lua_absindex(L, idx);
+
+        // a table which was converted before is shared, not converted again
+        lua_rawgetp(L, LUA_REGISTRYINDEX, &converted_keymaps);
+        lua_pushvalue(L, idx);
+        lua_rawget(L, -2);
+        if(lua_isuserdata(L, -1)){
+            int ret = key_action_dup(lua_touserdata(L, -1), ka);
+            lua_pop(L, 2);
+            return ret;
+        }
+        lua_pop(L, 2);
 
-        // zeroize
-        for(size_t k = 0; k < KEY_MAX; k++){
-            map[k] = (key_action_t){.type=KT_NONE};
+        // refuse cycles before they recurse forever
+        const void *table = lua_topointer(L, idx);
+        for(int i = 0; i < n_copying; i++){
+            if(copying[i] == table){
+                fprintf(stderr, "keymap contains itself\n");
+                return -1;
+            }
+        }
+        if(n_copying == KEYMAP_MAX_DEPTH){
+            fprintf(stderr, "keymaps nested deeper than %d\n",
+                    KEYMAP_MAX_DEPTH);
+            return -1;
+        }
+
+        // a keymap only has room for the keys it binds
+        size_t n = 0;
+        lua_pushnil(L);
+        while(lua_next(L, idx) != 0){
+            n++;
+            lua_pop(L, 1);
         }
+        key_map_t *map = key_map_new(n);
+        if(!map) return -1;
 
         // this may recurse.
-        if(extract_table_to_key_map(L, idx, map)){
-            // handle error: release everything we have allocated in map
-            for(size_t k = 0; k < KEY_MAX; k++){
-                key_action_free(&map[k]);
-            }
-            free(map);
+        copying[n_copying++] = table;
+        int ret = extract_table_to_key_map(L, idx, map);
+        n_copying--;
+        if(!ret) ret = key_map_sort(map);
+        if(ret){
+            key_map_free(map);
             return -1;
         }
 
         ka->type = KT_MAP;
         ka->key.map = map;
+
+        /* remember the conversion; later changes to the table are ignored,
+           since keymaps are immutable once built */
+        lua_rawgetp(L, LUA_REGISTRYINDEX, &converted_keymaps);
+        lua_pushvalue(L, idx);
+        if(lua_new_key_action(L)){
+            lua_pop(L, 2);
+            return 0;
+        }
+        key_action_dup(ka, lua_touserdata(L, -1));
+        lua_rawset(L, -3);
+        lua_pop(L, 1);
         return 0;
     }
 
@@ -257,6 +344,9 @@ int lua_key_action_tostring(lua_State *L){
         case KT_MAP:
             lua_pushliteral(L, "MAP");
             break;
+        case KT_DANCE:
+            lua_pushliteral(L, "TAP_DANCE");
+            break;
         default:
             lua_pushliteral(L, "invalid key action");
             break;
@@ -545,14 +635,17 @@ int lua_dual_key(lua_State *L){
     }
 
     // validate args
-    if(tap.type == KT_DUAL || tap.type == KT_MAP){
+    if(tap.type == KT_DUAL || tap.type == KT_MAP || tap.type == KT_DANCE){
         lua_pushliteral(L,
-            "dual_key() argument 1 cannot be another dual_key or a keymap"
+            "dual_key() argument 1 cannot be another dual_key, a tap_dance, "
+            "or a keymap"
         );
         goto fail_hold;
     }
-    if(hold.type == KT_DUAL){
-        lua_pushliteral(L, "dual_key() argument 2 cannot be another dual_key");
+    if(hold.type == KT_DUAL || hold.type == KT_DANCE){
+        lua_pushliteral(L,
+            "dual_key() argument 2 cannot be another dual_key or a tap_dance"
+        );
         goto fail_hold;
     }
 
@@ -632,6 +725,476 @@ fail:
     return lua_error(L);
 }
 
+/* combo(), leader(), and tap_dance() all take a config table with only a
+   single timeout in it, and each has its own error messages */
+#define TIMEOUT_CONFIG_BAD_TYPE -1
+#define TIMEOUT_CONFIG_INVALID_TIMEOUT_MS -2
+
+#define COMBO_CONFIG_BAD_TYPE_MSG \
+    "combo() argument 3 must a config table. Allowed keys are\n" \
+    " TIMEOUT_MS."
+#define COMBO_INVALID_TIMEOUT_MS_MSG \
+    "CONFIG.TIMEOUT_MS in combo() must be a positive integer."
+
+#define TAP_DANCE_CONFIG_BAD_TYPE_MSG \
+    "the last argument of tap_dance() may be a config table. Allowed keys\n" \
+    "are TAPPING_MS."
+#define TAP_DANCE_INVALID_TAPPING_MS_MSG \
+    "CONFIG.TAPPING_MS in tap_dance() must be a positive integer."
+
+#define LEADER_CONFIG_BAD_TYPE_MSG \
+    "leader() argument 3 must a config table. Allowed keys are\n" \
+    " TIMEOUT_MS."
+#define LEADER_INVALID_TIMEOUT_MS_MSG \
+    "CONFIG.TIMEOUT_MS in leader() must be a positive integer."
+
+// return a negative error code on failure, 0 on success
+int read_timeout_config(lua_State *L, int config_idx, const char *name,
+        long *timeout_ms_out){
+    int error_code = TIMEOUT_CONFIG_BAD_TYPE;
+
+    // CONFIG arg must be a table
+    if(!lua_istable(L, config_idx)) return error_code;
+
+    // iterate through keys in the table
+    lua_pushnil(L);
+    config_idx = non_negative_idx(L, config_idx);
+    while(lua_next(L, config_idx) != 0){
+
+        // key is at index -2, value is at index -1
+
+        if(!lua_isstring(L, -2)){
+            // all keys must be strings
+            error_code = TIMEOUT_CONFIG_BAD_TYPE;
+            goto fail_iter;
+        }
+
+        size_t keylen;
+        const char *key = lua_tolstring(L, -2, &keylen);
+        if(strncmp(name, key, keylen) == 0){
+            if(!lua_isinteger(L, -1)){
+                error_code = TIMEOUT_CONFIG_INVALID_TIMEOUT_MS;
+                goto fail_iter;
+            }
+            lua_Integer n = lua_tointeger(L, -1);
+            // timeout must be positive
+            if(n < 1){
+                error_code = TIMEOUT_CONFIG_INVALID_TIMEOUT_MS;
+                goto fail_iter;
+            }
+            *timeout_ms_out = n;
+        }else{
+            // unrecognized key
+            goto fail_iter;
+        }
+
+        // remove the value
+        lua_pop(L, 1);
+        continue;
+
+    fail_iter:
+        lua_pop(L, 2);
+        return error_code;
+    }
+    // lua_next() removes the key at the very end
+
+    return 0;
+}
+
+// function combo(keys: table, action[, config: table]):
+int lua_combo(lua_State *L){
+    // check the number of arguments
+    int nargs = lua_gettop(L);
+    if(nargs != 2 && nargs != 3){
+        lua_pushliteral(L, "combo() requires two or three arguments");
+        goto fail;
+    }
+
+    if(!lua_istable(L, 1)){
+        lua_pushliteral(L, "argument 1 of combo() must be a list of keys");
+        goto fail;
+    }
+
+    // read the keys into a set
+    size_t n_keys = lua_rawlen(L, 1);
+    if(n_keys < 2 || n_keys > COMBO_KEYS_MAX){
+        lua_pushfstring(L, "combo() requires between 2 and %d keys",
+                COMBO_KEYS_MAX);
+        goto fail;
+    }
+    uint16_t keys[COMBO_KEYS_MAX];
+    for(size_t i = 0; i < n_keys; i++){
+        lua_rawgeti(L, 1, (lua_Integer)i + 1);
+        bool ok = lua_isinteger(L, -1);
+        lua_Integer n = lua_tointeger(L, -1);
+        lua_pop(L, 1);
+        if(!ok || n < 0 || n >= KEY_MAX){
+            lua_pushliteral(L, "combo() keys must be key names");
+            goto fail;
+        }
+        for(size_t j = 0; j < i; j++){
+            if(keys[j] == n){
+                lua_pushliteral(L, "combo() keys must all be different");
+                goto fail;
+            }
+        }
+        keys[i] = (uint16_t)n;
+    }
+
+    long timeout_ms = 50;
+    if(nargs > 2){
+        switch(read_timeout_config(L, 3, "TIMEOUT_MS", &timeout_ms)){
+            case 0: break;
+
+            case TIMEOUT_CONFIG_INVALID_TIMEOUT_MS:
+                lua_pushliteral(L, COMBO_INVALID_TIMEOUT_MS_MSG);
+                goto fail;
+
+            case TIMEOUT_CONFIG_BAD_TYPE:
+            default:
+                lua_pushliteral(L, COMBO_CONFIG_BAD_TYPE_MSG);
+                goto fail;
+        }
+    }
+
+    // get the config from the lua_State
+    lua_getglobal(L, "__config");
+    config_t *config = lua_touserdata(L, lua_gettop(L));
+    lua_pop(L, 1);
+
+    if(!config->combos){
+        config->combos = calloc(1, sizeof(*config->combos));
+        if(!config->combos){
+            lua_pushliteral(L, "malloc failed");
+            goto fail;
+        }
+    }
+    combos_t *combos = config->combos;
+    if(combos->n == COMBO_MAX){
+        lua_pushfstring(L, "no more than %d combos are allowed", COMBO_MAX);
+        goto fail;
+    }
+
+    // a combo with the same keys as an earlier one could never fire
+    uint64_t same = combos->size_masks[n_keys];
+    for(size_t i = 0; i < n_keys; i++){
+        same &= combos->key_masks[keys[i]];
+    }
+    if(same){
+        lua_pushliteral(L, "combo() keys must differ from every other combo");
+        goto fail;
+    }
+
+    key_action_t action;
+    if(copy_to_key_action(L, 2, &action)){
+        lua_pushliteral(L, "combo() failed to copy argument 2");
+        goto fail;
+    }
+    if(action.type != KT_SIMPLE && action.type != KT_MACRO){
+        lua_pushliteral(L, "argument 2 of combo() must be a key or a macro");
+        goto fail_action;
+    }
+
+    // compile the combo into the masks
+    size_t c = combos->n++;
+    combos->combos[c] = (struct combo){
+        .action = action,
+        .timeout = msec_to_ns(timeout_ms),
+        .n_keys = (uint8_t)n_keys,
+    };
+    for(size_t i = 0; i < n_keys; i++){
+        combos->key_masks[keys[i]] |= (uint64_t)1 << c;
+    }
+    combos->size_masks[n_keys] |= (uint64_t)1 << c;
+
+    lua_pop(L, nargs);
+    return 0;
+
+fail_action:
+    key_action_free(&action);
+fail:
+    return lua_error(L);
+}
+
+/* parse a leader sequence like "g s" or "KEY_G KEY_S" into key codes.
+   Returns the number of keys, or -1 on error. */
+static int parse_leader_seq(const char *seq, uint16_t *codes){
+    int n = 0;
+    while(*seq){
+        // skip spaces
+        if(*seq == ' '){
+            seq++;
+            continue;
+        }
+        size_t len = strcspn(seq, " ");
+        if(n == LEADER_SEQ_MAX || len > 32) return -1;
+
+        // try the name as given, then as a short name like "g" for KEY_G
+        char name[40];
+        snprintf(name, sizeof(name), "%.*s", (int)len, seq);
+        uint16_t code = get_input_value(name);
+        if(!code){
+            snprintf(name, sizeof(name), "KEY_%.*s", (int)len, seq);
+            for(char *c = name; *c; c++) *c = toupper(*c);
+            code = get_input_value(name);
+        }
+        if(!code || code >= KEY_MAX) return -1;
+
+        codes[n++] = code;
+        seq += len;
+    }
+    return n;
+}
+
+static void leader_free(leader_t *leader){
+    if(leader->nodes){
+        for(size_t i = 0; i < leader->n_nodes; i++){
+            key_action_free(&leader->nodes[i].action);
+        }
+    }
+    free(leader->nodes);
+    free(leader->next);
+    *leader = (leader_t){0};
+}
+
+// function leader(key, sequences: table[, config: table]):
+int lua_leader(lua_State *L){
+    // check the number of arguments
+    int nargs = lua_gettop(L);
+    if(nargs != 2 && nargs != 3){
+        lua_pushliteral(L, "leader() requires two or three arguments");
+        goto fail;
+    }
+
+    if(!lua_isinteger(L, 1)
+            || lua_tointeger(L, 1) < 1 || lua_tointeger(L, 1) >= KEY_MAX){
+        lua_pushliteral(L, "argument 1 of leader() must be a key name");
+        goto fail;
+    }
+    uint16_t key = (uint16_t)lua_tointeger(L, 1);
+
+    if(!lua_istable(L, 2)){
+        lua_pushliteral(L, "argument 2 of leader() must be a table");
+        goto fail;
+    }
+
+    long timeout_ms = 1000;
+    if(nargs > 2){
+        switch(read_timeout_config(L, 3, "TIMEOUT_MS", &timeout_ms)){
+            case 0: break;
+
+            case TIMEOUT_CONFIG_INVALID_TIMEOUT_MS:
+                lua_pushliteral(L, LEADER_INVALID_TIMEOUT_MS_MSG);
+                goto fail;
+
+            case TIMEOUT_CONFIG_BAD_TYPE:
+            default:
+                lua_pushliteral(L, LEADER_CONFIG_BAD_TYPE_MSG);
+                goto fail;
+        }
+    }
+
+    // get the config from the lua_State
+    lua_getglobal(L, "__config");
+    config_t *config = lua_touserdata(L, lua_gettop(L));
+    lua_pop(L, 1);
+
+    if(!config->leaders){
+        config->leaders = calloc(1, sizeof(*config->leaders));
+        if(!config->leaders){
+            lua_pushliteral(L, "malloc failed");
+            goto fail;
+        }
+    }
+    leaders_t *leaders = config->leaders;
+    if(leaders->n == LEADER_MAX){
+        lua_pushfstring(L, "no more than %d leaders are allowed", LEADER_MAX);
+        goto fail;
+    }
+    if(leaders->by_key[key]){
+        lua_pushliteral(L, "leader() was already called for that key");
+        goto fail;
+    }
+
+    leader_t *leader = &leaders->leaders[leaders->n];
+    *leader = (leader_t){ .key = key, .timeout = msec_to_ns(timeout_ms) };
+
+    uint16_t codes[LEADER_SEQ_MAX];
+    int n;
+
+    /* first pass: give every key in a sequence a column, and count how many
+       nodes the trie could need */
+    size_t max_nodes = 1;
+    lua_pushnil(L);
+    while(lua_next(L, 2) != 0){
+        // key is at index -2, value is at index -1
+        if(lua_type(L, -2) != LUA_TSTRING
+                || (n = parse_leader_seq(lua_tostring(L, -2), codes)) < 1){
+            lua_pop(L, 2);
+            lua_pushliteral(L, "leader() sequences must be strings of up to "
+                    "16 key names separated by spaces, like \"g s\"");
+            goto fail;
+        }
+        for(int i = 0; i < n; i++){
+            if(leader->alpha[codes[i]]) continue;
+            if(leader->n_alpha == UINT8_MAX){
+                lua_pop(L, 2);
+                lua_pushliteral(L, "leader() sequences use too many keys");
+                goto fail;
+            }
+            leader->alpha[codes[i]] = (uint8_t)++leader->n_alpha;
+        }
+        max_nodes += n;
+        lua_pop(L, 1);
+    }
+    if(max_nodes > UINT16_MAX){
+        lua_pushliteral(L, "leader() has too many sequences");
+        goto fail;
+    }
+
+    // allocate the whole trie at once
+    leader->next = calloc(max_nodes * leader->n_alpha, sizeof(*leader->next));
+    leader->nodes = calloc(max_nodes, sizeof(*leader->nodes));
+    if(!leader->next || !leader->nodes){
+        lua_pushliteral(L, "malloc failed");
+        goto fail_leader;
+    }
+    leader->n_nodes = 1;
+
+    // second pass: insert each sequence
+    lua_pushnil(L);
+    while(lua_next(L, 2) != 0){
+        n = parse_leader_seq(lua_tostring(L, -2), codes);
+        size_t node = 0;
+        for(int i = 0; i < n; i++){
+            size_t col = leader->alpha[codes[i]] - 1;
+            uint16_t *next = &leader->next[node * leader->n_alpha + col];
+            if(!*next){
+                *next = (uint16_t)leader->n_nodes++;
+                leader->nodes[node].has_next = true;
+            }
+            node = *next;
+        }
+
+        key_action_t *action = &leader->nodes[node].action;
+        if(action->type != KT_NONE){
+            lua_pop(L, 2);
+            lua_pushliteral(L, "leader() has the same sequence twice");
+            goto fail_leader;
+        }
+        if(copy_to_key_action(L, -1, action)){
+            lua_pop(L, 2);
+            lua_pushliteral(L, "leader() failed to copy an action");
+            goto fail_leader;
+        }
+        if(action->type != KT_SIMPLE && action->type != KT_MACRO){
+            lua_pop(L, 2);
+            lua_pushliteral(L, "leader() actions must be keys or macros");
+            goto fail_leader;
+        }
+        lua_pop(L, 1);
+    }
+
+    leaders->by_key[key] = (uint8_t)++leaders->n;
+
+    lua_pop(L, nargs);
+    return 0;
+
+fail_leader:
+    leader_free(leader);
+fail:
+    return lua_error(L);
+}
+
+// function tap_dance(action1, action2, ...[, config: table]):
+int lua_tap_dance(lua_State *L){
+    int nargs = lua_gettop(L);
+
+    // a trailing plain table is the config, since taps can't be keymaps
+    long tapping_ms = 200;
+    int n = nargs;
+    if(n > 0 && lua_istable(L, n)){
+        switch(read_timeout_config(L, n, "TAPPING_MS", &tapping_ms)){
+            case 0: break;
+
+            case TIMEOUT_CONFIG_INVALID_TIMEOUT_MS:
+                lua_pushliteral(L, TAP_DANCE_INVALID_TAPPING_MS_MSG);
+                goto fail;
+
+            case TIMEOUT_CONFIG_BAD_TYPE:
+            default:
+                lua_pushliteral(L, TAP_DANCE_CONFIG_BAD_TYPE_MSG);
+                goto fail;
+        }
+        n--;
+    }
+    if(n < 1){
+        lua_pushliteral(L, "tap_dance() requires at least one action");
+        goto fail;
+    }
+
+    key_dance_t *dance = malloc(sizeof(*dance));
+    if(!dance){
+        lua_pushliteral(L, "tap_dance() failed to allocate memory");
+        goto fail;
+    }
+    *dance = (key_dance_t){ .n = (size_t)n, .tapping_ms = tapping_ms };
+    dance->taps = calloc(n, sizeof(*dance->taps));
+    dance->holds = calloc(n, sizeof(*dance->holds));
+    if(!dance->taps || !dance->holds){
+        lua_pushliteral(L, "tap_dance() failed to allocate memory");
+        goto fail_dance;
+    }
+
+    for(int i = 0; i < n; i++){
+        key_action_t ka;
+        if(copy_to_key_action(L, i + 1, &ka)){
+            lua_pushfstring(L, "tap_dance() failed to copy argument %d", i + 1);
+            goto fail_dance;
+        }
+        // a dual_key gives the action for a count a hold variant
+        if(ka.type == KT_DUAL){
+            key_action_t *tap = ka.key.dual.tap;
+            key_action_t *hold = ka.key.dual.hold;
+            dance->taps[i] = *tap;
+            dance->holds[i] = *hold;
+            free(tap);
+            free(hold);
+        }else{
+            dance->taps[i] = ka;
+        }
+        int type = dance->taps[i].type;
+        if(type != KT_SIMPLE && type != KT_MACRO){
+            lua_pushfstring(L, "tap_dance() argument %d must be a key, a "
+                    "macro, or a dual_key of a key or macro", i + 1);
+            goto fail_dance;
+        }
+        if(ka.type == KT_DUAL && dance->holds[i].type == KT_NONE){
+            lua_pushfstring(L, "tap_dance() argument %d has no hold action",
+                    i + 1);
+            goto fail_dance;
+        }
+    }
+
+    // done with args
+    lua_pop(L, nargs);
+
+    // push a new key_action to the stack
+    if(lua_new_key_action(L)){
+        lua_pushliteral(L, "tap_dance() failed to allocate memory");
+        goto fail_dance;
+    }
+    key_action_t *ka = lua_touserdata(L, lua_gettop(L));
+    ka->type = KT_DANCE;
+    ka->key.dance = dance;
+    return 1;
+
+fail_dance:
+    key_dance_free(dance);
+fail:
+    return lua_error(L);
+}
+
 int lua_print(lua_State *L){
     int nargs = lua_gettop(L);
     for(int i = 0; i < nargs; i++){
@@ -650,11 +1213,90 @@ int lua_print(lua_State *L){
     return 0;
 }
 
-// function grab_keyboard(pattern: string, keymap: table):
+#define GRAB_CONFIG_BAD_TYPE -1
+#define GRAB_CONFIG_BAD_TYPE_MSG \
+    "grab_keyboard() argument 3 must a config table. Allowed keys are\n" \
+    " REPEAT_DELAY_MS and REPEAT_INTERVAL_MS."
+
+#define GRAB_INVALID_REPEAT_DELAY_MS -2
+#define GRAB_INVALID_REPEAT_DELAY_MS_MSG \
+    "CONFIG.REPEAT_DELAY_MS in grab_keyboard() must be a positive integer."
+
+#define GRAB_INVALID_REPEAT_INTERVAL_MS -3
+#define GRAB_INVALID_REPEAT_INTERVAL_MS_MSG \
+    "CONFIG.REPEAT_INTERVAL_MS in grab_keyboard() must be a positive integer " \
+    "or 0"
+
+// return a negative error code on failure, 0 on success
+int read_grab_config(lua_State *L, int config_idx, grab_t *grab){
+    int error_code = GRAB_CONFIG_BAD_TYPE;
+
+    // CONFIG arg must be a table
+    if(!lua_istable(L, config_idx)) return error_code;
+
+    // iterate through keys in the table
+    lua_pushnil(L);
+    config_idx = non_negative_idx(L, config_idx);
+    while(lua_next(L, config_idx) != 0){
+
+        // key is at index -2, value is at index -1
+
+        if(!lua_isstring(L, -2)){
+            // all keys must be strings
+            error_code = GRAB_CONFIG_BAD_TYPE;
+            goto fail_iter;
+        }
+
+        size_t keylen;
+        const char *key = lua_tolstring(L, -2, &keylen);
+        if(strncmp("REPEAT_DELAY_MS", key, keylen) == 0){
+            if(!lua_isinteger(L, -1)){
+                error_code = GRAB_INVALID_REPEAT_DELAY_MS;
+                goto fail_iter;
+            }
+            lua_Integer n = lua_tointeger(L, -1);
+            // repeat delay must be positive
+            if(n < 1){
+                error_code = GRAB_INVALID_REPEAT_DELAY_MS;
+                goto fail_iter;
+            }
+            grab->repeat_delay_ms = n;
+        }else if(strncmp("REPEAT_INTERVAL_MS", key, keylen) == 0){
+            if(!lua_isinteger(L, -1)){
+                error_code = GRAB_INVALID_REPEAT_INTERVAL_MS;
+                goto fail_iter;
+            }
+            lua_Integer n = lua_tointeger(L, -1);
+            // repeat interval must be positive or 0
+            if(n < 0){
+                error_code = GRAB_INVALID_REPEAT_INTERVAL_MS;
+                goto fail_iter;
+            }
+            grab->repeat_interval_ms = n;
+        }else{
+            // unrecognized key
+            goto fail_iter;
+        }
+
+        // remove the value
+        lua_pop(L, 1);
+        continue;
+
+    fail_iter:
+        lua_pop(L, 2);
+        return error_code;
+    }
+    // lua_next() removes the key at the very end
+
+    return 0;
+}
+
+// function grab_keyboard(pattern: string, keymap: table[, config: table]):
 int lua_grab_keyboard(lua_State *L){
     // check the number of arguments
-    if(lua_gettop(L) != 2){
-        lua_pushliteral(L, "grab_keyboard() requires two arguments");
+    int nargs = lua_gettop(L);
+    if(nargs != 2 && nargs != 3){
+        lua_pushliteral(L, "grab_keyboard() requires two or three arguments");
         goto fail;
     }
 
@@ -669,7 +1311,31 @@ int lua_grab_keyboard(lua_State *L){
         lua_pushliteral(L, "malloc failed");
         goto fail;
     }
-    *grab = (grab_t){.ignore=false};
+    // defaults match the kernel's own key repeat
+    *grab = (grab_t){
+        .ignore=false,
+        .repeat_delay_ms=250,
+        .repeat_interval_ms=33,
+    };
+
+    if(nargs > 2){
+        switch(read_grab_config(L, 3, grab)){
+            case 0: break;
+
+            case GRAB_INVALID_REPEAT_DELAY_MS:
+                lua_pushliteral(L, GRAB_INVALID_REPEAT_DELAY_MS_MSG);
+                goto fail_grab;
+
+            case GRAB_INVALID_REPEAT_INTERVAL_MS:
+                lua_pushliteral(L, GRAB_INVALID_REPEAT_INTERVAL_MS_MSG);
+                goto fail_grab;
+
+            case GRAB_CONFIG_BAD_TYPE:
+            default:
+                lua_pushliteral(L, GRAB_CONFIG_BAD_TYPE_MSG);
+                goto fail_grab;
+        }
+    }
 
     // copy the second argument
     if(copy_to_key_action(L, 2, &grab->map)){
@@ -683,8 +1349,12 @@ int lua_grab_keyboard(lua_State *L){
         goto fail_map;
     }
 
-    // fill in the KT_NONE values (which should have fall-through behavior)
-    fill_map(&grab->map, NULL);
+    // check how the KT_NONE values will fall through to the parent keymap
+    const key_map_t *ancestors[KEYMAP_MAX_DEPTH + 1];
+    if(check_map(grab->map.key.map, ancestors, 0, &grab->map_depth)){
+        lua_pushliteral(L, "grab_keyboard() failed to compile keymap");
+        goto fail_map;
+    }
 
     // compile the regex pattern
     size_t len;
@@ -696,6 +1366,13 @@ int lua_grab_keyboard(lua_State *L){
         lua_pushfstring(L, "failed to compile regex: %.*s", (int)errlen, err);
         goto fail_map;
     }
+    // kept for saving a compiled config
+    grab->pattern = strdup(pattern);
+    if(!grab->pattern){
+        regfree(&grab->regex);
+        lua_pushliteral(L, "strdup failed");
+        goto fail_map;
+    }
 
     // get the config from the lua_State
     lua_getglobal(L, "__config");
@@ -708,7 +1385,7 @@ int lua_grab_keyboard(lua_State *L){
     *last = grab;
 
     // pop the args and the __config
-    lua_pop(L, 3);
+    lua_pop(L, nargs + 1);
     return 0;
 
 fail_map:
@@ -750,6 +1427,12 @@ int lua_ignore_keyboard(lua_State *L){
         lua_pushfstring(L, "failed to compile regex: %.*s", (int)errlen, err);
         goto fail_grab;
     }
+    grab->pattern = strdup(pattern);
+    if(!grab->pattern){
+        regfree(&grab->regex);
+        lua_pushliteral(L, "strdup failed");
+        goto fail_grab;
+    }
 
     // get the config from the lua_State
     lua_getglobal(L, "__config");
@@ -774,6 +1457,7 @@ void grab_free(grab_t *grab){
     if(!grab) return;
 
     regfree(&grab->regex);
+    free(grab->pattern);
     key_action_free(&grab->map);
     grab_free(grab->next);
     free(grab);
@@ -793,6 +1477,9 @@ int set_lua_globals(config_t *config){
     lua_pushlightuserdata(L, config);
     lua_setglobal(L, "__config");
 
+    lua_newtable(L);
+    lua_rawsetp(L, LUA_REGISTRYINDEX, &converted_keymaps);
+
     // add c functions
     lua_pushcfunction(L, lua_print);
     lua_setglobal(L, "print");
@@ -823,6 +1510,15 @@ int set_lua_globals(config_t *config){
     lua_pushinteger(L, DUAL_MODE_TIMEOUT_ONLY);
     lua_setglobal(L, "TIMEOUT_ONLY");
 
+    lua_pushcfunction(L, lua_tap_dance);
+    lua_setglobal(L, "tap_dance");
+
+    lua_pushcfunction(L, lua_combo);
+    lua_setglobal(L, "combo");
+
+    lua_pushcfunction(L, lua_leader);
+    lua_setglobal(L, "leader");
+
     lua_pushcfunction(L, lua_grab_keyboard);
     lua_setglobal(L, "grab_keyboard");
 
@@ -838,7 +1534,180 @@ int set_lua_globals(config_t *config){
     return 0;
 }
 
-config_t *config_new(const char* config_file){
+/* copy everything the resolvers read into the arena, returning the roots (or
+   NULL while measuring).  The config is untouched, so this may run again into
+   another arena. */
+static config_roots_t *compact_config(config_t *config, key_compact_t *kc,
+        arena_t *a){
+    bool fill = a->base != NULL;
+    key_compact_init(kc, a);
+
+    config_roots_t *roots = arena_alloc(a, sizeof(*roots));
+    size_t n_maps = 0;
+    for(grab_t *g = config->grabs; g; g = g->next) n_maps++;
+    key_action_t *maps = arena_alloc(a, sizeof(*maps) * n_maps);
+    if(fill){
+        *roots = (config_roots_t){ .maps = maps, .n_maps = n_maps };
+    }
+
+    size_t n = 0;
+    for(grab_t *g = config->grabs; g; g = g->next, n++){
+        if(g->ignore){
+            if(fill) maps[n] = (key_action_t){0};
+            continue;
+        }
+        key_action_compact(kc, &g->map, fill ? &maps[n] : NULL);
+    }
+
+    if(config->combos){
+        combos_t *combos = arena_alloc(a, sizeof(*combos));
+        if(fill){
+            *combos = *config->combos;
+            roots->combos = combos;
+        }
+        for(size_t i = 0; i < config->combos->n; i++){
+            key_action_compact(kc, &config->combos->combos[i].action,
+                    fill ? &combos->combos[i].action : NULL);
+        }
+    }
+
+    if(config->leaders){
+        leaders_t *leaders = arena_alloc(a, sizeof(*leaders));
+        if(fill){
+            *leaders = *config->leaders;
+            roots->leaders = leaders;
+        }
+        for(size_t i = 0; i < config->leaders->n; i++){
+            leader_t *old = &config->leaders->leaders[i];
+            size_t n_next = old->n_nodes * old->n_alpha;
+            uint16_t *next = arena_alloc(a, sizeof(*next) * n_next);
+            struct leader_node *nodes = arena_alloc(a,
+                    sizeof(*nodes) * old->n_nodes);
+            for(size_t j = 0; j < old->n_nodes; j++){
+                key_action_compact(kc, &old->nodes[j].action,
+                        fill ? &nodes[j].action : NULL);
+                if(fill) nodes[j].has_next = old->nodes[j].has_next;
+            }
+            if(!fill) continue;
+            memcpy(next, old->next, sizeof(*next) * n_next);
+            leaders->leaders[i].next = next;
+            leaders->leaders[i].nodes = nodes;
+        }
+    }
+
+    return roots;
+}
+
+/* Compare two fills of the same arena at different addresses.  The only
+   words which differ are pointers into the arena, since nothing in it points
+   anywhere else; their offsets go in *relocs.  Return 0/-1 on success/error.
+   */
+static int find_relocs(const char *a, const char *b, size_t size,
+        size_t **relocs, size_t *n_relocs){
+    size_t n = 0;
+    size_t cap = 0;
+    *relocs = NULL;
+    for(size_t off = 0; off + sizeof(uintptr_t) <= size;
+            off += sizeof(uintptr_t)){
+        uintptr_t x, y;
+        memcpy(&x, a + off, sizeof(x));
+        memcpy(&y, b + off, sizeof(y));
+        if(x == y) continue;
+        if(x - (uintptr_t)a != y - (uintptr_t)b || x - (uintptr_t)a > size){
+            fprintf(stderr, "compacted config can't be relocated\n");
+            free(*relocs);
+            return -1;
+        }
+        if(n == cap){
+            cap = cap ? cap * 2 : 1024;
+            size_t *new = realloc(*relocs, sizeof(**relocs) * cap);
+            if(!new){
+                perror("realloc");
+                free(*relocs);
+                return -1;
+            }
+            *relocs = new;
+        }
+        (*relocs)[n++] = off;
+    }
+    *n_relocs = n;
+    return 0;
+}
+
+/* Once the config has run, nothing needs the lua_State or the keymaps as lua
+   built them, only the compiled lookups.  Move those into one allocation,
+   and free the rest.  If relocs is not NULL, a second copy is compacted
+   elsewhere to find the arena's pointers, as find_relocs() describes.
+   Return 0/-1 on success/error. */
+static int config_compact(config_t *config, size_t **relocs,
+        size_t *n_relocs){
+    arena_t a = {0};
+    key_compact_t kc = {0};
+    compact_config(config, &kc, &a);
+    if(kc.failed) goto fail;
+
+    a.size = a.used;
+    a.used = 0;
+    // zeroed, so that padding matches between copies
+    a.base = calloc(1, a.size);
+    if(!a.base){
+        perror("calloc");
+        goto fail;
+    }
+    config_roots_t *roots = compact_config(config, &kc, &a);
+
+    if(relocs){
+        arena_t b = { .base = calloc(1, a.size), .size = a.size };
+        if(!b.base){
+            perror("calloc");
+            free(a.base);
+            goto fail;
+        }
+        compact_config(config, &kc, &b);
+        int ret = find_relocs(a.base, b.base, a.size, relocs, n_relocs);
+        free(b.base);
+        if(ret){
+            free(a.base);
+            goto fail;
+        }
+    }
+    key_compact_free(&kc);
+
+    // the arena replaces everything lua built
+    size_t n = 0;
+    for(grab_t *g = config->grabs; g; g = g->next, n++){
+        key_action_free(&g->map);
+        g->map = roots->maps[n];
+    }
+    if(config->combos){
+        for(size_t i = 0; i < config->combos->n; i++){
+            key_action_free(&config->combos->combos[i].action);
+        }
+        free(config->combos);
+        config->combos = roots->combos;
+    }
+    if(config->leaders){
+        for(size_t i = 0; i < config->leaders->n; i++){
+            leader_free(&config->leaders->leaders[i]);
+        }
+        free(config->leaders);
+        config->leaders = roots->leaders;
+    }
+
+    config->arena = a.base;
+    config->arena_size = a.size;
+    config->roots = roots;
+    lua_close(config->L);
+    config->L = NULL;
+    return 0;
+
+fail:
+    key_compact_free(&kc);
+    return -1;
+}
+
+config_t *config_new_relocatable(const char* config_file, size_t **relocs,
+        size_t *n_relocs){
     config_t *config = malloc(sizeof(*config));
     if(!config) return NULL;
     *config = (config_t){0};
@@ -869,19 +1738,51 @@ config_t *config_new(const char* config_file){
         goto fail;
     }
 
+    if(config_compact(config, relocs, n_relocs)){
+        goto fail;
+    }
+
     return config;
 
 fail:
-    lua_close(config->L);
-    free(config);
+    config_free(config);
     return NULL;
 }
 
+config_t *config_new(const char* config_file){
+    return config_new_relocatable(config_file, NULL, NULL);
+}
+
 
 void config_free(config_t *config){
     if(!config) return;
 
-    lua_close(config->L);
+    if(config->L) lua_close(config->L);
+    if(config->arena){
+        // the arena holds everything these point to
+        for(grab_t *g = config->grabs; g; g = g->next){
+            g->map = (key_action_t){0};
+        }
+        config->combos = NULL;
+        config->leaders = NULL;
+        if(config->mapping){
+            munmap(config->mapping, config->mapping_size);
+        }else{
+            free(config->arena);
+        }
+    }
     grab_free(config->grabs);
+    if(config->combos){
+        for(size_t i = 0; i < config->combos->n; i++){
+            key_action_free(&config->combos->combos[i].action);
+        }
+        free(config->combos);
+    }
+    if(config->leaders){
+        for(size_t i = 0; i < config->leaders->n; i++){
+            leader_free(&config->leaders->leaders[i]);
+        }
+        free(config->leaders);
+    }
     free(config);
 }
@@ -4,27 +4,63 @@
 #include <regex.h>
 #include <lua.h>
 
+#include "combo.h"
 #include "key_action.h"
+#include "leader.h"
 #include "resolver.h"
 
 // a linked list of keyboard grabs or ignores passed by the user
 typedef struct grab_t {
     // a compliled regex pattern
     regex_t regex;
+    // the pattern regex was compiled from
+    char *pattern;
     bool ignore;
     // except when ignore==true, map will always have type == KT_MAP:
     key_action_t map;
+    // how deeply keymaps are nested in map; 0 means no layers at all
+    int map_depth;
+    // synthetic key repeat; an interval of 0 disables it
+    long repeat_delay_ms;
+    long repeat_interval_ms;
     struct grab_t *next;
     // initialized when the send_t is known, well after the config is read
     struct resolver resolver;
 } grab_t;
 
+/* where everything the resolvers read is found in the arena, which holds
+   nothing else that points outside of it */
 typedef struct {
+    // one for each grab, in order; KT_NONE for an ignore_keyboard()
+    key_action_t *maps;
+    size_t n_maps;
+    combos_t *combos;
+    leaders_t *leaders;
+} config_roots_t;
+
+typedef struct {
+    // only while loading; closed once the config is compacted
     lua_State *L;
+    /* every grab's keymap, the combos and the leaders, compacted into one
+       allocation once loading is done */
+    char *arena;
+    size_t arena_size;
+    config_roots_t *roots;
+    // the compiled config file holding the arena, if it was loaded from one
+    void *mapping;
+    size_t mapping_size;
     grab_t *grabs;
+    // combos apply to every grab; NULL if there are none
+    combos_t *combos;
+    // leader key sequences; NULL if there are none
+    leaders_t *leaders;
 } config_t;
 
 config_t *config_new(const char* config_file);
+/* config_new(), also returning the offset of every pointer in the arena, so
+   that it can be saved and loaded at another address.  Free *relocs after. */
+config_t *config_new_relocatable(const char* config_file, size_t **relocs,
+        size_t *n_relocs);
 void config_free(config_t *config);
 
 #endif // CONFIG_H
@@ -0,0 +1,421 @@
+#include "config_cache.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#define CC_MAGIC "sdiolcfg"
+// bump whenever what the arena holds changes, even if its sizes don't
+#define CC_VERSION 1
+// the arena starts at a multiple of this in the file
+#define CC_ALIGN 64
+
+typedef struct {
+    char magic[8];
+    uint32_t version;
+    // the layout of the arena in this build, which must match to load it
+    uint16_t ptr_size;
+    uint16_t key_max;
+    uint32_t key_action_size;
+    uint32_t roots_size;
+    uint32_t combos_size;
+    uint32_t leaders_size;
+    // of the lua file this was compiled from
+    uint64_t source_hash;
+    // followed by n_grabs cc_grab_t, then the patterns, then the relocations
+    uint64_t n_grabs;
+    // the patterns, each nul-terminated, padded to a multiple of 8
+    uint64_t strings_size;
+    // offsets into the arena of each pointer, which is stored as an offset
+    uint64_t n_relocs;
+    // from the start of the file
+    uint64_t arena_off;
+    uint64_t arena_size;
+    // of the config_roots_t, from the start of the arena
+    uint64_t roots_off;
+} cc_header_t;
+
+typedef struct {
+    // into the patterns
+    uint64_t pattern_off;
+    int64_t repeat_delay_ms;
+    int64_t repeat_interval_ms;
+    int32_t map_depth;
+    uint32_t ignore;
+} cc_grab_t;
+
+static cc_header_t header_for_build(void){
+    cc_header_t h = {
+        .version = CC_VERSION,
+        .ptr_size = sizeof(void*),
+        .key_max = KEY_MAX,
+        .key_action_size = sizeof(key_action_t),
+        .roots_size = sizeof(config_roots_t),
+        .combos_size = sizeof(combos_t),
+        .leaders_size = sizeof(leaders_t),
+    };
+    memcpy(h.magic, CC_MAGIC, sizeof(h.magic));
+    return h;
+}
+
+static uint64_t fnv1a(uint64_t h, const void *buf, size_t len){
+    const uint8_t *bytes = buf;
+    for(size_t i = 0; i < len; i++){
+        h = (h ^ bytes[i]) * 0x100000001b3;
+    }
+    return h;
+}
+
+/* FNV-1a of a file's contents, and whether it is a compiled config.
+   Returns 0 on success or -1 on error. */
+static int hash_file(const char *path, uint64_t *hash, bool *compiled){
+    FILE *f = fopen(path, "rb");
+    if(!f){
+        fprintf(stderr, "%s: %s\n", path, strerror(errno));
+        return -1;
+    }
+    uint64_t h = 0xcbf29ce484222325;
+    char buf[4096];
+    size_t len;
+    bool first = true;
+    *compiled = false;
+    while((len = fread(buf, 1, sizeof(buf), f)) > 0){
+        if(first){
+            *compiled = len >= sizeof(CC_MAGIC) - 1
+                && memcmp(buf, CC_MAGIC, sizeof(CC_MAGIC) - 1) == 0;
+            first = false;
+        }
+        h = fnv1a(h, buf, len);
+    }
+    int ret = ferror(f) ? -1 : 0;
+    if(ret) fprintf(stderr, "%s: read failed\n", path);
+    fclose(f);
+    *hash = h;
+    return ret;
+}
+
+static size_t align_up(size_t n, size_t align){
+    return (n + align - 1) / align * align;
+}
+
+/* write a compacted config, whose arena has pointers at each of relocs.  It
+   is written to a temporary file first, so that nobody can load half of
+   one.  Returns 0 on success or -1 on error. */
+static int write_compiled(const config_t *config, const size_t *relocs,
+        size_t n_relocs, uint64_t hash, const char *path){
+    int retval = -1;
+
+    cc_header_t h = header_for_build();
+    h.source_hash = hash;
+    h.n_relocs = n_relocs;
+    h.arena_size = config->arena_size;
+    h.roots_off = (uint64_t)((char*)config->roots - config->arena);
+    for(grab_t *g = config->grabs; g; g = g->next){
+        h.n_grabs++;
+        h.strings_size += strlen(g->pattern) + 1;
+    }
+    h.strings_size = align_up(h.strings_size, 8);
+    h.arena_off = align_up(sizeof(h) + h.n_grabs * sizeof(cc_grab_t)
+            + h.strings_size + h.n_relocs * sizeof(uint64_t), CC_ALIGN);
+
+    // the arena's pointers are written as offsets from its start
+    char *arena = malloc(config->arena_size);
+    if(!arena){
+        perror("malloc");
+        return -1;
+    }
+    memcpy(arena, config->arena, config->arena_size);
+    for(size_t i = 0; i < n_relocs; i++){
+        uintptr_t ptr;
+        memcpy(&ptr, arena + relocs[i], sizeof(ptr));
+        ptr -= (uintptr_t)config->arena;
+        memcpy(arena + relocs[i], &ptr, sizeof(ptr));
+    }
+
+    char tmp[PATH_MAX];
+    if(snprintf(tmp, sizeof(tmp), "%s.%d.tmp", path, (int)getpid())
+            >= (int)sizeof(tmp)){
+        fprintf(stderr, "%s: path too long\n", path);
+        goto cu_arena;
+    }
+    FILE *f = fopen(tmp, "wb");
+    if(!f){
+        fprintf(stderr, "%s: %s\n", tmp, strerror(errno));
+        goto cu_arena;
+    }
+
+    bool ok = fwrite(&h, sizeof(h), 1, f) == 1;
+    uint64_t pattern_off = 0;
+    for(grab_t *g = config->grabs; g; g = g->next){
+        cc_grab_t rec = {
+            .pattern_off = pattern_off,
+            .repeat_delay_ms = g->repeat_delay_ms,
+            .repeat_interval_ms = g->repeat_interval_ms,
+            .map_depth = g->map_depth,
+            .ignore = g->ignore,
+        };
+        ok &= fwrite(&rec, sizeof(rec), 1, f) == 1;
+        pattern_off += strlen(g->pattern) + 1;
+    }
+    for(grab_t *g = config->grabs; g; g = g->next){
+        ok &= fwrite(g->pattern, strlen(g->pattern) + 1, 1, f) == 1;
+    }
+    static const char zeros[CC_ALIGN];
+    ok &= fwrite(zeros, 1, h.strings_size - pattern_off, f)
+        == h.strings_size - pattern_off;
+    for(size_t i = 0; i < n_relocs; i++){
+        uint64_t off = relocs[i];
+        ok &= fwrite(&off, sizeof(off), 1, f) == 1;
+    }
+    size_t pad = h.arena_off - (size_t)ftell(f);
+    ok &= fwrite(zeros, 1, pad, f) == pad;
+    ok &= fwrite(arena, 1, h.arena_size, f) == h.arena_size;
+    if(fclose(f)) ok = false;
+    if(!ok){
+        fprintf(stderr, "%s: write failed\n", tmp);
+        unlink(tmp);
+        goto cu_arena;
+    }
+
+    if(rename(tmp, path)){
+        fprintf(stderr, "%s: %s\n", path, strerror(errno));
+        unlink(tmp);
+        goto cu_arena;
+    }
+    retval = 0;
+
+cu_arena:
+    free(arena);
+    return retval;
+}
+
+/* Map a compiled config and turn it back into a config_t.  If check_hash,
+   it must have been compiled from lua with that hash.  With quiet, nothing
+   is printed about files which are missing, stale, or unusable, since the
+   caller will just run the lua instead. */
+static config_t *load_compiled(const char *path, bool check_hash,
+        uint64_t hash, bool quiet){
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if(fd < 0){
+        if(!quiet) fprintf(stderr, "%s: %s\n", path, strerror(errno));
+        return NULL;
+    }
+    struct stat st;
+    if(fstat(fd, &st)){
+        if(!quiet) fprintf(stderr, "%s: %s\n", path, strerror(errno));
+        close(fd);
+        return NULL;
+    }
+    size_t size = (size_t)st.st_size;
+    if(size < sizeof(cc_header_t)){
+        if(!quiet) fprintf(stderr, "%s: not a compiled sdiol config\n", path);
+        close(fd);
+        return NULL;
+    }
+    // private, since the relocations write to it
+    char *map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if(map == MAP_FAILED){
+        if(!quiet) perror("mmap");
+        return NULL;
+    }
+
+    const cc_header_t *h = (const cc_header_t*)map;
+    cc_header_t want = header_for_build();
+    if(memcmp(h->magic, want.magic, sizeof(want.magic)) != 0){
+        if(!quiet) fprintf(stderr, "%s: not a compiled sdiol config\n", path);
+        goto fail_map;
+    }
+    if(h->version != want.version || h->ptr_size != want.ptr_size
+            || h->key_max != want.key_max
+            || h->key_action_size != want.key_action_size
+            || h->roots_size != want.roots_size
+            || h->combos_size != want.combos_size
+            || h->leaders_size != want.leaders_size){
+        if(!quiet){
+            fprintf(stderr, "%s: compiled by an incompatible sdiol, "
+                    "compile it again\n", path);
+        }
+        goto fail_map;
+    }
+    if(check_hash && h->source_hash != hash) goto fail_map;
+
+    // every section must be inside the file, in order
+    if(h->n_grabs > size / sizeof(cc_grab_t)
+            || h->n_relocs > size / sizeof(uint64_t)
+            || h->strings_size > size){
+        goto corrupt;
+    }
+    size_t grabs_off = sizeof(*h);
+    size_t strings_off = grabs_off + h->n_grabs * sizeof(cc_grab_t);
+    size_t relocs_off = strings_off + h->strings_size;
+    size_t relocs_end = relocs_off + h->n_relocs * sizeof(uint64_t);
+    if(relocs_off % sizeof(uint64_t)
+            || relocs_end > h->arena_off
+            || h->arena_off % CC_ALIGN
+            || h->arena_off > size
+            || h->arena_size > size - h->arena_off
+            || h->roots_off % _Alignof(config_roots_t)
+            || h->roots_off > h->arena_size
+            || h->arena_size - h->roots_off < sizeof(config_roots_t)){
+        goto corrupt;
+    }
+    const cc_grab_t *recs = (const cc_grab_t*)(map + grabs_off);
+    const char *strings = map + strings_off;
+    const uint64_t *relocs = (const uint64_t*)(map + relocs_off);
+    char *arena = map + h->arena_off;
+
+    // turn offsets back into pointers
+    for(size_t i = 0; i < h->n_relocs; i++){
+        uint64_t off = relocs[i];
+        if(off % sizeof(uintptr_t) || off > h->arena_size - sizeof(uintptr_t)){
+            goto corrupt;
+        }
+        uintptr_t *slot = (uintptr_t*)(arena + off);
+        if(*slot > h->arena_size) goto corrupt;
+        *slot += (uintptr_t)arena;
+    }
+
+    config_t *config = malloc(sizeof(*config));
+    if(!config){
+        perror("malloc");
+        goto fail_map;
+    }
+    config_roots_t *roots = (config_roots_t*)(arena + h->roots_off);
+    *config = (config_t){
+        .arena = arena,
+        .arena_size = h->arena_size,
+        .roots = roots,
+        .mapping = map,
+        .mapping_size = size,
+        .combos = roots->combos,
+        .leaders = roots->leaders,
+    };
+    // from here on, config_free() unmaps the file
+    if(roots->n_maps != h->n_grabs) goto corrupt_config;
+
+    grab_t **last = &config->grabs;
+    for(size_t i = 0; i < h->n_grabs; i++){
+        const cc_grab_t *rec = &recs[i];
+        if(rec->pattern_off >= h->strings_size
+                || !memchr(strings + rec->pattern_off, '\0',
+                    h->strings_size - rec->pattern_off)){
+            goto corrupt_config;
+        }
+        grab_t *grab = malloc(sizeof(*grab));
+        if(!grab){
+            perror("malloc");
+            goto fail_config;
+        }
+        *grab = (grab_t){
+            .ignore = rec->ignore,
+            .map_depth = rec->map_depth,
+            .repeat_delay_ms = rec->repeat_delay_ms,
+            .repeat_interval_ms = rec->repeat_interval_ms,
+        };
+        grab->pattern = strdup(strings + rec->pattern_off);
+        if(!grab->pattern){
+            perror("strdup");
+            free(grab);
+            goto fail_config;
+        }
+        int ret = regcomp(&grab->regex, grab->pattern,
+                REG_EXTENDED | REG_ICASE);
+        if(ret){
+            char err[1024];
+            regerror(ret, &grab->regex, err, sizeof(err));
+            fprintf(stderr, "failed to compile regex: %s\n", err);
+            free(grab->pattern);
+            free(grab);
+            goto fail_config;
+        }
+        grab->map = roots->maps[i];
+        *last = grab;
+        last = &grab->next;
+    }
+
+    return config;
+
+corrupt_config:
+    if(!quiet) fprintf(stderr, "%s: corrupt compiled config\n", path);
+fail_config:
+    config_free(config);
+    return NULL;
+
+corrupt:
+    if(!quiet) fprintf(stderr, "%s: corrupt compiled config\n", path);
+fail_map:
+    munmap(map, size);
+    return NULL;
+}
+
+int config_compile(const char *config_file, const char *out_path){
+    uint64_t hash;
+    bool compiled;
+    if(hash_file(config_file, &hash, &compiled)) return -1;
+    if(compiled){
+        fprintf(stderr, "%s is already compiled\n", config_file);
+        return -1;
+    }
+
+    size_t *relocs;
+    size_t n_relocs;
+    config_t *config = config_new_relocatable(config_file, &relocs, &n_relocs);
+    if(!config) return -1;
+
+    int ret = write_compiled(config, relocs, n_relocs, hash, out_path);
+
+    free(relocs);
+    config_free(config);
+    return ret;
+}
+
+config_t *config_open(const char *config_file, const char *cache_dir,
+        bool verbose){
+    uint64_t hash;
+    bool compiled;
+    if(hash_file(config_file, &hash, &compiled)) return NULL;
+    if(compiled) return load_compiled(config_file, false, 0, false);
+    if(!cache_dir) return config_new(config_file);
+
+    /* one cache entry per config file, named for its path, which is replaced
+       whenever the contents' hash no longer matches */
+    char real[PATH_MAX];
+    const char *abs = realpath(config_file, real);
+    if(!abs) abs = config_file;
+    char path[PATH_MAX];
+    uint64_t name = fnv1a(0xcbf29ce484222325, abs, strlen(abs));
+    if(snprintf(path, sizeof(path), "%s/%016" PRIx64 ".sdc", cache_dir, name)
+            >= (int)sizeof(path)){
+        return config_new(config_file);
+    }
+
+    config_t *config = load_compiled(path, true, hash, true);
+    if(config){
+        if(verbose) printf("loaded %s from %s\n", config_file, path);
+        return config;
+    }
+
+    // run the lua, and cache the result for next time
+    size_t *relocs;
+    size_t n_relocs;
+    config = config_new_relocatable(config_file, &relocs, &n_relocs);
+    if(!config) return NULL;
+    if(access(cache_dir, W_OK) == 0){
+        if(!write_compiled(config, relocs, n_relocs, hash, path) && verbose){
+            printf("cached %s at %s\n", config_file, path);
+        }
+    }else if(verbose){
+        printf("not caching %s: %s: %s\n", config_file, cache_dir,
+                strerror(errno));
+    }
+    free(relocs);
+    return config;
+}
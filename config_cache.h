@@ -0,0 +1,31 @@
+#ifndef CONFIG_CACHE_H
+#define CONFIG_CACHE_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "config.h"
+
+/* Compiled configs, written by `sdiol compile` and by the config cache.  A
+   compiled config is a header, the grabs and their patterns, and the config's
+   arena with its pointers stored as offsets, in native byte order and native
+   struct layout.  Loading one maps the file, turns the offsets listed in its
+   relocation table back into pointers, and recompiles the regexes; no lua
+   runs at all.  The header records the build's layout, so a file from an
+   incompatible build is refused rather than misread. */
+
+#define CONFIG_CACHE_DIR "/var/cache/sdiol"
+
+/* compile config_file into a compiled config at out_path; returns 0 on
+   success or -1 on error */
+int config_compile(const char *config_file, const char *out_path);
+
+/* Load a config file, which is either lua or a compiled config.  For lua,
+   if cache_dir is not NULL, a compiled copy is kept there, named for a hash
+   of the file's contents, and used instead of running the lua whenever the
+   contents are unchanged.  Returns NULL on error. */
+config_t *config_open(const char *config_file, const char *cache_dir,
+        bool verbose);
+
+#endif // CONFIG_CACHE_H
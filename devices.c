@@ -11,10 +11,10 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
-#include <sys/inotify.h>
 #include <sys/select.h>
 #include <sys/stat.h>
 #include <sys/types.h>
+#include <time.h>
 #include <unistd.h>
 
 void enable_ev_key_value(void *arg, const char *name, uint16_t val){
@@ -70,14 +70,29 @@ grab_t *check_grabs(grab_t *grabs, const char *name){
     return NULL;
 }
 
-// return true if we decided to grab the device
-static bool open_input(char *dev, grab_t *grabs, int *fd_out,
-        grab_t **grab_out, bool verbose){
-    *grab_out = NULL;
-    int fd = open(dev, O_RDWR);
+/* turn off the device's own key repeat, since the kernel can't know how we
+   remapped keys; the resolver generates repeats instead */
+static void disable_repeat(keyboard_t *kb){
+    kb->rep_saved = ioctl(kb->fd, EVIOCGREP, kb->rep) == 0;
+    // devices without EV_REP have nothing to disable
+    if(!kb->rep_saved) return;
+    unsigned int rep[2] = { kb->rep[0], 0 };
+    if(ioctl(kb->fd, EVIOCSREP, rep) < 0){
+        perror("EVIOCSREP");
+        kb->rep_saved = false;
+    }
+}
+
+open_input_t open_input(const char *dev, grab_t *grabs, keyboard_t *kb,
+        bool verbose){
+    // non-blocking, so the serve_loop can drain each device until EAGAIN
+    int fd = open(dev, O_RDWR | O_NONBLOCK);
     if (fd < 0) {
+        if(errno == EACCES || errno == EPERM){
+            return OPEN_INPUT_NOT_READY;
+        }
         fprintf(stderr, "%s: %s\n", dev, strerror(errno));
-        return false;
+        return OPEN_INPUT_SKIPPED;
     }
 
     char buf[256];
@@ -87,21 +102,41 @@ static bool open_input(char *dev, grab_t *grabs, int *fd_out,
         if(verbose){
             printf("grabbing %s\n", buf);
         }
+        // the resolver's timing assumes monotonic event timestamps
+        int clk = CLOCK_MONOTONIC;
+        if(ioctl(fd, EVIOCSCLOCKID, &clk) < 0){
+            fprintf(stderr, "%s: EVIOCSCLOCKID: %s\n", dev, strerror(errno));
+            close(fd);
+            return OPEN_INPUT_SKIPPED;
+        }
         int ret = ioctl(fd, EVIOCGRAB, 1);
         if (ret < 0) {
             fprintf(stderr, "%s: %s\n", dev, strerror(errno));
             close(fd);
-            return false;
+            return OPEN_INPUT_SKIPPED;
         } else {
-            *fd_out = fd;
-            *grab_out = grab;
-            return true;
+            *kb = (keyboard_t){
+                .fd = fd,
+                .grab = grab,
+                .reader = NULL,
+                .trace_id = -1,
+            };
+            snprintf(kb->dev, sizeof(kb->dev), "%s", dev);
+            disable_repeat(kb);
+            return OPEN_INPUT_GRABBED;
         }
     }
     if(verbose){
         printf("ignoring %s\n", buf);
     }
-    return false;
+    close(fd);
+    return OPEN_INPUT_SKIPPED;
+}
+
+void close_input(keyboard_t *kb){
+    // if the device was unplugged, this fails harmlessly
+    if(kb->rep_saved) ioctl(kb->fd, EVIOCSREP, kb->rep);
+    close(kb->fd);
 }
 
 void open_inputs(keyboard_t *kbs, int *n_kbs, grab_t *grabs, bool verbose){
@@ -118,61 +153,17 @@ void open_inputs(keyboard_t *kbs, int *n_kbs, grab_t *grabs, bool verbose){
         snprintf(dev, sizeof(dev), "/dev/input/%s", ent->d_name);
 
         if(*n_kbs < MAX_KBS){
-            int fd;
-            grab_t *grab;
-            if(!open_input(dev, grabs, &fd, &grab, verbose))
-                continue;
-
-            keyboard_t kb;
-            kb.fd = fd;
-            kb.grab = grab;
-
-            kbs[(*n_kbs)++] = kb;
+            switch(open_input(dev, grabs, &kbs[*n_kbs], verbose)){
+                case OPEN_INPUT_GRABBED:
+                    (*n_kbs)++;
+                    break;
+                case OPEN_INPUT_NOT_READY:
+                    fprintf(stderr, "%s: %s\n", dev, strerror(errno));
+                    break;
+                case OPEN_INPUT_SKIPPED:
+                    break;
+            }
         }
     }
     closedir(d);
 }
-
-void handle_inotify_events(int inot, keyboard_t *kbs, int* n_kbs,
-        grab_t *grabs, bool verbose){
-    // most of this section is straight from `man 7 inotify`
-    char buf[4096] __attribute__ ((aligned(__alignof__(struct inotify_event))));
-    const struct inotify_event *event;
-
-    ssize_t len = read(inot, buf, sizeof(buf));
-    if(len == -1 && errno != EAGAIN){
-        perror("read");
-        exit(3);
-    }
-
-    // EAGAIN means we are out of events for now.
-    if(len <= 0) return;
-
-    // read all the events we just got
-    for(char *ptr = buf; ptr < buf + len;
-            ptr += sizeof(struct inotify_event) + event->len){
-        event = (const struct inotify_event *)ptr;
-
-        if(*n_kbs < MAX_KBS){
-            char dev[512];
-            snprintf(dev, sizeof(dev), "/dev/input/%s", event->name);
-            int fd;
-            grab_t *grab;
-            if(!open_input(dev, grabs, &fd, &grab, verbose))
-                continue;
-
-            keyboard_t kb;
-            kb.fd = fd;
-            kb.grab = grab;
-
-            kbs[(*n_kbs)++] = kb;
-        }
-    }
-}
-
-int open_inotify() {
-  int inot = inotify_init();
-  inotify_add_watch(inot, "/dev/input", IN_CREATE);
-
-  return inot;
-}
@@ -2,20 +2,54 @@
 #define DEVICES_H
 
 #include <stdbool.h>
+#include <stdint.h>
+#include <linux/input.h>
+
 #include "config.h"
+#include "reader.h"
 
 #define MAX_KBS 16
 
+// the most input_events we will read() from a device at once
+#define READ_BATCH 64
+
 typedef struct {
     int fd;
     grab_t *grab;
+    // the thread reading fd, or NULL if the serve_loop reads it directly
+    reader_t *reader;
+    // the device's id in the trace being recorded (sdiol record), or -1
+    int trace_id;
+    // the /dev/input path it was opened from
+    char dev[64];
+    /* a bit for each key the device is holding down, so if the device goes
+       away we can release exactly the keys it pressed */
+    uint8_t pressed[(KEY_MAX + 7) / 8];
+    /* the device's own key repeat settings (REP_DELAY, REP_PERIOD), restored
+       when we let go of it, since sdiol generates repeats itself */
+    unsigned int rep[2];
+    bool rep_saved;
 } keyboard_t;
 
 int open_output(void);
+// the grab for a device name, or NULL if it should not be grabbed
+grab_t *check_grabs(grab_t *grabs, const char *name);
 bool device_name_check(const char *name);
+
+typedef enum {
+    OPEN_INPUT_GRABBED,
+    // not a device to grab, or it failed to open
+    OPEN_INPUT_SKIPPED,
+    /* the device node denied us access, which for a new node usually means
+       udev has not set its permissions yet; errno is left set */
+    OPEN_INPUT_NOT_READY,
+} open_input_t;
+
+// open dev and fill in kb, if we should grab it
+open_input_t open_input(const char *dev, grab_t *grabs, keyboard_t *kb,
+        bool verbose);
+// restore the device's key repeat and close it
+void close_input(keyboard_t *kb);
 void open_inputs(keyboard_t *kbs, int *n_kbs, grab_t *grabs, bool verbose);
-void handle_inotify_events(int inot, keyboard_t *kbs, int* n_kbs,
-        grab_t *grabs, bool verbose);
-int open_inotify();
 
 #endif // DEVICES_H
@@ -0,0 +1,189 @@
+#include "hotplug.h"
+#include "app.h"
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/inotify.h>
+#include <sys/timerfd.h>
+
+#define INPUT_DIR "/dev/input"
+
+int hotplug_init(hotplug_t *h, int epfd){
+    *h = (hotplug_t){ .inot = -1, .timer = -1 };
+
+    h->inot = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if(h->inot < 0){
+        perror("inotify_init1");
+        return -1;
+    }
+    // IN_ATTRIB is how we hear that udev has set a new node's permissions
+    int ret = inotify_add_watch(
+        h->inot, INPUT_DIR, IN_CREATE | IN_DELETE | IN_ATTRIB
+    );
+    if(ret < 0){
+        perror("inotify_add_watch");
+        goto cu_inot;
+    }
+
+    h->timer = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    if(h->timer < 0){
+        perror("timerfd_create");
+        goto cu_inot;
+    }
+
+    if(epoll_watch(epfd, EPOLL_CTL_ADD, h->inot, EPOLLIN,
+                EPOLL_TAG_INOTIFY, HOTPLUG_FD_INOTIFY)
+            || epoll_watch(epfd, EPOLL_CTL_ADD, h->timer, EPOLLIN,
+                EPOLL_TAG_INOTIFY, HOTPLUG_FD_TIMER)){
+        perror("epoll_ctl");
+        goto cu_timer;
+    }
+
+    return 0;
+
+cu_timer:
+    close(h->timer);
+    h->timer = -1;
+cu_inot:
+    close(h->inot);
+    h->inot = -1;
+    return -1;
+}
+
+void hotplug_free(hotplug_t *h){
+    if(h->timer > -1) close(h->timer);
+    if(h->inot > -1) close(h->inot);
+    h->timer = -1;
+    h->inot = -1;
+}
+
+static struct hotplug_pending *find_pending(hotplug_t *h, const char *dev){
+    for(size_t i = 0; i < h->n_pending; i++){
+        if(strcmp(h->pending[i].dev, dev) == 0) return &h->pending[i];
+    }
+    return NULL;
+}
+
+static void drop_pending(hotplug_t *h, struct hotplug_pending *p){
+    *p = h->pending[--h->n_pending];
+}
+
+/* (re)start the quiet period of a device node.  Any change to the node
+   counts as progress, so its retries start over too. */
+static void settle(hotplug_t *h, const char *dev, nstime_t when){
+    struct hotplug_pending *p = find_pending(h, dev);
+    if(!p){
+        if(h->n_pending == HOTPLUG_PENDING_MAX){
+            fprintf(stderr, "too many new devices, ignoring %s\n", dev);
+            return;
+        }
+        p = &h->pending[h->n_pending++];
+        snprintf(p->dev, sizeof(p->dev), "%s", dev);
+    }
+    p->when = when;
+    p->tries = 0;
+}
+
+// point the timer at the earliest pending device, or disarm it
+static void rearm(hotplug_t *h){
+    nstime_t when = 0;
+    for(size_t i = 0; i < h->n_pending; i++){
+        if(!when || h->pending[i].when < when){
+            when = h->pending[i].when;
+        }
+    }
+    if(when == h->armed) return;
+
+    // a zero it_value disarms the timer
+    struct itimerspec its = { .it_value = nstime_to_timespec(when) };
+    if(timerfd_settime(h->timer, TFD_TIMER_ABSTIME, &its, NULL)){
+        perror("timerfd_settime");
+        return;
+    }
+    h->armed = when;
+}
+
+static void handle_inotify(hotplug_t *h, const hotplug_cbs_t *cbs){
+    // most of this section is straight from `man 7 inotify`
+    char buf[4096]
+        __attribute__ ((aligned(__alignof__(struct inotify_event))));
+    const struct inotify_event *event;
+
+    nstime_t settled = nstime_now() + msec_to_ns(HOTPLUG_DEBOUNCE_MS);
+
+    while(true){
+        ssize_t len = read(h->inot, buf, sizeof(buf));
+        if(len == -1 && errno == EINTR) continue;
+        if(len == -1 && errno != EAGAIN){
+            perror("read");
+            exit(3);
+        }
+
+        // EAGAIN means we are out of events for now.
+        if(len <= 0) break;
+
+        for(char *ptr = buf; ptr < buf + len;
+                ptr += sizeof(struct inotify_event) + event->len){
+            event = (const struct inotify_event *)ptr;
+
+            // only evdev nodes, not js*, mouse*, or the by-* directories
+            if(!event->len || strncmp(event->name, "event", 5) != 0){
+                continue;
+            }
+            char dev[64];
+            snprintf(dev, sizeof(dev), "%s/%s", INPUT_DIR, event->name);
+
+            if(event->mask & IN_DELETE){
+                struct hotplug_pending *p = find_pending(h, dev);
+                if(p) drop_pending(h, p);
+                cbs->remove(cbs->arg, dev);
+                continue;
+            }
+            // IN_CREATE or IN_ATTRIB
+            settle(h, dev, settled);
+        }
+    }
+
+    rearm(h);
+}
+
+// try to open every device which has settled
+static void handle_timer(hotplug_t *h, const hotplug_cbs_t *cbs){
+    uint64_t expirations;
+    read(h->timer, &expirations, sizeof(expirations));
+    h->armed = 0;
+
+    nstime_t now = nstime_now();
+    size_t i = 0;
+    while(i < h->n_pending){
+        struct hotplug_pending *p = &h->pending[i];
+        if(p->when > now){
+            i++;
+            continue;
+        }
+        if(cbs->open(cbs->arg, p->dev) == HOTPLUG_DONE){
+            drop_pending(h, p);
+            continue;
+        }
+        if(++p->tries == HOTPLUG_RETRIES){
+            fprintf(stderr, "%s: still not ready, giving up\n", p->dev);
+            drop_pending(h, p);
+            continue;
+        }
+        p->when = now + msec_to_ns(HOTPLUG_RETRY_MS << (p->tries - 1));
+        i++;
+    }
+
+    rearm(h);
+}
+
+void hotplug_handle(hotplug_t *h, uint32_t val, const hotplug_cbs_t *cbs){
+    if(val == HOTPLUG_FD_TIMER){
+        handle_timer(h, cbs);
+    }else{
+        handle_inotify(h, cbs);
+    }
+}
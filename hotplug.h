@@ -0,0 +1,69 @@
+#ifndef HOTPLUG_H
+#define HOTPLUG_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "time_util.h"
+
+/* Watches /dev/input for event devices coming and going, without ever
+   rescanning the directory.  A new node is not opened right away: udev
+   creates it before setting its permissions, and a USB hub announces all of
+   its devices in a burst, so each node waits until it has been quiet for
+   HOTPLUG_DEBOUNCE_MS.  Opens which fail because the node is not ready yet are
+   retried with backoff, and again whenever the node's attributes change.
+
+   The inotify fd and a timerfd both sit in the serve_loop's epoll set, tagged
+   with EPOLL_TAG_INOTIFY and the HOTPLUG_FD_* values. */
+
+#define HOTPLUG_PENDING_MAX 32
+#define HOTPLUG_DEBOUNCE_MS 50
+// the first retry delay, which doubles after each failure
+#define HOTPLUG_RETRY_MS 100
+#define HOTPLUG_RETRIES 6
+
+enum {
+    HOTPLUG_FD_INOTIFY,
+    HOTPLUG_FD_TIMER,
+};
+
+typedef enum {
+    // the device was opened, or was not one to grab
+    HOTPLUG_DONE,
+    // the device can't be opened yet, try again later
+    HOTPLUG_NOT_READY,
+} hotplug_result_t;
+
+typedef struct {
+    // called with a /dev/input path once it has settled
+    hotplug_result_t (*open)(void *arg, const char *dev);
+    // called with a /dev/input path which was deleted
+    void (*remove)(void *arg, const char *dev);
+    void *arg;
+} hotplug_cbs_t;
+
+// a device node waiting to be opened
+struct hotplug_pending {
+    char dev[64];
+    nstime_t when;
+    int tries;
+};
+
+typedef struct {
+    int inot;
+    int timer;
+    // the timer's current expiration, or 0 if disarmed
+    nstime_t armed;
+    struct hotplug_pending pending[HOTPLUG_PENDING_MAX];
+    size_t n_pending;
+} hotplug_t;
+
+// returns 0 on success or -1 on error
+int hotplug_init(hotplug_t *h, int epfd);
+void hotplug_free(hotplug_t *h);
+
+// call when an fd tagged with EPOLL_TAG_INOTIFY is ready
+void hotplug_handle(hotplug_t *h, uint32_t val, const hotplug_cbs_t *cbs);
+
+#endif // HOTPLUG_H
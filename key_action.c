@@ -1,6 +1,7 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdbool.h>
+#include <string.h>
 
 #include "key_action.h"
 #include "names.h"
@@ -11,10 +12,12 @@ key_macro_t *key_macro_new(int code, bool press){
     *macro = (key_macro_t){0};
     macro->code = code;
     macro->press = press;
+    macro->refs = 1;
     return macro;
 }
 
 void key_macro_free(key_macro_t *macro){
+    if(!macro || --macro->refs) return;
     key_macro_t *next;
     for(; macro != NULL; macro = next){
         next = macro->next;
@@ -42,6 +45,65 @@ key_macro_t *key_macro_dup(key_macro_t *macro){
     return copy;
 }
 
+key_map_t *key_map_new(size_t n){
+    key_map_t *map = malloc(sizeof(*map) + sizeof(*map->keys) * n);
+    if(!map) return NULL;
+    map->refs = 1;
+    map->n = 0;
+    return map;
+}
+
+void key_map_free(key_map_t *map){
+    if(!map || --map->refs) return;
+    for(size_t i = 0; i < map->n; i++){
+        key_action_free(&map->keys[i].action);
+    }
+    free(map);
+}
+
+static int binding_cmp(const void *a, const void *b){
+    const struct key_binding *x = a;
+    const struct key_binding *y = b;
+    return (x->code > y->code) - (x->code < y->code);
+}
+
+int key_map_sort(key_map_t *map){
+    qsort(map->keys, map->n, sizeof(*map->keys), binding_cmp);
+    for(size_t i = 1; i < map->n; i++){
+        if(map->keys[i].code == map->keys[i - 1].code){
+            fprintf(stderr, "key %s is mapped twice in one keymap\n",
+                    get_input_name((uint16_t)map->keys[i].code));
+            return -1;
+        }
+    }
+    return 0;
+}
+
+const key_action_t *key_map_find(const key_map_t *map, int i){
+    size_t lo = 0, hi = map->n;
+    while(lo < hi){
+        size_t mid = (lo + hi) / 2;
+        if(map->keys[mid].code < i){
+            lo = mid + 1;
+        }else{
+            hi = mid;
+        }
+    }
+    if(lo < map->n && map->keys[lo].code == i) return &map->keys[lo].action;
+    return NULL;
+}
+
+void key_dance_free(key_dance_t *dance){
+    if(!dance || --dance->refs) return;
+    for(size_t i = 0; i < dance->n; i++){
+        if(dance->taps) key_action_free(&dance->taps[i]);
+        if(dance->holds) key_action_free(&dance->holds[i]);
+    }
+    free(dance->taps);
+    free(dance->holds);
+    free(dance);
+}
+
 void key_action_free(key_action_t *ka){
     if(!ka) return;
 
@@ -58,10 +120,10 @@ void key_action_free(key_action_t *ka){
             free(ka->key.dual.hold);
             break;
         case KT_MAP:
-            for(size_t i = 0; i < KEY_MAX; i++){
-                key_action_free(&ka->key.map[i]);
-            }
-            free(ka->key.map);
+            key_map_free(ka->key.map);
+            break;
+        case KT_DANCE:
+            key_dance_free(ka->key.dance);
             break;
     }
     *ka = (key_action_t){0};
@@ -72,9 +134,8 @@ int key_action_dup(const key_action_t *in, key_action_t *out){
         case KT_NONE:   *out = *in; break;
         case KT_SIMPLE: *out = *in; break;
         case KT_MACRO:
-            out->key.macro = key_macro_dup(in->key.macro);
-            if(!out->key.macro) goto fail;
-            out->type = KT_MACRO;
+            *out = *in;
+            out->key.macro->refs++;
             break;
         case KT_DUAL:
             // match type and mode
@@ -102,21 +163,12 @@ int key_action_dup(const key_action_t *in, key_action_t *out){
             }
             break;
         case KT_MAP:
-            // match type
-            out->type = in->type;
-            // alloc map
-            out->key.map = malloc(sizeof(*out->key.map) * KEY_MAX);
-            if(!out->key.map) goto fail;
-            // duplicate map elements
-            for(size_t i = 0; i < KEY_MAX; i++){
-                if(key_action_dup(&in->key.map[i], &out->key.map[i])){
-                    for(size_t ii = 0; ii < i; i++){
-                        key_action_free(&out->key.map[ii]);
-                    }
-                    free(out->key.map);
-                    goto fail;
-                }
-            }
+            *out = *in;
+            out->key.map->refs++;
+            break;
+        case KT_DANCE:
+            *out = *in;
+            out->key.dance->refs++;
             break;
     }
     return 0;
@@ -126,26 +178,288 @@ fail:
     return -1;
 }
 
-key_action_t *key_action_get(key_action_t *ka, int i){
-    for(size_t tries = 0; tries < 32; tries++){
+
+void key_compact_init(key_compact_t *c, arena_t *arena){
+    c->arena = arena;
+    c->n_memo = 0;
+    c->simple = arena_alloc(arena, sizeof(*c->simple) * KEY_MAX);
+    if(!c->simple) return;
+    for(int i = 0; i < KEY_MAX; i++){
+        c->simple[i] = (key_action_t){.type=KT_SIMPLE, .key={.simple=i}};
+    }
+}
+
+void key_compact_free(key_compact_t *c){
+    free(c->memo);
+    *c = (key_compact_t){0};
+}
+
+static struct key_compact_memo *memo_find(key_compact_t *c, const void *src,
+        long parent){
+    for(size_t i = 0; i < c->n_memo; i++){
+        if(c->memo[i].src == src && c->memo[i].parent == parent){
+            return &c->memo[i];
+        }
+    }
+    return NULL;
+}
+
+/* Remember a compacted copy.  The memo only grows while measuring, since
+   filling makes the same entries in the same order. */
+static struct key_compact_memo *memo_add(key_compact_t *c, const void *src,
+        long parent, void *out){
+    if(c->n_memo == c->cap_memo){
+        size_t cap = c->cap_memo ? c->cap_memo * 2 : 64;
+        void *memo = realloc(c->memo, sizeof(*c->memo) * cap);
+        if(!memo){
+            perror("realloc");
+            c->failed = true;
+            return NULL;
+        }
+        c->memo = memo;
+        c->cap_memo = cap;
+    }
+    struct key_compact_memo *memo = &c->memo[c->n_memo++];
+    *memo = (struct key_compact_memo){
+        .src = src, .parent = parent, .out = out,
+    };
+    return memo;
+}
+
+/* Lay out a macro's steps as key events, in order.  A frame may hold any
+   number of keys, but only one event for each, or a press and release of the
+   same key would arrive together; the frame ends at the first key which
+   repeats, and after the last step.  Returns the number of events, and only
+   counts if out is NULL. */
+static size_t flatten_macro(const key_macro_t *in, struct input_event *out){
+    uint8_t in_frame[(KEY_MAX + 7) / 8] = {0};
+    size_t n = 0;
+    for(const key_macro_t *step = in; step; step = step->next){
+        uint8_t bit = (uint8_t)(1 << (step->code % 8));
+        if(in_frame[step->code / 8] & bit){
+            if(out) out[n] = (struct input_event){
+                .type = EV_SYN, .code = SYN_REPORT,
+            };
+            n++;
+            memset(in_frame, 0, sizeof(in_frame));
+        }
+        in_frame[step->code / 8] |= bit;
+        if(out) out[n] = (struct input_event){
+            .type = EV_KEY, .code = (uint16_t)step->code, .value = step->press,
+        };
+        n++;
+    }
+    if(n){
+        if(out) out[n] = (struct input_event){
+            .type = EV_SYN, .code = SYN_REPORT,
+        };
+        n++;
+    }
+    return n;
+}
+
+static key_events_t *compact_macro(key_compact_t *c, const key_macro_t *in){
+    struct key_compact_memo *memo = memo_find(c, in, -1);
+    if(memo) return memo->out;
+
+    size_t n = flatten_macro(in, NULL);
+    key_events_t *events = arena_alloc(c->arena,
+            sizeof(*events) + sizeof(*events->evs) * n);
+    if(events){
+        events->n = flatten_macro(in, events->evs);
+    }
+    memo_add(c, in, -1, events);
+    return events;
+}
+
+/* where an action being compacted sits: the keymap holding it (and its memo
+   index), that keymap's parent, and the key code.  The keymaps are NULL while
+   measuring, and at the root. */
+struct compact_at {
+    const key_action_t *map;
+    long map_idx;
+    const key_action_t *parent;
+    int code;
+};
+
+static void compact_value(key_compact_t *c, const key_action_t *in,
+        key_action_t *out, struct compact_at at);
+static void compact_map(key_compact_t *c, const key_map_t *in,
+        key_action_t *out, const key_action_t *parent, long idx);
+
+/* the memo of keymap in under the parent keymap with memo index parent; its
+   node is allocated the first time, and filled in by whoever first finds it
+   unfilled.  Returns NULL if out of memory. */
+static struct key_compact_memo *map_memo(key_compact_t *c,
+        const key_map_t *in, long parent){
+    struct key_compact_memo *memo = memo_find(c, in, parent);
+    if(memo) return memo;
+    return memo_add(c, in, parent, arena_alloc(c->arena, sizeof(key_action_t)));
+}
+
+// fill in a keymap's memo, if nobody has yet, and return its node
+static key_action_t *map_fill(key_compact_t *c, struct key_compact_memo *memo,
+        const key_action_t *parent){
+    if(!memo) return NULL;
+    key_action_t *node = memo->out;
+    if(!memo->filled){
+        memo->filled = true;
+        // the memo may move while compacting in
+        compact_map(c, memo->src, node, parent, memo - c->memo);
+    }
+    return node;
+}
+
+// compact an action which is referenced by pointer
+static key_action_t *compact_ref(key_compact_t *c, const key_action_t *in,
+        struct compact_at at){
+    bool fill = c->arena->base != NULL;
+    switch(in->type){
+        case KT_NONE:
+            // fall through to the parent keymap, or act as the plain key
+            if(!fill) return NULL;
+            if(!at.parent) return &c->simple[at.code];
+            return key_action_get(at.parent, at.code);
+        case KT_SIMPLE:
+            return fill ? &c->simple[in->key.simple] : NULL;
+        case KT_MAP:
+            return map_fill(c, map_memo(c, in->key.map, at.map_idx), at.map);
+        default:
+            break;
+    }
+    key_action_t *out = arena_alloc(c->arena, sizeof(*out));
+    compact_value(c, in, out, at);
+    return out;
+}
+
+/* A keymap is compacted sparse when it has a parent to fall through to and
+   few bindings, or else dense.  The choice only depends on the source and
+   where it sits, so both passes make the same one. */
+static void compact_map(key_compact_t *c, const key_map_t *in,
+        key_action_t *out, const key_action_t *parent, long idx){
+    static const key_action_t none = { .type = KT_NONE };
+    bool fill = c->arena->base != NULL;
+    bool sparse = c->memo[idx].parent != -1 && in->n <= KEYMAP_SPARSE_MAX;
+    size_t n = sparse ? in->n : KEY_MAX;
+    uint16_t *codes = NULL;
+    if(sparse) codes = arena_alloc(c->arena, sizeof(*codes) * n);
+    key_action_t **lookup = arena_alloc(c->arena, sizeof(*lookup) * n);
+    if(fill){
+        *out = (key_action_t){ .type = KT_MAP };
+        out->key.map = NULL;
+        out->key.lookup = lookup;
+        out->key.codes = codes;
+        out->key.n = sparse ? n : 0;
+        out->key.parent = sparse ? (key_action_t*)parent : NULL;
+    }
+    struct compact_at at = { .map = out, .map_idx = idx, .parent = parent };
+
+    // the whole lookup table must exist before any child keymap uses it
+    size_t next = 0;
+    for(size_t i = 0; i < n; i++){
+        const key_action_t *ka;
+        if(sparse){
+            at.code = in->keys[i].code;
+            ka = &in->keys[i].action;
+            if(fill) codes[i] = (uint16_t)at.code;
+        }else if(next < in->n && in->keys[next].code == (int)i){
+            at.code = (int)i;
+            ka = &in->keys[next++].action;
+        }else{
+            at.code = (int)i;
+            ka = &none;
+        }
+        key_action_t *target;
+        if(ka->type == KT_NONE || ka->type == KT_SIMPLE){
+            target = compact_ref(c, ka, at);
+        }else if(ka->type == KT_MAP){
+            // filled in below
+            struct key_compact_memo *memo = map_memo(c, ka->key.map, idx);
+            target = memo ? memo->out : NULL;
+        }else{
+            target = arena_alloc(c->arena, sizeof(*target));
+        }
+        if(fill) lookup[i] = target;
+    }
+
+    for(size_t j = 0; j < in->n; j++){
+        const key_action_t *ka = &in->keys[j].action;
+        at.code = in->keys[j].code;
         switch(ka->type){
+            case KT_NONE:
             case KT_SIMPLE:
-            case KT_MACRO:
-            case KT_DUAL:
-                return ka;
+                break;
             case KT_MAP:
-                return &ka->key.map[i];
-            case KT_NONE:
-                // try again with another deref
-                ka = ka->key.ref;
+                map_fill(c, memo_find(c, ka->key.map, idx), out);
                 break;
             default:
-                fprintf(stderr, "invalid key action in key_action_get()\n");
-                exit(1);
+                compact_value(c, ka,
+                        fill ? lookup[sparse ? j : (size_t)at.code] : NULL, at);
+                break;
         }
     }
+}
 
-    fprintf(stderr, "detected probable infinite recursion in keymap\n");
-    exit(1);
-    return NULL;
+// compact an action into *out, which is NULL while measuring
+static void compact_value(key_compact_t *c, const key_action_t *in,
+        key_action_t *out, struct compact_at at){
+    bool fill = c->arena->base != NULL;
+    switch(in->type){
+        case KT_NONE:
+        case KT_SIMPLE:
+            if(fill) *out = *in;
+            break;
+        case KT_MACRO: {
+            key_events_t *events = compact_macro(c, in->key.macro);
+            if(fill){
+                *out = (key_action_t){ .type = KT_MACRO };
+                out->key.macro = NULL;
+                out->key.events = events;
+            }
+            break;
+        }
+        case KT_DUAL: {
+            key_action_t *tap = compact_ref(c, in->key.dual.tap, at);
+            key_action_t *hold = compact_ref(c, in->key.dual.hold, at);
+            if(fill){
+                *out = *in;
+                out->key.dual.tap = tap;
+                out->key.dual.hold = hold;
+            }
+            break;
+        }
+        case KT_MAP: {
+            key_action_t *node = compact_ref(c, in, at);
+            if(fill) *out = *node;
+            break;
+        }
+        case KT_DANCE: {
+            const key_dance_t *dance = in->key.dance;
+            key_dance_t *d = arena_alloc(c->arena, sizeof(*d));
+            key_action_t *taps = arena_alloc(c->arena,
+                    sizeof(*taps) * dance->n);
+            key_action_t *holds = arena_alloc(c->arena,
+                    sizeof(*holds) * dance->n);
+            for(size_t i = 0; i < dance->n; i++){
+                compact_value(c, &dance->taps[i], fill ? &taps[i] : NULL, at);
+                // a KT_NONE hold means no hold variant, not a fall-through
+                compact_value(c, &dance->holds[i], fill ? &holds[i] : NULL,
+                        at);
+            }
+            if(fill){
+                *d = *dance;
+                d->taps = taps;
+                d->holds = holds;
+                *out = (key_action_t){ .type = KT_DANCE };
+                out->key.dance = d;
+            }
+            break;
+        }
+    }
+}
+
+void key_action_compact(key_compact_t *c, const key_action_t *in,
+        key_action_t *out){
+    struct compact_at at = { .map_idx = -1 };
+    compact_value(c, in, out, at);
 }
@@ -1,18 +1,38 @@
 #ifndef KEY_ACTION_H
 #define KEY_ACTION_H
 
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <linux/input.h>
+
+#include "arena.h"
+
 struct key_action_t;
 typedef struct key_action_t key_action_t;
 
 struct key_macro_t;
 typedef struct key_macro_t key_macro_t;
 
+struct key_map_t;
+typedef struct key_map_t key_map_t;
+
 struct key_macro_t{
     int code;
     bool press;
     key_macro_t *next;
+    // how many key actions share the chain, counted on its first step only
+    size_t refs;
 };
 
+/* a compacted macro: its steps as key events, with an EV_SYN only where the
+   next step touches a key already in the frame, and at the end.  The event
+   times are left zero for the resolver to fill in. */
+typedef struct {
+    size_t n;
+    struct input_event evs[];
+} key_events_t;
+
 typedef enum {
     // rollover waveform triggers the "tap" key action
     DUAL_MODE_TAP_ON_ROLLOVER = 0,
@@ -31,20 +51,53 @@ typedef struct {
     long double_tap_ms;
 } key_dual_t;
 
+/* a key which picks an action by how many times it is tapped in a row.  The
+   taps and holds arrays both have n elements, for 1 through n taps. */
+typedef struct {
+    // how many key actions share this tap dance
+    size_t refs;
+    size_t n;
+    // the most time between a release and the next press, or a press and
+    // its release, for the taps to count as consecutive
+    long tapping_ms;
+    // each must be a KT_SIMPLE or KT_MACRO
+    key_action_t *taps;
+    // KT_NONE where a count has no hold variant, or else any non-dual action
+    key_action_t *holds;
+} key_dance_t;
+
 enum key_type {
     KT_NONE,
     KT_SIMPLE,
     KT_MACRO,
     KT_DUAL,
     KT_MAP,
+    KT_DANCE,
 };
 
 union key_union {
     int simple;
-    key_macro_t *macro;
+    struct {
+        // set while loading; NULL once compacted
+        key_macro_t *macro;
+        // set once compacted
+        const key_events_t *events;
+    };
     key_dual_t dual;
-    key_action_t *map; // always allocated to length of 256
-    key_action_t *ref; // non-root keymaps with KT_NONE will have this filled
+    key_dance_t *dance;
+    struct {
+        // set while loading; NULL once compacted
+        key_map_t *map;
+        /* set once compacted.  A dense keymap has the final action for every
+           key, either from map or fallen through from the containing keymaps.
+           A sparse one has an action for each of its n codes, and any other
+           key falls through to parent. */
+        key_action_t **lookup;
+        // sorted, or NULL for a dense keymap
+        const uint16_t *codes;
+        size_t n;
+        key_action_t *parent;
+    };
 };
 
 struct key_action_t {
@@ -52,15 +105,103 @@ struct key_action_t {
     union key_union key;
 };
 
+struct key_binding {
+    int code;
+    key_action_t action;
+};
+
+/* a keymap as the config built it, with just the keys it binds, sorted by
+   code.  Once built it is never modified, so every use of one lua table
+   shares it. */
+struct key_map_t {
+    size_t refs;
+    size_t n;
+    struct key_binding keys[];
+};
+
 key_macro_t *key_macro_new(int code, bool press);
+// drop a reference to a macro chain
 void key_macro_free(key_macro_t *macro);
+// copy a macro chain, such as for splicing into another one
 key_macro_t *key_macro_dup(key_macro_t *macro);
 
+/* returns a keymap with one reference and room for n bindings, with n set to
+   0; add the bindings in any order and then call key_map_sort() */
+key_map_t *key_map_new(size_t n);
+void key_map_free(key_map_t *map);
+// returns 0, or -1 if a code is bound twice
+int key_map_sort(key_map_t *map);
+// the action bound to code i, or NULL if the keymap doesn't bind it
+const key_action_t *key_map_find(const key_map_t *map, int i);
+
+void key_dance_free(key_dance_t *dance);
 void key_action_free(key_action_t *ka);
+/* key macros, keymaps, and tap dances are shared with out, not copied, so
+   this is cheap no matter how large in is */
 int key_action_dup(const key_action_t *in, key_action_t *out);
 
-// helper function for dereferencing key actions from a key action map
-key_action_t *key_action_get(key_action_t *ka, int i);
+/* Compacting copies a compiled action into an arena, keeping only what the
+   resolver reads: keymaps keep a lookup table but not their map array,
+   macros become flat arrays of events, a dual_key's nil tap or hold points
+   straight at what it falls through to, and every KT_SIMPLE reached by
+   pointer comes from one shared table. */
+struct key_compact_memo {
+    const void *src;
+    // the memo index of the keymap src was compacted under, or -1
+    long parent;
+    void *out;
+    bool filled;
+};
+
+/* Keymaps and macros shared while loading stay shared once compacted: each
+   keymap is compacted once per parent keymap (its fall-through differs under
+   each parent), and each macro once. */
+typedef struct {
+    arena_t *arena;
+    // one KT_SIMPLE for each key code, or NULL while measuring
+    key_action_t *simple;
+    struct key_compact_memo *memo;
+    size_t n_memo;
+    size_t cap_memo;
+    // the memo couldn't grow while measuring
+    bool failed;
+} key_compact_t;
+
+/* call on a zeroed key_compact_t before each pass; it allocates the shared
+   table, so it must come first */
+void key_compact_init(key_compact_t *c, arena_t *arena);
+void key_compact_free(key_compact_t *c);
+/* compact a root keymap, combo action, or leader action into *out, which is
+   NULL while measuring */
+void key_action_compact(key_compact_t *c, const key_action_t *in,
+        key_action_t *out);
+
+// keymaps may be nested no deeper than this
+#define KEYMAP_MAX_DEPTH 32
+
+/* A nested keymap with no more bindings than this is compacted sparse: a
+   sorted array searched on each press, costing a few bytes per binding
+   instead of a full lookup table.  Larger keymaps, and keymaps with no
+   parent to fall through to, are compacted dense. */
+#define KEYMAP_SPARSE_MAX 64
+
+// the key action for code i in a compacted keymap
+static inline key_action_t *key_action_get(const key_action_t *ka, int i){
+    while(ka->key.codes){
+        size_t lo = 0, hi = ka->key.n;
+        while(lo < hi){
+            size_t mid = (lo + hi) / 2;
+            if(ka->key.codes[mid] < i){
+                lo = mid + 1;
+            }else{
+                hi = mid;
+            }
+        }
+        if(lo < ka->key.n && ka->key.codes[lo] == i) return ka->key.lookup[lo];
+        ka = ka->key.parent;
+    }
+    return ka->key.lookup[i];
+}
 
 #endif // KEY_ACTION_H
 
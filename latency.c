@@ -0,0 +1,43 @@
+#include "latency.h"
+
+#include <stdio.h>
+
+// the largest value which lands in bucket idx
+static int64_t bucket_top(size_t idx){
+    size_t mag = idx / LAT_SUB;
+    size_t sub = idx % LAT_SUB;
+    if(mag == 0) return (int64_t)sub;
+    uint64_t lo = (uint64_t)(LAT_SUB + sub) << (mag - 1);
+    return (int64_t)(lo + ((uint64_t)1 << (mag - 1)) - 1);
+}
+
+int64_t latency_quantile(const latency_hist_t *h, double q){
+    if(h->total == 0) return 0;
+    // the rank of the value we want, rounded up
+    double rank = q * (double)h->total;
+    uint64_t want = (uint64_t)rank;
+    if(want < rank || want == 0) want++;
+    uint64_t seen = 0;
+    for(size_t i = 0; i < LAT_BUCKETS; i++){
+        seen += h->counts[i];
+        if(seen >= want){
+            // never report more than we have actually seen
+            int64_t top = bucket_top(i);
+            return top < h->max ? top : h->max;
+        }
+    }
+    return h->max;
+}
+
+void latency_print(const latency_hist_t *h, const char *label){
+    if(h->total == 0){
+        printf("%s: no events\n", label);
+        return;
+    }
+    printf("%s: %lu events, p50 %.1fus, p99 %.1fus, p99.9 %.1fus, "
+            "max %.1fus\n", label, (unsigned long)h->total,
+            latency_quantile(h, 0.5) / 1000.0,
+            latency_quantile(h, 0.99) / 1000.0,
+            latency_quantile(h, 0.999) / 1000.0,
+            h->max / 1000.0);
+}
@@ -0,0 +1,50 @@
+#ifndef LATENCY_H
+#define LATENCY_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* An HDR-style histogram of latencies in nanoseconds.  Values are bucketed
+   by their highest set bit, and each power of two is split into LAT_SUB
+   linear sub-buckets, so every bucket is within 1/LAT_SUB of its values.
+   Recording is a couple of arithmetic ops and an increment: no locks and no
+   allocations. */
+
+#define LAT_SUB_BITS 3
+#define LAT_SUB (1 << LAT_SUB_BITS)
+// enough magnitudes for about 2.4 hours; anything longer lands in the last
+#define LAT_MAGS 40
+#define LAT_BUCKETS (LAT_MAGS * LAT_SUB)
+
+typedef struct {
+    uint64_t counts[LAT_BUCKETS];
+    uint64_t total;
+    int64_t max;
+} latency_hist_t;
+
+static inline void latency_record(latency_hist_t *h, int64_t ns){
+    // the event claims to be from the future; call it instantaneous
+    if(ns < 0) ns = 0;
+    uint64_t v = (uint64_t)ns;
+    size_t idx;
+    if(v < LAT_SUB){
+        idx = v;
+    }else{
+        int msb = 63 - __builtin_clzll(v);
+        int mag = msb - LAT_SUB_BITS + 1;
+        size_t sub = (v >> (msb - LAT_SUB_BITS)) & (LAT_SUB - 1);
+        idx = (size_t)mag * LAT_SUB + sub;
+        if(idx >= LAT_BUCKETS) idx = LAT_BUCKETS - 1;
+    }
+    h->counts[idx]++;
+    h->total++;
+    if(ns > h->max) h->max = ns;
+}
+
+// the latency at quantile q (0 < q <= 1), in nanoseconds
+int64_t latency_quantile(const latency_hist_t *h, double q);
+
+// print count, p50, p99, p99.9 and max on one line, prefixed by label
+void latency_print(const latency_hist_t *h, const char *label);
+
+#endif // LATENCY_H
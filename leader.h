@@ -0,0 +1,47 @@
+#ifndef LEADER_H
+#define LEADER_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <linux/input.h>
+
+#include "key_action.h"
+#include "time_util.h"
+
+#define LEADER_MAX 8
+// the most keys in one sequence, not counting the leader key
+#define LEADER_SEQ_MAX 16
+
+struct leader_node {
+    // KT_NONE if no sequence ends here, otherwise a KT_SIMPLE or KT_MACRO
+    key_action_t action;
+    // whether any longer sequence continues from here
+    bool has_next;
+};
+
+/* a leader key and its sequences, compiled into a trie in two contiguous
+   arrays.  Only the keys which appear in some sequence get a column in the
+   transition table, so a transition is a single indexed load. */
+typedef struct {
+    uint16_t key;
+    // how long to wait for each next key of a sequence
+    nstime_t timeout;
+    // the column of each key code in next, plus one; 0 means no column
+    uint8_t alpha[KEY_MAX];
+    size_t n_alpha;
+    size_t n_nodes;
+    /* next[node * n_alpha + column] is the node after pressing that key, or
+       0 if no sequence continues that way (node 0 is the root, which is
+       never a transition target) */
+    uint16_t *next;
+    struct leader_node *nodes;
+} leader_t;
+
+typedef struct {
+    size_t n;
+    leader_t leaders[LEADER_MAX];
+    // the index of the leader for each key code, plus one; 0 means none
+    uint8_t by_key[KEY_MAX];
+} leaders_t;
+
+#endif // LEADER_H
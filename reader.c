@@ -0,0 +1,181 @@
+#include "reader.h"
+#include "devices.h"
+#include "spsc.h"
+
+#include <errno.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+
+/* reader_main() needs very little stack, and with --realtime every page of
+   every thread's stack gets locked into memory */
+#define READER_STACK (64 * 1024)
+
+struct reader {
+    int fd;
+    // shared eventfd to wake up the consumer
+    int wake_fd;
+    // eventfd to tell the thread to exit
+    int stop_fd;
+    // eventfd the consumer writes when it makes room in a full ring
+    int space_fd;
+    _Atomic bool want_space;
+    _Atomic bool dead;
+    _Atomic unsigned long reads;
+    pthread_t thread;
+    spsc_ring_t ring;
+};
+
+static void eventfd_signal(int fd){
+    uint64_t one = 1;
+    write(fd, &one, sizeof(one));
+}
+
+static void eventfd_clear(int fd){
+    uint64_t count;
+    read(fd, &count, sizeof(count));
+}
+
+// wait for the consumer to make room in the ring; returns false if stopped
+static bool wait_for_space(reader_t *rd){
+    atomic_store(&rd->want_space, true);
+    struct pollfd pfds[2] = {
+        { .fd = rd->space_fd, .events = POLLIN },
+        { .fd = rd->stop_fd, .events = POLLIN },
+    };
+    // check again after setting want_space, so we can't miss a wakeup
+    while(spsc_full(&rd->ring)){
+        int ret = poll(pfds, 2, -1);
+        if(ret < 0 && errno != EINTR) break;
+        if(pfds[1].revents) return false;
+        if(pfds[0].revents) eventfd_clear(rd->space_fd);
+    }
+    atomic_store(&rd->want_space, false);
+    return true;
+}
+
+static void *reader_main(void *arg){
+    reader_t *rd = arg;
+    struct input_event evs[READ_BATCH];
+    struct pollfd pfds[2] = {
+        { .fd = rd->fd, .events = POLLIN },
+        { .fd = rd->stop_fd, .events = POLLIN },
+    };
+
+    while(true){
+        int ret = poll(pfds, 2, -1);
+        if(ret < 0){
+            if(errno == EINTR) continue;
+            perror("poll");
+            break;
+        }
+        if(pfds[1].revents) return NULL;
+
+        // the device fd is non-blocking, so this drains up to READ_BATCH
+        ssize_t len = read(rd->fd, evs, sizeof(evs));
+        atomic_fetch_add_explicit(&rd->reads, 1, memory_order_relaxed);
+        if(len < 0){
+            if(errno == EAGAIN || errno == EINTR) continue;
+            break;
+        }
+        if(len == 0) break;
+
+        // push the whole batch, waiting for room if the consumer is behind
+        size_t n = len / sizeof(*evs);
+        size_t pushed = 0;
+        while(true){
+            pushed += spsc_push(&rd->ring, &evs[pushed], n - pushed);
+            eventfd_signal(rd->wake_fd);
+            if(pushed == n) break;
+            if(!wait_for_space(rd)) return NULL;
+        }
+    }
+
+    // let the consumer know the device is gone, after everything we pushed
+    atomic_store_explicit(&rd->dead, true, memory_order_release);
+    eventfd_signal(rd->wake_fd);
+    return NULL;
+}
+
+reader_t *reader_new(int fd, int wake_fd){
+    reader_t *rd;
+    // the ring's members are cache-line aligned
+    if(posix_memalign((void**)&rd, 64, sizeof(*rd))){
+        perror("posix_memalign");
+        return NULL;
+    }
+    rd->fd = fd;
+    rd->wake_fd = wake_fd;
+    atomic_init(&rd->want_space, false);
+    atomic_init(&rd->dead, false);
+    atomic_init(&rd->reads, 0);
+    spsc_init(&rd->ring);
+
+    rd->stop_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if(rd->stop_fd < 0){
+        perror("eventfd");
+        goto fail_rd;
+    }
+    rd->space_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if(rd->space_fd < 0){
+        perror("eventfd");
+        goto fail_stop;
+    }
+
+    pthread_attr_t attr;
+    pthread_attr_init(&attr);
+    pthread_attr_setstacksize(&attr, READER_STACK);
+
+    // signals should only ever interrupt the serve_loop's thread
+    sigset_t all, old;
+    sigfillset(&all);
+    pthread_sigmask(SIG_SETMASK, &all, &old);
+    int ret = pthread_create(&rd->thread, &attr, reader_main, rd);
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+    pthread_attr_destroy(&attr);
+    if(ret != 0){
+        fprintf(stderr, "pthread_create: %s\n", strerror(ret));
+        goto fail_space;
+    }
+
+    return rd;
+
+fail_space:
+    close(rd->space_fd);
+fail_stop:
+    close(rd->stop_fd);
+fail_rd:
+    free(rd);
+    return NULL;
+}
+
+void reader_free(reader_t *rd){
+    if(!rd) return;
+    eventfd_signal(rd->stop_fd);
+    pthread_join(rd->thread, NULL);
+    close(rd->space_fd);
+    close(rd->stop_fd);
+    free(rd);
+}
+
+size_t reader_drain(reader_t *rd, struct input_event *out, size_t max){
+    size_t n = spsc_pop(&rd->ring, out, max);
+    if(n > 0 && atomic_load(&rd->want_space)){
+        eventfd_signal(rd->space_fd);
+    }
+    return n;
+}
+
+bool reader_dead(reader_t *rd){
+    return atomic_load_explicit(&rd->dead, memory_order_acquire);
+}
+
+unsigned long reader_take_reads(reader_t *rd){
+    return atomic_exchange_explicit(&rd->reads, 0, memory_order_relaxed);
+}
@@ -0,0 +1,32 @@
+#ifndef READER_H
+#define READER_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <linux/input.h>
+
+/* A thread which reads one input device (sdiol --threaded) and pushes its raw
+   input_events into a wait-free SPSC ring for the serve_loop to consume.
+   After pushing a batch, the thread writes to wake_fd, an eventfd shared by
+   all readers, which sits in the serve_loop's epoll set. */
+
+struct reader;
+typedef struct reader reader_t;
+
+// start a reader thread for fd; returns NULL on error
+reader_t *reader_new(int fd, int wake_fd);
+
+// stop and join the reader thread (fd is not closed)
+void reader_free(reader_t *rd);
+
+// consumer side: pop up to max events from the ring
+size_t reader_drain(reader_t *rd, struct input_event *out, size_t max);
+
+/* true once the thread has stopped due to a read error on its device; by then
+   everything it read is in the ring, so drain after checking this */
+bool reader_dead(reader_t *rd);
+
+// the number of read() calls since the last call to reader_take_reads()
+unsigned long reader_take_reads(reader_t *rd);
+
+#endif // READER_H
@@ -0,0 +1,77 @@
+#define _GNU_SOURCE
+#include "realtime.h"
+
+#include <errno.h>
+#include <sched.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+
+// how much stack to fault in up front; the serve_loop needs far less
+#define PREFAULT_STACK (256 * 1024)
+
+void realtime_prefault(void *mem, size_t len){
+    volatile char *c = mem;
+    size_t page = sysconf(_SC_PAGESIZE);
+    for(size_t i = 0; i < len; i += page){
+        c[i] = c[i];
+    }
+    if(len > 0){
+        c[len - 1] = c[len - 1];
+    }
+}
+
+static void prefault_stack(void){
+    char stack[PREFAULT_STACK];
+    memset(stack, 0, sizeof(stack));
+    // don't let the compiler optimize away the memset
+    __asm__ __volatile__("" : : "r"(stack) : "memory");
+}
+
+int realtime_setup(int priority, int cpu){
+    if(cpu > -1){
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        CPU_SET(cpu, &set);
+        if(sched_setaffinity(0, sizeof(set), &set)){
+            fprintf(stderr, "--realtime: failed to pin to cpu %d: %s\n",
+                    cpu, strerror(errno));
+            return -1;
+        }
+    }
+
+    struct sched_param param = { .sched_priority = priority };
+    if(sched_setscheduler(0, SCHED_FIFO, &param)){
+        int e = errno;
+        fprintf(stderr, "--realtime: failed to set SCHED_FIFO priority %d: "
+                "%s\n", priority, strerror(e));
+        if(e == EPERM){
+            struct rlimit rl = {0};
+            getrlimit(RLIMIT_RTPRIO, &rl);
+            fprintf(stderr, "  this requires CAP_SYS_NICE or an RLIMIT_RTPRIO "
+                    "of at least %d (currently %lu)\n",
+                    priority, (unsigned long)rl.rlim_cur);
+        }
+        return -1;
+    }
+
+    if(mlockall(MCL_CURRENT | MCL_FUTURE)){
+        int e = errno;
+        fprintf(stderr, "--realtime: failed to lock memory: %s\n",
+                strerror(e));
+        if(e == EPERM || e == ENOMEM){
+            struct rlimit rl = {0};
+            getrlimit(RLIMIT_MEMLOCK, &rl);
+            fprintf(stderr, "  this requires CAP_IPC_LOCK or a larger "
+                    "RLIMIT_MEMLOCK (currently %lu bytes)\n",
+                    (unsigned long)rl.rlim_cur);
+        }
+        return -1;
+    }
+
+    prefault_stack();
+
+    return 0;
+}
@@ -0,0 +1,17 @@
+#ifndef REALTIME_H
+#define REALTIME_H
+
+#include <stddef.h>
+
+#define RT_PRIORITY_DEFAULT 50
+
+/* Make the calling thread (and threads it starts later) real-time: pin it to
+   cpu (unless cpu < 0), run it as SCHED_FIFO at priority, lock all current
+   and future memory, and prefault the stack.  Prints what went wrong and
+   which capability or rlimit is missing and returns -1 on failure. */
+int realtime_setup(int priority, int cpu);
+
+// touch every page in [mem, mem+len) so it is resident before we need it
+void realtime_prefault(void *mem, size_t len);
+
+#endif // REALTIME_H
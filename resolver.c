@@ -5,6 +5,7 @@
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 
 void resolver_init(struct resolver *r, key_action_t *root_keymap,
         send_t send, void *send_data){
@@ -15,11 +16,94 @@ void resolver_init(struct resolver *r, key_action_t *root_keymap,
     r->current_keymap = root_keymap;
 }
 
+void resolver_set_send_many(struct resolver *r, send_many_t send_many){
+    r->send_many = send_many;
+}
+
+void resolver_set_combos(struct resolver *r, const combos_t *combos){
+    r->combos = combos;
+}
+
+void resolver_set_leaders(struct resolver *r, const leaders_t *leaders){
+    r->leaders = leaders;
+}
+
+void resolver_set_repeat(struct resolver *r, long delay_ms, long interval_ms){
+    r->repeat.delay = msec_to_ns(delay_ms);
+    r->repeat.interval = msec_to_ns(interval_ms);
+    r->repeat.active = false;
+}
+
+
+/* the full timestamp of a queued event, in microseconds, recovered from the
+   newest event we have seen (which can't be ~35 minutes newer) */
+static int64_t rev_time_us(const struct resolver *r, rev_t ev){
+    int32_t age_us = (int32_t)((uint32_t)r->newest_us - ev.time_us);
+    return r->newest_us - age_us;
+}
+
+static nstime_t rev_time(const struct resolver *r, rev_t ev){
+    return rev_time_us(r, ev) * NS_PER_USEC;
+}
+
+// convert back to the kernel's format at the output boundary
+static void send_rev(struct resolver *r, rev_t ev){
+    int64_t us = rev_time_us(r, ev);
+    struct input_event out = {
+        .time = {
+            .tv_sec = us / 1000000,
+            .tv_usec = us % 1000000,
+        },
+        .type = ev.type,
+        .code = ev.code,
+        .value = ev.value,
+    };
+    r->send(r->send_data, out);
+}
+
+// end a frame of generated events, at the time of ev
+static void send_syn(struct resolver *r, rev_t ev){
+    rev_t syn_ev = {
+        .time_us = ev.time_us,
+        .type = EV_SYN,
+        .code = SYN_REPORT,
+        .value = 0,
+    };
+    send_rev(r, syn_ev);
+}
+
+// the most events send_events() passes in one call
+#define SEND_BATCH 64
+
+// send a compacted macro, with every event at the time of ev
+static void send_events(struct resolver *r, rev_t ev,
+        const key_events_t *events){
+    int64_t us = rev_time_us(r, ev);
+    struct timeval time = {
+        .tv_sec = us / 1000000,
+        .tv_usec = us % 1000000,
+    };
+    struct input_event buf[SEND_BATCH];
+    size_t len = 0;
+    for(size_t i = 0; i < events->n; i++){
+        buf[len] = events->evs[i];
+        buf[len].time = time;
+        if(!r->send_many){
+            r->send(r->send_data, buf[len]);
+            continue;
+        }
+        if(++len == SEND_BATCH){
+            r->send_many(r->send_data, buf, len);
+            len = 0;
+        }
+    }
+    if(len) r->send_many(r->send_data, buf, len);
+}
 
 // call on each "natural" TAP resolution (which happens upon key release)
-static void track_last_tap(struct resolver *r, struct input_event release_ev){
+static void track_last_tap(struct resolver *r, rev_t release_ev){
     r->last_tap_code = release_ev.code;
-    r->last_tap_time = release_ev.time;
+    r->last_tap_time = rev_time_us(r, release_ev);
 }
 
 // call on each non-natural-TAP dual-key resolution
@@ -34,6 +118,69 @@ static void maybe_invalidate_last_tap(struct resolver *r, int code){
     }
 }
 
+/* the unresolved queue is full (which means its head is a dual key waiting
+   for a timeout).  Returns true if ev was merged into the queue or dropped,
+   otherwise it forces the head to resolve so there is room to queue ev. */
+static bool make_room(struct resolver *r, rev_t ev){
+    rev_t *newest = &r->unresolved[(r->ur_start + r->ur_len - 1) % URMAX];
+    switch(ev.type){
+        case EV_MSC:
+            // scancodes and the like are informational; drop them
+            r->overflow.coalesced++;
+            return true;
+        case EV_SYN:
+            // an empty frame
+            if(newest->type == EV_SYN){
+                r->overflow.coalesced++;
+                return true;
+            }
+            break;
+        case EV_REL:
+            /* add relative motion to the newest queued motion on the same
+               axis, as long as no key event is in between */
+            for(size_t i = 1; i <= r->ur_len && i <= COALESCE_WINDOW; i++){
+                size_t idx = (r->ur_start + r->ur_len - i) % URMAX;
+                rev_t *old = &r->unresolved[idx];
+                if(old->type == EV_KEY) break;
+                if(old->type == EV_REL && old->code == ev.code){
+                    old->value += ev.value;
+                    r->overflow.coalesced++;
+                    return true;
+                }
+            }
+            break;
+    }
+
+    /* give up waiting on the head and treat it as held; only the head, since
+       what follows it may still have time to resolve normally */
+    r->overflow.forced_holds++;
+    r->force_hold = true;
+    resolve(r);
+    r->force_hold = false;
+    while(resolve(r));
+    return false;
+}
+
+void resolver_push(struct resolver *r, struct input_event input){
+    // dedup inputs before inserting to unresolved
+    if(!resolve_dedup_input(r, input)) return;
+    // a new press stops the repeat, like it would on a real keyboard
+    if(input.type == EV_KEY && input.value == 1){
+        r->repeat.active = false;
+    }
+    int64_t us = (int64_t)input.time.tv_sec * 1000000 + input.time.tv_usec;
+    if(us > r->newest_us) r->newest_us = us;
+    rev_t ev = {
+        .time_us = (uint32_t)us,
+        .value = input.value,
+        .type = input.type,
+        .code = input.code,
+    };
+    if(r->ur_len == URMAX && make_room(r, ev)) return;
+    r->unresolved[(r->ur_start + r->ur_len++) % URMAX] = ev;
+    while(resolve(r));
+}
+
 // returns bool ok
 bool resolve_dedup_input(struct resolver *r, struct input_event ev){
     if(ev.type != EV_KEY) return true;
@@ -53,6 +200,10 @@ bool resolve_dedup_input(struct resolver *r, struct input_event ev){
         // ignore non-first press of a key;
         return r->input_counts[ev.code]++ == 0;
     }
+    if(ev.value == 2){
+        // kernel repeats can't tell us which press they belong to
+        return false;
+    }
     return true;
 }
 
@@ -62,22 +213,25 @@ bool resolve_dedup_input(struct resolver *r, struct input_event ev){
      - X has timed out (hold mode)
      - X has been released (tap mode)
      - another key has been pressed and released (hold mode)
+     - the queue is full, so X can't wait any longer (hold mode)
      - actually, neither has happened yet (resolvable time will be set) */
 enum waveform {
     WAVEFORM_TAP,
     WAVEFORM_HOLD,
     WAVEFORM_NONE_YET,
 };
-enum waveform check_waveform(struct resolver *r, struct input_event ev,
+static enum waveform check_waveform(struct resolver *r, rev_t ev,
         key_dual_t dual){
+    nstime_t pressed = rev_time(r, ev);
     // is the keypress old enough to be a hold?
-    if(msec_diff(timeval_now(), ev.time) > dual.hold_ms){
+    if(nstime_now() - pressed >= msec_to_ns(dual.hold_ms)){
         // only on time-based holds do we check doubletap behavior.
         long dtms = dual.double_tap_ms;
         if(dtms > -1){
             // check for double tap conditions
             if(r->last_tap_code == ev.code){
-                if(dtms == 0 || msec_diff(ev.time, r->last_tap_time) < dtms){
+                int64_t since_us = rev_time_us(r, ev) - r->last_tap_time;
+                if(dtms == 0 || since_us * NS_PER_USEC < msec_to_ns(dtms)){
                     // not a natural tap
                     invalidate_last_tap(r);
                     return WAVEFORM_TAP;
@@ -89,12 +243,29 @@ enum waveform check_waveform(struct resolver *r, struct input_event ev,
     }
     // in TIMEOUT_ONLY, we don't have to check any further
     if(dual.mode == DUAL_MODE_TIMEOUT_ONLY){
-        return WAVEFORM_NONE_YET;
+        if(!r->force_hold) return WAVEFORM_NONE_YET;
+        // unless the queue is full, where a key already released is a TAP
+        for(size_t i = 1; i < r->ur_len; i++){
+            rev_t ev2 = r->unresolved[(r->ur_start + i) % URMAX];
+            if(ev2.type == EV_KEY && ev2.value == 0 && ev2.code == ev.code){
+                track_last_tap(r, ev2);
+                return WAVEFORM_TAP;
+            }
+        }
+        invalidate_last_tap(r);
+        return WAVEFORM_HOLD;
     }
 
-    int keys_pressed[KEY_MAX] = {0};
-    for(size_t i = 1; i < r->ur_len; i++){
-        struct input_event ev2 = r->unresolved[(r->ur_start + i) % URMAX];
+    /* pick up where the last check of this key left off; everything before
+       scan->next is already known not to decide anything */
+    struct waveform_scan *scan = &r->scan;
+    if(scan->next == 0){
+        memset(scan->pressed, 0, sizeof(scan->pressed));
+        scan->next = 1;
+    }
+    for(; scan->next < r->ur_len; scan->next++){
+        size_t i = scan->next;
+        rev_t ev2 = r->unresolved[(r->ur_start + i) % URMAX];
         // only consider key events
         if(ev2.type != EV_KEY) continue;
         // was the main key released?
@@ -110,66 +281,241 @@ enum waveform check_waveform(struct resolver *r, struct input_event ev,
         }
         // on press, record the pressed state of the key
         if(ev2.value == 1 && ev2.code < KEY_MAX){
-            keys_pressed[ev2.code] = 1;
+            scan->pressed[ev2.code / 64] |= (uint64_t)1 << (ev2.code % 64);
             // any secondary press prevents a doubletap
             invalidate_last_tap(r);
         }
         // some other key was pressed and released, main key is a HOLD
-        if(ev2.value == 0 && ev2.code < KEY_MAX && keys_pressed[ev2.code]){
+        if(ev2.value == 0 && ev2.code < KEY_MAX
+                && (scan->pressed[ev2.code / 64] >> (ev2.code % 64)) & 1){
             invalidate_last_tap(r);
             return WAVEFORM_HOLD;
         }
     }
 
+    // the queue overflowed, so we can't wait on this key any longer
+    if(r->force_hold){
+        invalidate_last_tap(r);
+        return WAVEFORM_HOLD;
+    }
     return WAVEFORM_NONE_YET;
 }
 
-void do_keypress(struct resolver *r, struct input_event ev, key_action_t *ka){
+// hold a layer until the key with the given code is released
+static bool layer_push(struct resolver *r, uint16_t code, key_action_t *map){
+    if(r->n_layers == LAYER_STACK_MAX){
+        // squeeze out the layers which were released out of order
+        size_t n = 0;
+        for(size_t i = 0; i < r->n_layers; i++){
+            if(r->layers[i].live) r->layers[n++] = r->layers[i];
+        }
+        r->n_layers = n;
+        if(n == LAYER_STACK_MAX){
+            fprintf(stderr, "too many layers held, ignoring one\n");
+            return false;
+        }
+    }
+    r->layers[r->n_layers++] = (struct layer){
+        .map = map, .code = code, .live = true,
+    };
+    r->current_keymap = map;
+    return true;
+}
+
+static void layer_release(struct resolver *r, uint16_t code){
+    // usually the newest layer is the one being released
+    for(size_t i = r->n_layers; i-- > 0;){
+        if(r->layers[i].live && r->layers[i].code == code){
+            r->layers[i].live = false;
+            break;
+        }
+    }
+    // the top of the stack must always be live
+    while(r->n_layers && !r->layers[r->n_layers - 1].live){
+        r->n_layers--;
+    }
+    r->current_keymap = r->n_layers
+        ? r->layers[r->n_layers - 1].map : r->root_keymap;
+}
+
+static void do_keypress(struct resolver *r, rev_t ev, key_action_t *ka){
     switch(ka->type){
         case KT_DUAL:
             fprintf(stderr, "can't call do_keypress() on a dual-mode key\n");
             exit(1);
             break;
         case KT_NONE:
-            fprintf(stderr, "can't call do_keypress() on a none-type key\n");
+            // a dual_key's nil tap or hold is compiled to its fall-through
+            fprintf(stderr, "can't call do_keypress() on an empty key\n");
             exit(1);
             break;
+        case KT_DANCE:
+            // outside of resolve_press(), a tap dance is just tapped once
+            do_keypress(r, ev, &ka->key.dance->taps[0]);
+            break;
         case KT_SIMPLE:
+            // repeat the key from when it was physically pressed
+            if(r->repeat.interval){
+                r->repeat.active = true;
+                r->repeat.src = ev.code;
+                r->repeat.code = ka->key.simple;
+                r->repeat.next = rev_time(r, ev) + r->repeat.delay;
+            }
             // remember how to release the key
             r->release_map[ev.code] = ka->key.simple;
             // send the modified key
             ev.code = ka->key.simple;
-            r->send(r->send_data, ev);
+            send_rev(r, ev);
             break;
         case KT_MACRO:
-            // send the whole chain of macros
-            for(key_macro_t *m = ka->key.macro; m; m = m->next){
-                struct input_event ev = {
-                    .type = EV_KEY,
-                    .value = m->press,
-                    .code = m->code,
-                };
-                r->send(r->send_data, ev);
-
-                struct input_event syn_ev = {
-                    .type = EV_SYN,
-                    .code = SYN_REPORT,
-                    .value = 0,
-                };
-                r->send(r->send_data, syn_ev);
-            }
+            // the whole macro, already laid out in frames
+            send_events(r, ev, ka->key.events);
             break;
         case KT_MAP:
-            // set the keymap
-            r->current_keymap = ka;
-            // reset the keymap on release
-            r->release_map[ev.code] = RESET_KEYMAP;
+            // hold the layer, and release it when this key is released
+            if(layer_push(r, ev.code, ka)){
+                r->release_map[ev.code] = RELEASE_LAYER;
+            }
             // send nothing
             break;
     }
 }
 
-bool resolve_press(struct resolver *r, struct input_event ev){
+/* Given a key press X at the head of unresolved which belongs to some combo,
+   check the events behind it to decide whether they complete a combo:
+     - every key of exactly one live combo is pressed, and no live combo has
+       more keys (fire)
+     - a key is pressed which no live combo contains in time, a key of a live
+       combo is released, or the timeout passes (fire the combo completed so
+       far, if any, otherwise none)
+     - actually, neither has happened yet (resolvable time will be set) */
+enum combo_result {
+    COMBO_FIRE,
+    COMBO_NONE,
+    COMBO_NONE_YET,
+};
+
+// drop combos which time out before the given time since the head press
+static uint64_t combos_in_time(const combos_t *combos, uint64_t live,
+        nstime_t since){
+    for(uint64_t bits = live; bits; bits &= bits - 1){
+        int c = __builtin_ctzll(bits);
+        if(since > combos->combos[c].timeout){
+            live &= ~((uint64_t)1 << c);
+        }
+    }
+    return live;
+}
+
+// the latest time at which some live combo could still complete
+static nstime_t combos_deadline(const combos_t *combos, uint64_t live,
+        nstime_t pressed){
+    nstime_t timeout = 0;
+    for(uint64_t bits = live; bits; bits &= bits - 1){
+        int c = __builtin_ctzll(bits);
+        if(combos->combos[c].timeout > timeout){
+            timeout = combos->combos[c].timeout;
+        }
+    }
+    return pressed + timeout;
+}
+
+static enum combo_result check_combo(struct resolver *r, rev_t ev, int *out){
+    const combos_t *combos = r->combos;
+    struct combo_scan *cs = &r->combo_scan;
+    nstime_t pressed = rev_time(r, ev);
+
+    // pick up where the last check of this key left off
+    if(cs->next == 0){
+        cs->live = combos->key_masks[ev.code];
+        cs->pressed = 1;
+        cs->next = 1;
+    }
+    bool broken = false;
+    for(; cs->next < r->ur_len; cs->next++){
+        rev_t ev2 = r->unresolved[(r->ur_start + cs->next) % URMAX];
+        // only consider key events
+        if(ev2.type != EV_KEY || ev2.code >= KEY_MAX) continue;
+        // releasing any key of a live combo ends the chord
+        if(ev2.value == 0){
+            if(combos->key_masks[ev2.code] & cs->live){
+                broken = true;
+                break;
+            }
+            continue;
+        }
+        uint64_t live = combos_in_time(combos,
+                cs->live & combos->key_masks[ev2.code],
+                rev_time(r, ev2) - pressed);
+        // this press isn't part of any combo that is still possible
+        if(!live){
+            broken = true;
+            break;
+        }
+        cs->live = live;
+        cs->pressed++;
+    }
+
+    uint64_t complete = cs->live & combos->size_masks[cs->pressed];
+    if(!broken && !r->force_hold){
+        if(!complete || (cs->live & ~complete)){
+            // a longer combo might still complete
+            nstime_t deadline = combos_deadline(combos, cs->live, pressed);
+            if(nstime_now() < deadline){
+                r->resolvable_time = deadline;
+                r->use_resolvable_time = true;
+                return COMBO_NONE_YET;
+            }
+        }
+    }
+    if(!complete){
+        cs->failed = true;
+        return COMBO_NONE;
+    }
+    // a combo's key set is unique, so at most one combo is complete
+    *out = __builtin_ctzll(complete);
+    return COMBO_FIRE;
+}
+
+/* the head of unresolved completed combo c: press its action in place of the
+   head, and drop the other presses of the chord.  The action is released
+   along with the head's key. */
+static void fire_combo(struct resolver *r, rev_t ev, int c){
+    const combos_t *combos = r->combos;
+    uint64_t bit = (uint64_t)1 << c;
+    size_t n = 1;
+    for(size_t i = 1; i < r->ur_len; i++){
+        rev_t ev2 = r->unresolved[(r->ur_start + i) % URMAX];
+        if(i < r->combo_scan.next && ev2.type == EV_KEY && ev2.value == 1
+                && ev2.code < KEY_MAX && (combos->key_masks[ev2.code] & bit)){
+            // releasing this key does nothing
+            r->release_map[ev2.code] = 0;
+            continue;
+        }
+        r->unresolved[(r->ur_start + n++) % URMAX] = ev2;
+    }
+    r->ur_len = n;
+    // pressing a macro or key action can't recurse into the ring
+    do_keypress(r, ev, (key_action_t*)&combos->combos[c].action);
+}
+
+static void dance_start(struct resolver *r, rev_t ev,
+        const key_dance_t *dance){
+    r->dance = (struct dance_state){
+        .dance = dance,
+        .code = ev.code,
+        .count = 1,
+        .held = true,
+        .last = ev,
+        .deadline = rev_time(r, ev) + msec_to_ns(dance->tapping_ms),
+    };
+    // the key does nothing until the dance is decided
+    r->release_map[ev.code] = 0;
+}
+
+// records which histogram the event belongs in, if it is resolved
+static bool resolve_press(struct resolver *r, rev_t ev,
+        latency_kind_t *kind){
     maybe_invalidate_last_tap(r, ev.code);
     // get the key action from the map
     key_action_t *ka = key_action_get(r->current_keymap, ev.code);
@@ -179,20 +525,24 @@ bool resolve_press(struct resolver *r, struct input_event ev){
         case KT_SIMPLE:
             do_keypress(r, ev, ka);
             return true;
+        case KT_DANCE:
+            dance_start(r, ev, ka->key.dance);
+            return true;
         case KT_DUAL:
             switch(check_waveform(r, ev, ka->key.dual)){
                 // .tap and .hold must not be KT_DUALs
                 case WAVEFORM_TAP:
+                    *kind = LAT_TAP;
                     do_keypress(r, ev, ka->key.dual.tap);
                     return true;
                 case WAVEFORM_HOLD:
+                    *kind = LAT_HOLD;
                     do_keypress(r, ev, ka->key.dual.hold);
                     return true;
                 case WAVEFORM_NONE_YET:
                     // wait for a timeout to resolve this event
-                    r->resolvable_time = msec_after(
-                        ev.time, ka->key.dual.hold_ms
-                    );
+                    r->resolvable_time = rev_time(r, ev)
+                        + msec_to_ns(ka->key.dual.hold_ms);
                     r->use_resolvable_time=true;
                     return false;
             }
@@ -203,25 +553,168 @@ bool resolve_press(struct resolver *r, struct input_event ev){
     }
 }
 
-bool resolve_release(struct resolver *r, struct input_event ev){
+static bool resolve_release(struct resolver *r, rev_t ev){
     /* make the code look like whatever we mapped it to when we
        resolved the initial keypress */
     int initial_code = ev.code;
     ev.code = r->release_map[initial_code];
     r->release_map[initial_code] = 0;
+    if(initial_code == r->repeat.src){
+        r->repeat.active = false;
+    }
     switch(ev.code){
-        case RESET_KEYMAP:
-            r->current_keymap = r->root_keymap;
+        case RELEASE_LAYER:
+            layer_release(r, initial_code);
             break;
         case 0:
             // we must have sent this key release early; do nothing.
             break;
         default:
-            r->send(r->send_data, ev);
+            send_rev(r, ev);
+    }
+    return true;
+}
+
+/* press a key action and, unless its key is still held, release it again.
+   The press and release each get a frame of their own: a timer may be what
+   decided the action, so no input frame's SYN_REPORT is coming to end them,
+   and a press and release of one code in one frame would cancel out. */
+static void tap_action(struct resolver *r, rev_t ev, key_action_t *ka){
+    do_keypress(r, ev, ka);
+    send_syn(r, ev);
+    if(r->input_counts[ev.code] == 0){
+        rev_t release = ev;
+        release.value = 0;
+        resolve_release(r, release);
+        send_syn(r, release);
+    }
+}
+
+static void leader_start(struct resolver *r, rev_t ev){
+    struct leader_state *ls = &r->leading;
+    ls->leader = &r->leaders->leaders[r->leaders->by_key[ev.code] - 1];
+    ls->node = 0;
+    ls->n_typed = 0;
+    ls->deadline = rev_time(r, ev) + ls->leader->timeout;
+    // the leader key itself does nothing
+    r->release_map[ev.code] = 0;
+}
+
+// leave the leader sequence, typing the keys it swallowed
+static void leader_abort(struct resolver *r){
+    struct leader_state *ls = &r->leading;
+    ls->leader = NULL;
+    for(size_t i = 0; i < ls->n_typed; i++){
+        rev_t ev = ls->typed[i];
+        key_action_t *ka = key_action_get(r->current_keymap, ev.code);
+        // as far as a dual key is concerned, the key was tapped
+        if(ka->type == KT_DUAL) ka = ka->key.dual.tap;
+        tap_action(r, ev, ka);
+    }
+    ls->n_typed = 0;
+}
+
+// end the leader sequence with the action where it stopped, if there is one
+static void leader_finish(struct resolver *r){
+    struct leader_state *ls = &r->leading;
+    key_action_t *action = &ls->leader->nodes[ls->node].action;
+    if(action->type == KT_NONE){
+        leader_abort(r);
+        return;
+    }
+    ls->leader = NULL;
+    tap_action(r, ls->typed[ls->n_typed - 1], action);
+    ls->n_typed = 0;
+}
+
+/* feed the key press at the head of unresolved to the leader sequence in
+   progress.  Returns false if the press doesn't continue any sequence, in
+   which case the sequence has been abandoned and the press still needs to
+   be resolved. */
+static bool leader_press(struct resolver *r, rev_t ev){
+    struct leader_state *ls = &r->leading;
+    const leader_t *l = ls->leader;
+    uint8_t col = l->alpha[ev.code];
+    uint16_t next = col ? l->next[ls->node * l->n_alpha + col - 1] : 0;
+    if(!next){
+        leader_abort(r);
+        return false;
+    }
+    ls->node = next;
+    ls->typed[ls->n_typed++] = ev;
+    ls->deadline = rev_time(r, ev) + l->timeout;
+    // the key does nothing unless the sequence is abandoned
+    r->release_map[ev.code] = 0;
+    // no need to wait for a longer sequence
+    if(!l->nodes[next].has_next){
+        leader_finish(r);
     }
     return true;
 }
 
+/* decide the tap dance: a held key gets the hold variant for its count (or
+   the tap action, held until the key is released), and otherwise the tap
+   action for the count is tapped */
+static void dance_finish(struct resolver *r){
+    struct dance_state *ds = &r->dance;
+    const key_dance_t *dance = ds->dance;
+    size_t i = ds->count - 1;
+    ds->dance = NULL;
+    if(ds->held){
+        key_action_t *hold = &dance->holds[i];
+        if(hold->type == KT_NONE) hold = &dance->taps[i];
+        do_keypress(r, ds->last, hold);
+        // like tap_action(), this may have been decided by a timer
+        send_syn(r, ds->last);
+    }else{
+        tap_action(r, ds->last, &dance->taps[i]);
+    }
+}
+
+static void dance_press(struct resolver *r, rev_t ev){
+    struct dance_state *ds = &r->dance;
+    ds->count++;
+    ds->held = true;
+    ds->last = ev;
+    ds->deadline = rev_time(r, ev) + msec_to_ns(ds->dance->tapping_ms);
+    r->release_map[ev.code] = 0;
+}
+
+static void dance_release(struct resolver *r, rev_t ev){
+    struct dance_state *ds = &r->dance;
+    ds->held = false;
+    ds->deadline = rev_time(r, ev) + msec_to_ns(ds->dance->tapping_ms);
+    // no more taps can change the outcome
+    if(ds->count == ds->dance->n){
+        dance_finish(r);
+    }
+}
+
+// resolve a key press which may start a combo
+static bool resolve_chord_press(struct resolver *r, rev_t ev,
+        latency_kind_t *kind){
+    int c;
+    enum combo_result cr = COMBO_NONE;
+    if(r->combos && r->combos->key_masks[ev.code] && !r->combo_scan.failed){
+        cr = check_combo(r, ev, &c);
+    }
+    switch(cr){
+        case COMBO_FIRE:
+            fire_combo(r, ev, c);
+            return true;
+        case COMBO_NONE_YET:
+            return false;
+        case COMBO_NONE:
+        default:
+            return resolve_press(r, ev, kind);
+    }
+}
+
+static void record_latency(struct resolver *r, latency_kind_t kind,
+        rev_t ev){
+    latency_record(&r->latency[kind], nstime_now() - rev_time(r, ev));
+}
+
 /* helper function which tries to resolve the oldest key event.  Returns false
    if it deems the event unresolvable, setting the resolver.resolve_time as
    appropriate. */
@@ -231,12 +724,22 @@ bool resolve(struct resolver *r){
     }
 
     // grab the oldest event
-    struct input_event ev = r->unresolved[r->ur_start % URMAX];
+    rev_t ev = r->unresolved[r->ur_start % URMAX];
 
     bool resolved = false;
     r->use_resolvable_time = false;
+    latency_kind_t kind = LAT_PASSTHROUGH;
 
     if(ev.type == EV_KEY){
+        /* the leader sequence timed out before this key, even if the timer
+           which would have ended it hasn't fired yet */
+        if(r->leading.leader && rev_time(r, ev) >= r->leading.deadline){
+            leader_finish(r);
+        }
+        // likewise, a tap dance can't be continued after it times out
+        if(r->dance.dance && rev_time(r, ev) >= r->dance.deadline){
+            dance_finish(r);
+        }
         // invalid key code
         if(ev.code > KEY_MAX){
             fprintf(stderr, "Dropping too-high keycode %d\n", ev.code);
@@ -245,28 +748,32 @@ bool resolve(struct resolver *r){
         // key released
         else if(ev.value == 0){
             // printf("%.10s of %.10s\n", "release", get_input_name(ev.code));
-            resolved = resolve_release(r, ev);
+            if(r->dance.dance && ev.code == r->dance.code){
+                dance_release(r, ev);
+                resolved = true;
+            }else{
+                resolved = resolve_release(r, ev);
+            }
         }
         // key pressed
         else if(ev.value == 1){
             // printf("%.10s of %.10s\n", "press", get_input_name(ev.code));
-            resolved = resolve_press(r, ev);
-        }
-        // key repeated
-        else if(ev.value == 2){
-            // printf("%.10s of %.10s\n", "repeat", get_input_name(ev.code));
-            /* make the code look like whatever we mapped it to when we
-               resolved the initial keypress */
-            ev.code = r->release_map[ev.code];
-            if(ev.code != 0 && ev.code != RESET_KEYMAP){
-                /* TODO: generate fake repeats to avoid the situation where
-                         where a key is pressed twice and we can't tell which
-                         repeat is from the first press and which one is
-                         irrelevant.  For now, X handles its own key repeats
-                         so these don't really even matter. */
-                r->send(r->send_data, ev);
+            // any other key interrupts a tap dance
+            if(r->dance.dance && ev.code != r->dance.code){
+                dance_finish(r);
+            }
+            if(r->dance.dance){
+                dance_press(r, ev);
+                resolved = true;
+            }else if(r->leading.leader && leader_press(r, ev)){
+                // part of a leader sequence
+                resolved = true;
+            }else if(r->leaders && r->leaders->by_key[ev.code]){
+                leader_start(r, ev);
+                resolved = true;
+            }else{
+                resolved = resolve_chord_press(r, ev, &kind);
             }
-            resolved = true;
         }else{
             fprintf(stderr,
                 "dropping invalid ev.value %d in resolver\n", ev.value
@@ -275,15 +782,19 @@ bool resolve(struct resolver *r){
         }
     }else if(ev.type == EV_SYN){
         // printf("EV_SYN\n");
-        r->send(r->send_data, ev);
+        send_rev(r, ev);
         resolved = true;
     }else{
         // other ev.types are passed through unchanged
-        r->send(r->send_data, ev);
+        send_rev(r, ev);
         resolved = true;
     }
 
     if(resolved){
+        if(ev.type == EV_KEY) record_latency(r, kind, ev);
+        // the next event starts a fresh waveform and combo scan
+        r->scan.next = 0;
+        r->combo_scan = (struct combo_scan){0};
         // one less element
         r->ur_len--;
         // but we start one later
@@ -295,17 +806,26 @@ bool resolve(struct resolver *r){
            initial press had come after the unresolvable key, then now that
            we have the release the unresolvable key would be resolvable. */
         ev = r->unresolved[(r->ur_start + r->ur_len - 1) % URMAX];
-        if(ev.value == 0 && ev.code < KEY_MAX){
+        // a SYN_REPORT's value and code are 0 too, but it must stay queued
+        if(ev.type == EV_KEY && ev.value == 0 && ev.code < KEY_MAX){
             /* make the code look like whatever we mapped it to when we
                resolved the initial keypress */
-            ev.code = r->release_map[ev.code];
+            int initial_code = ev.code;
+            ev.code = r->release_map[initial_code];
+            if(initial_code == r->repeat.src){
+                r->repeat.active = false;
+            }
             switch(ev.code){
-                case RESET_KEYMAP:
-                    // return to root keymap
-                    r->current_keymap = r->root_keymap;
+                case RELEASE_LAYER:
+                    r->release_map[initial_code] = 0;
+                    layer_release(r, initial_code);
                     // one less element
                     r->ur_len--;
                     break;
+                case 0:
+                    // released early already, or part of a combo
+                    r->ur_len--;
+                    break;
                 case KEY_LEFTALT:
                 case KEY_RIGHTALT:
                 case KEY_LEFTCTRL:
@@ -317,42 +837,99 @@ bool resolve(struct resolver *r){
                     // modifier keys don't get resolved early
                     break;
                 default:
-                    r->send(r->send_data, ev);
+                    send_rev(r, ev);
+                    record_latency(r, LAT_PASSTHROUGH, ev);
                     // send a sync event for this generated key event
-                    struct input_event syn_ev = {
-                        .type = EV_SYN,
-                        .code = SYN_REPORT,
-                        .value = 0,
-                    };
-                    r->send(r->send_data, syn_ev);
+                    send_syn(r, ev);
                     // one less element
                     r->ur_len--;
             }
+            // don't let the scans skip whatever is queued next
+            if(r->scan.next > r->ur_len){
+                r->scan.next = r->ur_len;
+            }
+            if(r->combo_scan.next > r->ur_len){
+                r->combo_scan.next = r->ur_len;
+            }
         }
     }
     return resolved;
 }
 
-// returns the timeout to be used for select(), which is either out or NULL
-struct timeval *select_timeout(struct resolver *r, struct timeval *out){
-    // don't pass a timeout if none is valid.
+/* if the oldest unresolved event is waiting for a timeout, write the time at
+   which it becomes resolvable to *out and return true */
+bool resolve_deadline(const struct resolver *r, nstime_t *out){
+    if(r->ur_len == 0){
+        // maybe a tap dance or leader sequence is waiting for another key
+        bool found = false;
+        if(r->dance.dance){
+            *out = r->dance.deadline;
+            found = true;
+        }
+        if(r->leading.leader && (!found || r->leading.deadline < *out)){
+            *out = r->leading.deadline;
+            found = true;
+        }
+        return found;
+    }
     if(!r->use_resolvable_time){
-        return NULL;
+        return false;
+    }
+    *out = r->resolvable_time;
+    return true;
+}
+
+bool resolver_repeat_deadline(const struct resolver *r, nstime_t *out){
+    // events waiting to be resolved always come before any repeat
+    if(!r->repeat.active || r->ur_len > 0){
+        return false;
     }
+    *out = r->repeat.next;
+    return true;
+}
+
+void resolver_tick(struct resolver *r, nstime_t now){
+    // give up waiting for the next tap of a tap dance
+    if(r->dance.dance && r->ur_len == 0 && now >= r->dance.deadline){
+        dance_finish(r);
+    }
+    // give up waiting for the next key of a leader sequence
+    if(r->leading.leader && r->ur_len == 0 && now >= r->leading.deadline){
+        leader_finish(r);
+    }
+    nstime_t next;
+    if(!resolver_repeat_deadline(r, &next) || now < next){
+        return;
+    }
+    rev_t ev = {
+        .time_us = (uint32_t)(now / NS_PER_USEC),
+        .type = EV_KEY,
+        .code = r->repeat.code,
+        .value = 2,
+    };
+    send_rev(r, ev);
+    send_syn(r, ev);
+    // if we woke up late, don't try to catch up
+    r->repeat.next += r->repeat.interval;
+    if(r->repeat.next <= now){
+        r->repeat.next = now + r->repeat.interval;
+    }
+}
 
-    struct timespec now_timespec;
-    clock_gettime(CLOCK_REALTIME, &now_timespec);
-    struct timeval now;
-    TIMESPEC_TO_TIMEVAL(&now, &now_timespec);
+void resolver_print_overflows(const struct resolver *r, const char *label){
+    printf("%s overflow: %lu events coalesced, %lu forced holds\n", label,
+            r->overflow.coalesced, r->overflow.forced_holds);
+}
 
-    long mdiff = msec_diff(r->resolvable_time, now);
-    if(mdiff < 0){
-        // somehow the timeout has expired, zero length timeout
-        out->tv_sec = 0;
-        out->tv_usec = 0;
-    }else{
-        out->tv_sec = mdiff / 1000;
-        out->tv_usec = (mdiff % 1000) * 1000;
+void resolver_print_latency(const struct resolver *r, const char *label){
+    static const char *names[LAT_KINDS] = {
+        [LAT_TAP] = "dual tap",
+        [LAT_HOLD] = "dual hold",
+        [LAT_PASSTHROUGH] = "passthrough",
+    };
+    char buf[128];
+    for(int i = 0; i < LAT_KINDS; i++){
+        snprintf(buf, sizeof(buf), "%s %s latency", label, names[i]);
+        latency_print(&r->latency[i], buf);
     }
-    return out;
 }
@@ -2,62 +2,237 @@
 #define RESOLVER_H
 
 #include <stdbool.h>
+#include <stdint.h>
 #include <time.h>
 
 #include "app.h"
+#include "combo.h"
 #include "key_action.h"
+#include "latency.h"
+#include "leader.h"
+#include "time_util.h"
 
-// the maximum number of unresolved events before we start dropping events
+/* the maximum number of unresolved events.  When the queue is full, non-key
+   events are coalesced or dropped and otherwise the pending dual key at the
+   head is forced to resolve as a HOLD. */
 #define URMAX 1024
 
-// a special value in release_map which indicates we should reset the keymap
-#define RESET_KEYMAP (KEY_MAX + 1)
+// how far back a full queue looks for motion to merge an EV_REL into
+#define COALESCE_WINDOW 64
+
+// a special value in release_map which indicates we should release a layer
+#define RELEASE_LAYER (KEY_MAX + 1)
+
+// the most keymap layers which can be held at once
+#define LAYER_STACK_MAX 32
+
+/* resolved key events are split by how they were resolved: dual keys which
+   became taps or holds, and everything else */
+typedef enum {
+    LAT_TAP,
+    LAT_HOLD,
+    LAT_PASSTHROUGH,
+    LAT_KINDS,
+} latency_kind_t;
+
+/* the resolver's internal event, half the size of a struct input_event.
+   Events are converted to and from struct input_event only at the edges of
+   the resolver.  time_us holds the low 32 bits of the event's monotonic
+   timestamp in microseconds.  It wraps every ~71 minutes, which is far
+   longer than any event waits in the queue. */
+typedef struct {
+    uint32_t time_us;
+    int32_t value;
+    uint16_t type;
+    uint16_t code;
+} rev_t;
+
+#define PRESSED_WORDS ((KEY_MAX + 63) / 64)
+
+/* how far check_waveform() has scanned behind the pending dual key at the
+   head of unresolved, so each event behind it is only examined once */
+struct waveform_scan {
+    // the offset from ur_start of the next event to examine; 0 means fresh
+    size_t next;
+    // keys pressed behind the dual key, as a bitset
+    uint64_t pressed[PRESSED_WORDS];
+};
+
+/* a keymap layer, active while the physical key which exposed it is held.
+   Layers released out of order stay on the stack as dead entries until
+   everything above them is released too. */
+struct layer {
+    key_action_t *map;
+    uint16_t code;
+    bool live;
+};
+
+/* how far check_combo() has scanned behind a key press at the head of
+   unresolved which might start a combo */
+struct combo_scan {
+    // the offset from ur_start of the next event to examine; 0 means fresh
+    size_t next;
+    // the combos which every key pressed so far belongs to
+    uint64_t live;
+    // how many keys have been pressed, including the head
+    unsigned pressed;
+    // the head can't start a combo; resolve it like any other press
+    bool failed;
+};
+
+// a leader sequence in progress
+struct leader_state {
+    // NULL when no sequence is in progress
+    const leader_t *leader;
+    // the trie node we have reached
+    uint16_t node;
+    // when to give up waiting for the next key
+    nstime_t deadline;
+    // the key presses of the sequence so far, typed if it doesn't match
+    rev_t typed[LEADER_SEQ_MAX];
+    size_t n_typed;
+};
+
+/* a tap dance in progress.  Presses and releases of its key are consumed as
+   they reach the head of unresolved, so nothing waits in the queue for it. */
+struct dance_state {
+    // NULL when no tap dance is in progress
+    const key_dance_t *dance;
+    uint16_t code;
+    // taps so far, including a press which is still held
+    size_t count;
+    bool held;
+    // the latest press of the key
+    rev_t last;
+    // when to stop waiting for the next press or release
+    nstime_t deadline;
+};
 
 // the state of the resolver thread, which decides how to interpret keys
 struct resolver {
     // We can either send to a local keyboard device or to a network socket
     send_t send;
+    // NULL if send must be called for each event
+    send_many_t send_many;
     void *send_data;
-    /* key events received, but we haven't decided how to treat them.  No key
-       can be resolved until all of the keys before it are resolved. */
-    struct input_event unresolved[URMAX];
+    // the hot scalars come first; the unresolved ring is near the end
     size_t ur_len;
     size_t ur_start;
-
-    // dedup inputs from multiple keyboards, logical ORing them together
-    int input_counts[KEY_MAX];
-
-    /* when we decide how to treat a keypress, we have to remember what key to
-       release.  This also implicitly maps out which keys are pressed. */
-    int release_map[KEY_MAX];
+    struct waveform_scan scan;
+    struct combo_scan combo_scan;
+    // the config's combos, or NULL
+    const combos_t *combos;
+    // the config's leaders, or NULL
+    const leaders_t *leaders;
+    struct leader_state leading;
+    struct dance_state dance;
+    // the full timestamp (in microseconds) of the newest event pushed
+    int64_t newest_us;
 
     /* If we have an unresolvable event, we mark the time that it will become
        resolvable by timeout */
-    struct timeval resolvable_time;
+    nstime_t resolvable_time;
     bool use_resolvable_time;
+    // set while the queue is full, to resolve the head without waiting
+    bool force_hold;
+
+    /* synthetic key repeat of the most recently pressed key, which only
+       repeats while nothing is waiting to be resolved */
+    struct {
+        nstime_t delay;
+        // 0 disables key repeat
+        nstime_t interval;
+        // when to send the next repeat
+        nstime_t next;
+        bool active;
+        // the physical key being held, and the key we are repeating
+        uint16_t src;
+        uint16_t code;
+    } repeat;
 
     key_action_t *root_keymap;
-    /* for now, we will only track a single current keymap, and releasing any
-       keyamp will send you back to the root keymap.  This isn't correct
-       behavior, but correct behavior seems complex and I can't quite decide on
-       what is correct behavior anyway.  For now, the simple solution is
-       sufficient. */
+    /* the topmost live layer's keymap, or root_keymap.  Keymaps are compiled
+       with fall-through already applied, so this is the only keymap we need
+       to look at to resolve a key press. */
     key_action_t *current_keymap;
 
     // track double-tapping to allow for repeats of dual-mode key TAP behaviors
     int last_tap_code;
-    struct timeval last_tap_time;
+    /* in full microseconds, since a queued event's 32-bit time_us can't tell
+       a tap a few seconds ago from one an hour ago */
+    int64_t last_tap_time;
+
+    /* dedup inputs from multiple keyboards, logical ORing them together.  These
+       are counts rather than bits because one key may be held on several of
+       the grab's keyboards at once. */
+    uint8_t input_counts[KEY_MAX];
+
+    /* when we decide how to treat a keypress, we have to remember what key to
+       release.  This also implicitly maps out which keys are pressed. */
+    uint16_t release_map[KEY_MAX];
+
+    // the held layers, bottom first
+    struct layer layers[LAYER_STACK_MAX];
+    size_t n_layers;
+
+    /* key events received, but we haven't decided how to treat them.  No key
+       can be resolved until all of the keys before it are resolved. */
+    rev_t unresolved[URMAX];
+
+    // what we did when the unresolved queue was full
+    struct {
+        unsigned long coalesced;
+        unsigned long forced_holds;
+    } overflow;
+
+    /* time from each key event's kernel timestamp until we resolved and sent
+       it; only ever touched by the serve_loop's thread */
+    latency_hist_t latency[LAT_KINDS];
 };
 
 void resolver_init(struct resolver *r, key_action_t *root_keymap,
         send_t send, void *send_data);
 
-// returns bool ok
+/* set a callback which takes many events at once, with the same send_data
+   as send, or NULL to send events one at a time */
+void resolver_set_send_many(struct resolver *r, send_many_t send_many);
+
+// set the combos to match key presses against, or NULL for none
+void resolver_set_combos(struct resolver *r, const combos_t *combos);
+
+// set the leader keys and their sequences, or NULL for none
+void resolver_set_leaders(struct resolver *r, const leaders_t *leaders);
+
+// configure key repeat; an interval of 0 disables it
+void resolver_set_repeat(struct resolver *r, long delay_ms, long interval_ms);
+
+/* returns bool ok.  Kernel key repeats are never ok, since the resolver
+   generates its own. */
 bool resolve_dedup_input(struct resolver *r, struct input_event ev);
 
+/* dedup a new input event, queue it, and resolve whatever we can.  A full
+   queue is handled as described at URMAX. */
+void resolver_push(struct resolver *r, struct input_event ev);
+
 bool resolve(struct resolver *r);
 
-// returns the timeout to be used for select(), which is either out or NULL
-struct timeval *select_timeout(struct resolver *r, struct timeval *out);
+// print the overflow counters, prefixed by label
+void resolver_print_overflows(const struct resolver *r, const char *label);
+
+// print the latency histograms, with each line prefixed by label
+void resolver_print_latency(const struct resolver *r, const char *label);
+
+/* if the oldest unresolved event is waiting for a timeout, or a leader
+   sequence or tap dance is waiting for its next key, write the time at which
+   resolve() or resolver_tick() should be called again to *out and return
+   true */
+bool resolve_deadline(const struct resolver *r, nstime_t *out);
+
+// if a key is repeating, write when to call resolver_tick() and return true
+bool resolver_repeat_deadline(const struct resolver *r, nstime_t *out);
+
+/* time out a leader sequence or tap dance, or send a key repeat, if one is
+   due at time now */
+void resolver_tick(struct resolver *r, nstime_t now);
 
 #endif // RESOLVER_H
@@ -7,9 +7,11 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
-#include <sys/inotify.h>
-#include <sys/select.h>
+#include <sys/ioctl.h>
+#include <sys/epoll.h>
 #include <sys/stat.h>
+#include <sys/timerfd.h>
+#include <sys/eventfd.h>
 #include <sys/types.h>
 #include <unistd.h>
 #include <getopt.h>
@@ -31,23 +33,43 @@
 #include "networking.h"
 #include "resolver.h"
 #include "devices.h"
+#include "hotplug.h"
 #include "config.h"
+#include "config_cache.h"
 #include "names.h"
 #include "permissions.h"
+#include "uring.h"
+#include "reader.h"
+#include "realtime.h"
+#include "trace.h"
 
 static volatile bool keep_going = true;
 static void quit_on_signal(int signum){
     keep_going = false;
 }
 
+static volatile bool dump_stats = false;
+static void dump_stats_on_signal(int signum){
+    dump_stats = true;
+}
+
 // command line inputs
 typedef struct {
     char *config;
+    char *cache_dir;
+    bool no_cache;
+    char *output;
     bool systemd;
     bool verbose;
     char* timeout;
     char* user_group;
     char* mode;
+    bool io_uring;
+    bool threaded;
+    bool realtime;
+    char *rt_priority;
+    char *rt_cpu;
+    bool max_speed;
 } opts_t;
 
 // run-time config (post-processed version of opts_t)
@@ -59,25 +81,33 @@ typedef struct {
     char *user;
     char* group;
     char* mode;
+    bool io_uring;
+    bool threaded;
+    bool realtime;
+    int rt_priority;
+    int rt_cpu;
+    bool max_speed;
 } runopts_t;
 
 typedef struct {
     // the send cb we are wrapping
     send_t send;
+    // the app's, or NULL
+    send_many_t send_many;
     void *send_data;
     bool verbose;
-    // dedup tracking
-    int press_count_map[KEY_MAX];
+    /* dedup tracking; a count, not a bit, since several actions (or grabs) may
+       hold the same output key at once */
+    uint8_t press_count_map[KEY_MAX];
     // EV_SYN tracking
     bool sent_something;
 } send_dedup_t;
 
 /* if two sources of a single key are present, send events according to the
    logical OR of those keys.  Also drop EV_SYN events if we detect that no real
-   key events have been sent since the last EV_SYN event we sent. */
-int send_dedup(void *data, struct input_event ev){
-    int retval = 0;
-    send_dedup_t *d = data;
+   key events have been sent since the last EV_SYN event we sent.  Returns
+   whether ev should be sent. */
+static bool dedup_keep(send_dedup_t *d, struct input_event ev){
     if(ev.type == EV_KEY){
         if(ev.code > KEY_MAX){
             fprintf(stderr,
@@ -101,8 +131,8 @@ int send_dedup(void *data, struct input_event ev){
                         get_input_name(ev.code)
                     );
                 }
-                retval = d->send(d->send_data, ev);
                 d->sent_something = true;
+                return true;
             }
         }
         // key press event
@@ -115,178 +145,642 @@ int send_dedup(void *data, struct input_event ev){
                         get_input_name(ev.code)
                     );
                 }
-                retval = d->send(d->send_data, ev);
                 d->sent_something = true;
+                return true;
             }
         }
         // key repeat event
         else if(ev.value == 2){
-            retval = d->send(d->send_data, ev);
             d->sent_something = true;
+            return true;
         }else{
             fprintf(stderr,
                 "dropping invalid ev.value %d in send_dedup\n",
                 ev.value
             );
         }
+        return false;
 
     }else if(ev.type == EV_SYN){
         // only send the EV_SYN event if some other event was sent
         if(d->sent_something){
-            retval = d->send(d->send_data, ev);
             d->sent_something = false;
+            return true;
         }
+        return false;
+    }
+
+    // other ev.types are passed through unchanged
+    d->sent_something = true;
+    return true;
+}
 
-    }else{
-        // other ev.types are passed through unchanged
-        retval = d->send(d->send_data, ev);
-        d->sent_something = true;
+int send_dedup(void *data, struct input_event ev){
+    send_dedup_t *d = data;
+    if(!dedup_keep(d, ev)) return 0;
+    return d->send(d->send_data, ev);
+}
+
+// the most events send_dedup_many() holds back before passing them on
+#define DEDUP_BATCH 64
+
+/* send_dedup for an array of events; what survives the dedup goes to the app
+   in as few calls as it can take */
+int send_dedup_many(void *data, const struct input_event *evs, size_t n){
+    send_dedup_t *d = data;
+    int retval = 0;
+    if(!d->send_many){
+        for(size_t i = 0; i < n; i++){
+            retval = send_dedup(d, evs[i]);
+        }
+        return retval;
     }
+    struct input_event kept[DEDUP_BATCH];
+    size_t len = 0;
+    for(size_t i = 0; i < n; i++){
+        if(!dedup_keep(d, evs[i])) continue;
+        kept[len++] = evs[i];
+        if(len == DEDUP_BATCH){
+            retval = d->send_many(d->send_data, kept, len);
+            len = 0;
+        }
+    }
+    if(len) retval = d->send_many(d->send_data, kept, len);
     return retval;
 }
 
-int serve_loop(const runopts_t *runopts, app_t app, void *app_data){
-    struct timeval exit_time;
-    bool timed_exit = false;
-    if(runopts->timeout > 0){
-        printf("preparing to exit after %d seconds\n", runopts->timeout);
-        exit_time = msec_after(timeval_now(), runopts->timeout * 1000);
-        timed_exit = true;
+// values for EPOLL_TAG_TIMER fds
+enum {
+    TIMER_EXIT,
+    TIMER_RESOLVE,
+};
+
+/* a timerfd which fires when the earliest pending dual key across all grabs
+   becomes resolvable by timeout, or when a key repeat is due.  Input
+   timestamps are CLOCK_MONOTONIC, so the timer is too. */
+typedef struct {
+    int fd;
+    bool armed;
+    nstime_t when;
+} resolve_timer_t;
+
+/* find the earliest time at which some grab is waiting on a timeout,
+   or, with repeats, at which some grab's held key repeats */
+static bool next_deadline(grab_t *grabs, bool repeats, nstime_t *out){
+    bool found = false;
+    for(grab_t *g = grabs; g; g = g->next){
+        nstime_t deadline;
+        if(!resolve_deadline(&g->resolver, &deadline)
+                && !(repeats
+                    && resolver_repeat_deadline(&g->resolver, &deadline))){
+            continue;
+        }
+        if(!found || deadline < *out){
+            *out = deadline;
+        }
+        found = true;
+    }
+    return found;
+}
+
+// retry every resolver and send any due key repeats, such as after a timeout
+static void resolve_all(grab_t *grabs){
+    nstime_t now = nstime_now();
+    for(grab_t *g = grabs; g; g = g->next){
+        if(g->ignore) continue;
+        while(resolve(&g->resolver));
+        resolver_tick(&g->resolver, now);
+    }
+}
+
+// re-arm (or disarm) the timer after the resolvers may have changed
+static void resolve_timer_update(resolve_timer_t *t, grab_t *grabs){
+    nstime_t when = 0;
+    bool found = next_deadline(grabs, true, &when);
+
+    // avoid the syscall if nothing changed
+    if(found == t->armed && (!found || when == t->when)){
+        return;
+    }
+
+    // a zero it_value disarms the timer
+    struct itimerspec its = { .it_value = nstime_to_timespec(when) };
+    if(timerfd_settime(t->fd, TFD_TIMER_ABSTIME, &its, NULL)){
+        perror("timerfd_settime");
+        return;
+    }
+    t->armed = found;
+    t->when = when;
+}
+
+// retry every resolver once the timer fires
+static void resolve_timer_fire(resolve_timer_t *t, grab_t *grabs){
+    uint64_t expirations;
+    read(t->fd, &expirations, sizeof(expirations));
+    t->armed = false;
+    resolve_all(grabs);
+}
+
+// counters for seeing how well input reads are amortized
+typedef struct {
+    unsigned long reads;
+    unsigned long events;
+} input_stats_t;
+
+static void print_input_stats(const input_stats_t *stats){
+    double per_read = stats->reads ? (double)stats->events / stats->reads : 0;
+    printf("input: %lu events in %lu reads (%.2f events/read)\n",
+            stats->events, stats->reads, per_read);
+}
+
+static void print_grab_stats(grab_t *grabs){
+    int i = 0;
+    for(grab_t *g = grabs; g; g = g->next, i++){
+        if(g->ignore) continue;
+        char label[32];
+        snprintf(label, sizeof(label), "grab %d", i);
+        resolver_print_overflows(&g->resolver, label);
+        resolver_print_latency(&g->resolver, label);
+    }
+}
+
+// the serve_loop's input devices and how we are reading them
+typedef struct {
+    const runopts_t *runopts;
+    int epfd;
+    // the eventfd which reader threads wake us with (--threaded), or -1
+    int ring_wake;
+    keyboard_t kbs[MAX_KBS];
+    int n_kbs;
+    input_stats_t stats;
+    // where to record raw input (sdiol record), or NULL
+    trace_t *trace;
+} inputs_t;
+
+/* start reading kbs[first] through kbs[n_kbs-1], through either the epoll
+   set, the io_uring, or a reader thread */
+static void watch_keyboards(inputs_t *in, int first){
+    for(int i = first; i < in->n_kbs; i++){
+        keyboard_t *kb = &in->kbs[i];
+        kb->reader = NULL;
+        if(in->trace){
+            char name[256] = {0};
+            ioctl(kb->fd, EVIOCGNAME(sizeof(name) - 1), name);
+            kb->trace_id = trace_add_device(in->trace, name);
+        }
+        if(uring_enabled()){
+            uring_add_input(kb->fd);
+            continue;
+        }
+        if(in->ring_wake > -1){
+            kb->reader = reader_new(kb->fd, in->ring_wake);
+            if(kb->reader) continue;
+            // without a thread, read this device from the epoll set instead
+            fprintf(stderr, "%s: reading without a thread\n", kb->dev);
+        }
+        int ret = epoll_watch(in->epfd, EPOLL_CTL_ADD, kb->fd, EPOLLIN,
+                EPOLL_TAG_INPUT, i);
+        if(ret != 0){
+            perror("epoll_ctl");
+        }
+    }
+}
+
+static void handle_input_event(const runopts_t *runopts, struct resolver *r,
+        struct input_event ev){
+    // print names of keypresses
+    if(runopts->verbose && ev.type == EV_KEY && ev.value == 1){
+        fprintf(stdout,
+            "recv %s press\n",
+            get_input_name(ev.code)
+        );
+    }else if(
+        runopts->verbose && ev.type == EV_KEY && ev.value == 0
+    ){
+        fprintf(stdout,
+            "recv %s release\n",
+            get_input_name(ev.code)
+        );
+    }
+    resolver_push(r, ev);
+}
+
+/* feed the resolver a release for every key the device still holds, as if
+   it had let go of them itself.  The resolver's per-key input counts make
+   sure a key also held on another device of the same grab stays down. */
+static void release_pressed(inputs_t *in, keyboard_t *kb){
+    nstime_t now = nstime_now();
+    struct input_event ev = {
+        .time = {
+            .tv_sec = now / NS_PER_SEC,
+            .tv_usec = (now % NS_PER_SEC) / NS_PER_USEC,
+        },
+        .type = EV_KEY,
+        .value = 0,
+    };
+    bool released = false;
+    for(size_t byte = 0; byte < sizeof(kb->pressed); byte++){
+        if(!kb->pressed[byte]) continue;
+        for(int bit = 0; bit < 8; bit++){
+            if(!(kb->pressed[byte] & (1 << bit))) continue;
+            ev.code = byte * 8 + bit;
+            // so that replaying the trace doesn't leave the keys stuck either
+            if(in->trace) trace_write_events(in->trace, kb->trace_id, &ev, 1);
+            handle_input_event(in->runopts, &kb->grab->resolver, ev);
+            released = true;
+        }
+        kb->pressed[byte] = 0;
+    }
+    if(!released) return;
+    ev.type = EV_SYN;
+    ev.code = SYN_REPORT;
+    if(in->trace) trace_write_events(in->trace, kb->trace_id, &ev, 1);
+    handle_input_event(in->runopts, &kb->grab->resolver, ev);
+}
+
+/* close a keyboard and fill its slot with the last keyboard, which means the
+   index stored in the moved keyboard's epoll_data needs to be updated */
+static void close_keyboard(inputs_t *in, int i){
+    keyboard_t *kbs = in->kbs;
+    // stop the reader thread before closing the fd it reads
+    reader_free(kbs[i].reader);
+    // closing the fd also removes it from the epoll set
+    close_input(&kbs[i]);
+    // don't leave keys stuck down in the output when a device disappears
+    release_pressed(in, &kbs[i]);
+    int last = --in->n_kbs;
+    if(i == last) return;
+    kbs[i] = kbs[last];
+    // io_uring reads and reader threads are not tied to an index in kbs
+    if(uring_enabled() || kbs[i].reader) return;
+    epoll_watch(in->epfd, EPOLL_CTL_MOD, kbs[i].fd, EPOLLIN,
+            EPOLL_TAG_INPUT, i);
+}
+
+// feed a batch of events read from kb to its grab's resolver
+static void handle_keyboard_events(inputs_t *in, keyboard_t *kb,
+        const struct input_event *evs, size_t n){
+    in->stats.events += n;
+    if(in->trace){
+        trace_write_events(in->trace, kb->trace_id, evs, n);
+    }
+    struct resolver *r = &kb->grab->resolver;
+    for(size_t i = 0; i < n; i++){
+        struct input_event ev = evs[i];
+        if(ev.type == EV_KEY && ev.code < KEY_MAX && ev.value != 2){
+            uint8_t bit = 1 << (ev.code % 8);
+            if(ev.value) kb->pressed[ev.code / 8] |= bit;
+            else kb->pressed[ev.code / 8] &= ~bit;
+        }
+        handle_input_event(in->runopts, r, ev);
     }
+}
+
+/* drain every pending event from a (non-blocking) keyboard, READ_BATCH events
+   per read().  Returns false if the keyboard should be closed. */
+static bool handle_keyboard(inputs_t *in, keyboard_t *kb){
+    struct input_event evs[READ_BATCH];
+    while(true){
+        ssize_t ret = read(kb->fd, evs, sizeof(evs));
+        in->stats.reads++;
+        if(ret < 0){
+            return errno == EAGAIN || errno == EINTR;
+        }
+        if(ret == 0){
+            return false;
+        }
+        size_t n = ret / sizeof(*evs);
+        handle_keyboard_events(in, kb, evs, n);
+        // a short read means the device has nothing more for us right now
+        if(n < READ_BATCH){
+            return true;
+        }
+    }
+}
+
+static void handle_uring_read(void *arg, int fd, const struct input_event *evs,
+        size_t n){
+    inputs_t *in = arg;
+    int i;
+    for(i = 0; i < in->n_kbs; i++){
+        if(in->kbs[i].fd == fd) break;
+    }
+    if(i == in->n_kbs) return;
 
+    if(!evs){
+        close_keyboard(in, i);
+        return;
+    }
+
+    in->stats.reads++;
+    handle_keyboard_events(in, &in->kbs[i], evs, n);
+}
+
+// drain the rings of every reader thread (--threaded)
+static void handle_rings(inputs_t *in){
+    uint64_t count;
+    read(in->ring_wake, &count, sizeof(count));
+
+    struct input_event evs[READ_BATCH];
+    for(int i = 0; i < in->n_kbs; i++){
+        keyboard_t *kb = &in->kbs[i];
+        if(!kb->reader) continue;
+        in->stats.reads += reader_take_reads(kb->reader);
+        /* check for death before draining: the thread only dies after pushing
+           everything it read, so a drain which follows is sure to be final */
+        bool dead = reader_dead(kb->reader);
+        size_t n;
+        while((n = reader_drain(kb->reader, evs, READ_BATCH)) > 0){
+            handle_keyboard_events(in, kb, evs, n);
+        }
+        if(dead){
+            close_keyboard(in, i);
+            // don't skip the new i-th entry of kbs
+            i--;
+        }
+    }
+}
+
+// open a device which was plugged in, once it has settled
+static hotplug_result_t hotplug_open(void *arg, const char *dev){
+    inputs_t *in = arg;
+    // attribute changes also come through here, for devices we already have
+    for(int i = 0; i < in->n_kbs; i++){
+        if(strcmp(in->kbs[i].dev, dev) == 0) return HOTPLUG_DONE;
+    }
+    if(in->n_kbs == MAX_KBS){
+        fprintf(stderr, "%s: already grabbing %d devices\n", dev, MAX_KBS);
+        return HOTPLUG_DONE;
+    }
+    open_input_t ret = open_input(
+        dev, in->runopts->config->grabs, &in->kbs[in->n_kbs],
+        in->runopts->verbose
+    );
+    if(ret == OPEN_INPUT_NOT_READY) return HOTPLUG_NOT_READY;
+    if(ret == OPEN_INPUT_GRABBED){
+        in->n_kbs++;
+        watch_keyboards(in, in->n_kbs - 1);
+    }
+    return HOTPLUG_DONE;
+}
+
+/* a device node was deleted.  Usually its read() failed first and it is
+   already closed, but a device with nothing to read may only notice now. */
+static void hotplug_remove(void *arg, const char *dev){
+    inputs_t *in = arg;
+    // with io_uring, the posted read fails and closes the device for us
+    if(uring_enabled()) return;
+    for(int i = 0; i < in->n_kbs; i++){
+        if(strcmp(in->kbs[i].dev, dev) == 0){
+            close_keyboard(in, i);
+            return;
+        }
+    }
+}
+
+/* trace, if not NULL, records the raw input from every device we grab */
+int serve_loop(const runopts_t *runopts, app_t app, void *app_data,
+        trace_t *trace){
     // let user release the enter key after running the command
     usleep(250000);
 
     // use one send_dedup_t on the output for all possible inputs
-    send_dedup_t deduper = { app.send, app_data, runopts->verbose };
+    send_dedup_t deduper = {
+        .send = app.send,
+        .send_many = app.send_many,
+        .send_data = app_data,
+        .verbose = runopts->verbose,
+    };
 
     // late-init the resolvers in each of the grabs
     for(grab_t *g = runopts->config->grabs; g; g = g->next){
         resolver_init(&g->resolver, &g->map, send_dedup, &deduper);
+        resolver_set_send_many(&g->resolver, send_dedup_many);
+        resolver_set_repeat(
+            &g->resolver, g->repeat_delay_ms, g->repeat_interval_ms
+        );
+        resolver_set_combos(&g->resolver, runopts->config->combos);
+        resolver_set_leaders(&g->resolver, runopts->config->leaders);
+        if(runopts->verbose && !g->ignore){
+            printf("grab keymap nesting depth: %d\n", g->map_depth);
+        }
     }
 
-    int i, ret, n_kbs;
-    keyboard_t kbs[MAX_KBS];
-    open_inputs(kbs, &n_kbs, runopts->config->grabs, runopts->verbose);
-    int inot = open_inotify();
+    if(runopts->realtime){
+        if(realtime_setup(runopts->rt_priority, runopts->rt_cpu)){
+            return 1;
+        }
+        // the unresolved rings must never page fault once we are running
+        for(grab_t *g = runopts->config->grabs; g; g = g->next){
+            realtime_prefault(&g->resolver, sizeof(g->resolver));
+        }
+    }
 
-    if (n_kbs == 0) {
-        fprintf(stderr, "couldn't open any inputs\n");
+    int retval = 1;
+
+    inputs_t in = { .runopts = runopts, .ring_wake = -1, .trace = trace };
+
+    /* every fd is registered with the epoll set exactly once, so each wakeup
+       only costs as much as the number of ready fds */
+    in.epfd = epoll_create1(EPOLL_CLOEXEC);
+    if(in.epfd < 0){
+        perror("epoll_create1");
         return 1;
     }
 
-    int retval = 0;
+    int exit_timer = -1;
+    if(runopts->timeout > 0){
+        printf("preparing to exit after %d seconds\n", runopts->timeout);
+        exit_timer = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK|TFD_CLOEXEC);
+        if(exit_timer < 0){
+            perror("timerfd_create");
+            goto cu_epoll;
+        }
+        struct itimerspec its = { .it_value = { .tv_sec = runopts->timeout } };
+        if(timerfd_settime(exit_timer, 0, &its, NULL)){
+            perror("timerfd_settime");
+            goto cu_timer;
+        }
+        int ret = epoll_watch(in.epfd, EPOLL_CTL_ADD, exit_timer, EPOLLIN,
+                EPOLL_TAG_TIMER, TIMER_EXIT);
+        if(ret != 0){
+            perror("epoll_ctl");
+            goto cu_timer;
+        }
+    }
 
-    // notify systemd we are up (if --systemd or -d was given)
-    if(runopts->systemd){
-        sd_notify(0, "READY=1");
+    resolve_timer_t resolve_timer = {0};
+    resolve_timer.fd = timerfd_create(
+        CLOCK_MONOTONIC, TFD_NONBLOCK|TFD_CLOEXEC
+    );
+    if(resolve_timer.fd < 0){
+        perror("timerfd_create");
+        goto cu_timer;
+    }
+    int ret = epoll_watch(in.epfd, EPOLL_CTL_ADD, resolve_timer.fd, EPOLLIN,
+            EPOLL_TAG_TIMER, TIMER_RESOLVE);
+    if(ret != 0){
+        perror("epoll_ctl");
+        goto cu_resolve_timer;
     }
 
-    fd_set rd_fds, wr_fds;
-    while (keep_going) {
-        FD_ZERO(&rd_fds);
-        FD_ZERO(&wr_fds);
+    if(app.epoll_register && app.epoll_register(app_data, in.epfd)){
+        goto cu_resolve_timer;
+    }
 
-        int max_fd = -1;
-        if(app.prep_select){
-            max_fd = app.prep_select(app_data, &rd_fds, &wr_fds);
-        }
+    if(runopts->io_uring && uring_init(in.epfd)){
+        goto cu_resolve_timer;
+    }
 
-        FD_SET(inot, &rd_fds);
-        if(inot > max_fd)
-            max_fd = inot;
-        for (i = 0; i < n_kbs; i++) {
-          FD_SET(kbs[i].fd, &rd_fds);
-          if (kbs[i].fd > max_fd)
-            max_fd = kbs[i].fd;
+    if(runopts->threaded){
+        in.ring_wake = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        if(in.ring_wake < 0){
+            perror("eventfd");
+            goto cu_uring;
         }
+        ret = epoll_watch(in.epfd, EPOLL_CTL_ADD, in.ring_wake, EPOLLIN,
+                EPOLL_TAG_RING, 0);
+        if(ret != 0){
+            perror("epoll_ctl");
+            goto cu_ring_wake;
+        }
+    }
+
+    // watch before scanning, so no device can slip in between the two
+    hotplug_t hotplug;
+    if(hotplug_init(&hotplug, in.epfd)){
+        goto cu_ring_wake;
+    }
+    hotplug_cbs_t hotplug_cbs = { hotplug_open, hotplug_remove, &in };
+
+    open_inputs(in.kbs, &in.n_kbs, runopts->config->grabs, runopts->verbose);
+
+    if (in.n_kbs == 0) {
+        fprintf(stderr, "couldn't open any inputs\n");
+        goto cu_inputs;
+    }
+
+    watch_keyboards(&in, 0);
+
+    retval = 0;
 
-        struct timeval time_till_exit;
-        struct timeval *timeout = NULL;
-        if(timed_exit){
-            time_till_exit = timeval_diff(exit_time, timeval_now());
-            timeout = &time_till_exit;
+    // notify systemd we are up (if --systemd or -d was given)
+    if(runopts->systemd){
+        sd_notify(0, "READY=1");
+    }
+
+    struct epoll_event ready[32];
+    while (keep_going) {
+        if(dump_stats){
+            dump_stats = false;
+            print_input_stats(&in.stats);
+            if(uring_enabled()) uring_print_stats();
+            print_grab_stats(runopts->config->grabs);
         }
 
-        ret = select(1 + max_fd, &rd_fds, &wr_fds, NULL, timeout);
-        if(ret == -1){
+        int nready = epoll_wait(
+            in.epfd, ready, sizeof(ready)/sizeof(*ready), -1
+        );
+        if(nready == -1){
             if(errno == EINTR){
                 // signal interrupted us, restart loop
                 continue;
             }
-            perror("select");
+            perror("epoll_wait");
             retval = 1;
             break;
         }
 
-        if(app.handle_select){
-            app.handle_select(app_data, &rd_fds, &wr_fds);
+        for(int i = 0; i < nready && keep_going; i++){
+            uint64_t data = ready[i].data.u64;
+            uint32_t val = EPOLL_DATA_VAL(data);
+            int old_n_kbs;
+            switch(EPOLL_DATA_TAG(data)){
+                case EPOLL_TAG_INPUT:
+                    if(handle_keyboard(&in, &in.kbs[val])) break;
+                    close_keyboard(&in, val);
+                    /* indices in the rest of this batch may be stale now, but
+                       epoll is level-triggered so just wait again */
+                    i = nready;
+                    break;
+
+                case EPOLL_TAG_INOTIFY:
+                    old_n_kbs = in.n_kbs;
+                    hotplug_handle(&hotplug, val, &hotplug_cbs);
+                    // like above, a removal may have moved keyboards around
+                    if(in.n_kbs < old_n_kbs) i = nready;
+                    break;
+
+                case EPOLL_TAG_TIMER:
+                    if(val == TIMER_RESOLVE){
+                        resolve_timer_fire(
+                            &resolve_timer, runopts->config->grabs
+                        );
+                        break;
+                    }
+                    // if we reached the timeout, exit
+                    printf("exiting due to timeout\n");
+                    keep_going = false;
+                    break;
+
+                case EPOLL_TAG_APP:
+                    app.epoll_handle(app_data, val, ready[i].events);
+                    break;
+
+                case EPOLL_TAG_URING:
+                    uring_handle(handle_uring_read, &in);
+                    break;
+
+                case EPOLL_TAG_RING:
+                    handle_rings(&in);
+                    break;
+            }
         }
 
-        // if we reached the timeout, exit
-        if(timeout && timeout->tv_sec == 0 && timeout->tv_usec == 0){
-            printf("exiting due to timeout\n");
-            break;
+        // write out everything this wakeup produced at once
+        if(app.flush){
+            app.flush(app_data);
         }
 
-        for (i = 0; i < n_kbs; i++) {
-            if (FD_ISSET(kbs[i].fd, &rd_fds)) {
-                struct input_event ev;
-                ret = read(kbs[i].fd, &ev, sizeof(struct input_event));
-                if (ret < 1){
-                    if(errno == EAGAIN) continue;
-                    // close this keyboard and left-shift the remaining fds
-                    close(kbs[i].fd);
-                    // TODO: do something to release any pressed keys here
-                    size_t nkbs_after = MAX_KBS - i - 1;
-                    memmove(&kbs[i], &kbs[i+1], sizeof(*kbs) * nkbs_after);
-                    n_kbs--;
-                    // don't skip the new i-th entry of kbs
-                    i--;
-                    continue;
-                }
-                struct resolver *r = &kbs[i].grab->resolver;
-                // print names of keypresses
-                if(runopts->verbose && ev.type == EV_KEY && ev.value == 1){
-                    fprintf(stdout,
-                        "recv %s press\n",
-                        get_input_name(ev.code)
-                    );
-                }else if(
-                    runopts->verbose && ev.type == EV_KEY && ev.value == 0
-                ){
-                    fprintf(stdout,
-                        "recv %s release\n",
-                        get_input_name(ev.code)
-                    );
-                }
-                // dedup inputs before inserting to unresolved
-                if(!resolve_dedup_input(r, ev)) continue;
-                // avoid overflow in unresolved
-                if(r->ur_len == URMAX){
-                    fprintf(stderr, "overflow!\n");
-                    exit(1);
-                }
-                r->unresolved[(r->ur_start + r->ur_len++) % URMAX] = ev;
-                while(resolve(r));
-            }
+        // one io_uring_enter() for all of this wakeup's writes and reads
+        if(uring_enabled()){
+            uring_submit();
         }
 
-        if(FD_ISSET(inot, &rd_fds)){
-            handle_inotify_events(
-                inot, kbs, &n_kbs, runopts->config->grabs, runopts->verbose
-            );
-        }
+        // some pending dual key may have a new (or no) timeout now
+        resolve_timer_update(&resolve_timer, runopts->config->grabs);
     }
 
     if(runopts->systemd){
         sd_notify(0, "STOPPING=1");
     }
 
-    for(int i = 0; i < n_kbs; i++){
-      close(kbs[i].fd);
+    if(runopts->verbose){
+        print_input_stats(&in.stats);
+        if(uring_enabled()) uring_print_stats();
+        print_grab_stats(runopts->config->grabs);
+    }
+
+cu_inputs:
+    for(int i = 0; i < in.n_kbs; i++){
+        reader_free(in.kbs[i].reader);
+    }
+    // cancel any posted reads before closing their fds
+    uring_exit();
+    for(int i = 0; i < in.n_kbs; i++){
+      close_input(&in.kbs[i]);
     }
-    close(inot);
+    hotplug_free(&hotplug);
+cu_ring_wake:
+    if(in.ring_wake > -1) close(in.ring_wake);
+cu_uring:
+    uring_exit();
+cu_resolve_timer:
+    close(resolve_timer.fd);
+cu_timer:
+    if(exit_timer > -1) close(exit_timer);
+cu_epoll:
+    close(in.epfd);
 
     return retval;
 }
@@ -322,11 +816,11 @@ int main_serve_unix(const runopts_t *runopts, char *socket, char *lock){
 
     app_t server_app = {
         .send=server_send_event,
-        .prep_select=server_prep_select,
-        .handle_select=server_handle_select,
+        .epoll_register=server_epoll_register,
+        .epoll_handle=server_epoll_handle,
     };
 
-    retval = serve_loop(runopts, server_app, &server);
+    retval = serve_loop(runopts, server_app, &server, NULL);
 
     for(size_t i = 0; i < server.nclients; i++){
         close(server.clients[i]);
@@ -343,8 +837,8 @@ int main_serve_tcp(const runopts_t *runopts, char *host, char *port){
     kbd_server_t server = {0};
     app_t server_app = {
         .send=server_send_event,
-        .prep_select=server_prep_select,
-        .handle_select=server_handle_select,
+        .epoll_register=server_epoll_register,
+        .epoll_handle=server_epoll_handle,
     };
 
     server.accept_fd = gai_open(host, port, true);
@@ -353,7 +847,7 @@ int main_serve_tcp(const runopts_t *runopts, char *host, char *port){
         return 1;
     }
 
-    int retval = serve_loop(runopts, server_app, &server);
+    int retval = serve_loop(runopts, server_app, &server, NULL);
 
     for(size_t i = 0; i < server.nclients; i++){
         close(server.clients[i]);
@@ -362,25 +856,274 @@ int main_serve_tcp(const runopts_t *runopts, char *host, char *port){
     return retval;
 }
 
+// the most events we will buffer for uinput between flushes
+#define LOCAL_OUT_MAX 1024
+
+/* output to a uinput device, buffered so that a whole batch of resolved
+   events (which may be many frames, for a macro) costs a single write() */
+typedef struct {
+    int fd;
+    // the serve_loop's epoll set, or -1 if there isn't one
+    int epfd;
+    // true while we wait for EPOLLOUT after a write hit EAGAIN
+    bool watching;
+    struct input_event buf[LOCAL_OUT_MAX];
+    size_t len;
+} local_out_t;
+
+static void local_out_watch(local_out_t *o, bool want){
+    if(o->epfd < 0 || o->watching == want) return;
+    int op = want ? EPOLL_CTL_ADD : EPOLL_CTL_DEL;
+    if(epoll_watch(o->epfd, op, o->fd, EPOLLOUT, EPOLL_TAG_APP, o->fd)){
+        perror("epoll_ctl");
+        return;
+    }
+    o->watching = want;
+}
+
+// write out everything buffered, keeping whatever didn't fit for later
+void local_out_flush(void *data){
+    local_out_t *o = data;
+    char *buf = (char*)o->buf;
+    size_t len = o->len * sizeof(*o->buf);
+    size_t off = 0;
+    while(off < len){
+        ssize_t ret = write(o->fd, buf + off, len - off);
+        if(ret < 0){
+            if(errno == EINTR) continue;
+            if(errno == EAGAIN) break;
+            // nothing we can do with these events
+            perror("write");
+            off = len;
+            break;
+        }
+        off += ret;
+    }
+
+    // uinput only writes whole events, but round down just in case
+    size_t written = off / sizeof(*o->buf);
+    memmove(o->buf, &o->buf[written], (o->len - written) * sizeof(*o->buf));
+    o->len -= written;
+
+    // if the uinput device pushed back, retry when it is writable
+    local_out_watch(o, o->len > 0);
+}
+
+int local_out_register(void *data, int epfd){
+    local_out_t *o = data;
+    o->epfd = epfd;
+    return 0;
+}
+
+void local_out_handle(void *data, uint32_t val, uint32_t events){
+    local_out_flush(data);
+}
+
 int send_event_locally(void *data, struct input_event ev){
-  int *fd = data;
+  local_out_t *o = data;
+
+  if(uring_enabled()){
+      return uring_write(o->fd, ev);
+  }
+
+  if(o->len == LOCAL_OUT_MAX){
+      local_out_flush(o);
+      // if there's still not room to buffer the event, just drop it.
+      if(o->len == LOCAL_OUT_MAX){
+          fprintf(stderr, "Warning: full uinput buffer, dropping events\n");
+          return 0;
+      }
+  }
+  o->buf[o->len++] = ev;
+  return sizeof(ev);
+}
 
-  return write(*fd, &ev, sizeof(ev));
+// buffer a whole array of events, such as a macro, with one copy
+int send_events_locally(void *data, const struct input_event *evs, size_t n){
+  local_out_t *o = data;
+
+  if(uring_enabled()){
+      for(size_t i = 0; i < n; i++){
+          uring_write(o->fd, evs[i]);
+      }
+      return (int)(sizeof(*evs) * n);
+  }
+
+  if(o->len + n > LOCAL_OUT_MAX){
+      local_out_flush(o);
+      // if there's still not room to buffer the events, just drop them.
+      if(o->len + n > LOCAL_OUT_MAX){
+          fprintf(stderr, "Warning: full uinput buffer, dropping events\n");
+          return 0;
+      }
+  }
+  memcpy(&o->buf[o->len], evs, sizeof(*evs) * n);
+  o->len += n;
+  return (int)(sizeof(*evs) * n);
 }
 
-int main_local(const runopts_t *runopts){
-    int out_fd = open_output();
-    if (out_fd < 0) {
+// trace is passed to serve_loop (sdiol record), and may be NULL
+int main_local(const runopts_t *runopts, trace_t *trace){
+    local_out_t *out = malloc(sizeof(*out));
+    if(!out){
+        perror("malloc");
+        return 1;
+    }
+    *out = (local_out_t){ .epfd = -1 };
+
+    out->fd = open_output();
+    if (out->fd < 0) {
         fprintf(stderr, "couldn't open output\n");
+        free(out);
         return 1;
     }
     app_t local_app = {
         .send=send_event_locally,
+        .send_many=send_events_locally,
+        .flush=local_out_flush,
+        .epoll_register=local_out_register,
+        .epoll_handle=local_out_handle,
+    };
+
+    int retval = serve_loop(runopts, local_app, out, trace);
+
+    close(out->fd);
+    free(out);
+    return retval;
+}
+
+// like main_local, but also record the raw input to path
+int main_record(const runopts_t *runopts, const char *path){
+    trace_t *trace = trace_create(path);
+    if(!trace){
+        return 1;
+    }
+    int retval = main_local(runopts, trace);
+    trace_close(trace);
+    return retval;
+}
+
+// replay pacing: trace time start maps to real time real_start
+typedef struct {
+    bool max_speed;
+    nstime_t start;
+    nstime_t real_start;
+} replay_clock_t;
+
+// move the resolvers' clock forward, sleeping first unless --max-speed
+static void replay_clock_set(const replay_clock_t *c, nstime_t t){
+    if(!c->max_speed){
+        struct timespec ts = nstime_to_timespec(c->real_start + (t - c->start));
+        while(keep_going && clock_nanosleep(
+            CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL
+        ) == EINTR);
+    }
+    nstime_set_virtual(t);
+}
+
+/* advance to time t, resolving every dual key which times out and sending
+   every key repeat on the way.  With t < 0, run until nothing is waiting for
+   a timeout; keys still held at the end of the trace don't repeat forever. */
+static void replay_advance(const replay_clock_t *c, grab_t *grabs, nstime_t t){
+    nstime_t deadline;
+    while(keep_going && next_deadline(grabs, t >= 0, &deadline)
+            && (t < 0 || deadline <= t)){
+        replay_clock_set(c, deadline);
+        resolve_all(grabs);
+    }
+    if(t >= 0){
+        replay_clock_set(c, t);
+    }
+}
+
+static int send_counted(void *data, struct input_event ev){
+    unsigned long *count = data;
+    (*count)++;
+    return sizeof(ev);
+}
+
+static int send_counted_many(void *data, const struct input_event *evs,
+        size_t n){
+    unsigned long *count = data;
+    *count += n;
+    return (int)(sizeof(*evs) * n);
+}
+
+/* push a trace through the configured grabs and resolvers, with no input or
+   output devices.  The resolvers run on the trace's clock, so the results
+   are the same at original timing or at --max-speed. */
+int main_replay(const runopts_t *runopts, const char *path){
+    trace_t *trace = trace_open(path);
+    if(!trace){
+        return 1;
+    }
+
+    unsigned long emitted = 0;
+    send_dedup_t deduper = {
+        .send = send_counted,
+        .send_many = send_counted_many,
+        .send_data = &emitted,
+        .verbose = runopts->verbose,
     };
+    grab_t *grabs = runopts->config->grabs;
+    for(grab_t *g = grabs; g; g = g->next){
+        resolver_init(&g->resolver, &g->map, send_dedup, &deduper);
+        resolver_set_send_many(&g->resolver, send_dedup_many);
+        resolver_set_repeat(
+            &g->resolver, g->repeat_delay_ms, g->repeat_interval_ms
+        );
+        resolver_set_combos(&g->resolver, runopts->config->combos);
+        resolver_set_leaders(&g->resolver, runopts->config->leaders);
+    }
+
+    // which grab, if any, each device in the trace would have matched
+    grab_t *dev_grabs[TRACE_MAX_DEVICES] = {0};
 
-    int retval = serve_loop(runopts, local_app, &out_fd);
+    replay_clock_t clock = { .max_speed = runopts->max_speed, .start = -1 };
+    unsigned long replayed = 0;
+    nstime_t real_start = nstime_monotonic();
 
-    close(out_fd);
+    int retval = 0;
+    while(keep_going){
+        int dev;
+        const char *name;
+        struct input_event ev;
+        trace_rec_t rec = trace_read(trace, &dev, &name, &ev);
+        if(rec == TRACE_END) break;
+        if(rec == TRACE_ERROR){
+            retval = 1;
+            break;
+        }
+        if(rec == TRACE_DEVICE){
+            dev_grabs[dev] = check_grabs(grabs, name);
+            if(runopts->verbose){
+                printf("%s %s\n", dev_grabs[dev] ? "grabbing" : "ignoring",
+                        name);
+            }
+            continue;
+        }
+
+        nstime_t t = nstime_from_timeval(ev.time);
+        if(clock.start < 0){
+            clock.start = t;
+            clock.real_start = nstime_monotonic();
+        }
+        replay_advance(&clock, grabs, t);
+
+        grab_t *grab = dev_grabs[dev];
+        if(!grab) continue;
+        handle_input_event(runopts, &grab->resolver, ev);
+        replayed++;
+    }
+    // let any dual key still pending time out
+    replay_advance(&clock, grabs, -1);
+
+    double secs = (nstime_monotonic() - real_start) / (double)NS_PER_SEC;
+    printf("replayed %lu events in %.3fs (%.0f events/s), emitted %lu\n",
+            replayed, secs, secs > 0 ? replayed / secs : 0, emitted);
+    print_grab_stats(grabs);
+
+    trace_close(trace);
     return retval;
 }
 
@@ -395,9 +1138,17 @@ int first_newline(char *string, int maxlen){
 
 // read from a file descriptor; we don't care what kind
 int main_read(const runopts_t *runopts, int fd){
-    int out_fd = open_output();
-    if (out_fd < 0) {
+    local_out_t *out = malloc(sizeof(*out));
+    if(!out){
+        perror("malloc");
+        return 1;
+    }
+    *out = (local_out_t){ .epfd = -1 };
+
+    out->fd = open_output();
+    if (out->fd < 0) {
         fprintf(stderr, "couldn't open output\n");
+        free(out);
         return 1;
     }
 
@@ -455,19 +1206,23 @@ int main_read(const runopts_t *runopts, int fd){
                 if(runopts->verbose && ev.type == EV_KEY && ev.value == 1){
                     fprintf(stderr, "%s\n", get_input_name(ev.code));
                 }
-                send_event_locally(&out_fd, ev);
+                send_event_locally(out, ev);
             }
             // discard the line
             memmove(buffer, &buffer[idx + 1], blen - idx - 1);
             blen -= idx + 1;
         }
+
+        // write everything we got from this read() at once
+        local_out_flush(out);
     }
 
     if(runopts->systemd){
         sd_notify(0, "STOPPING=1");
     }
 
-    close(out_fd);
+    close(out->fd);
+    free(out);
 
     return retval;
 }
@@ -492,6 +1247,9 @@ void print_help(FILE *dst){
         "usage: sdiol local                  # modify local IO\n"
         "usage: sdiol serve unix_socket      # serve IO over a unix socket\n"
         "usage: sdiol read                   # read IO from STDIN\n"
+        "usage: sdiol record FILE            # modify local IO, recording it\n"
+        "usage: sdiol replay FILE            # run recorded IO through config\n"
+        "usage: sdiol compile CONFIG -o OUT  # precompile a lua config\n"
         "\n"
         "# insecure, experimental features:\n"
         "usage: sdiol serve-tcp [host] port  # serve IO over the network\n"
@@ -500,9 +1258,25 @@ void print_help(FILE *dst){
         "general options:\n"
         " -h, --help           print this help text\n"
         " -c, --config FILE    set config file (default /etc/sdiol/conf.lua)\n"
+        "     --cache-dir DIR  cache compiled configs in DIR\n"
+        "                      (default " CONFIG_CACHE_DIR ")\n"
+        "     --no-cache       always run the lua config\n"
         " -v, --verbose        print useful info while running\n"
         "     --timeout N      exit after N seconds (for testing)\n"
         "     --systemd        run as systemd Type=notify service\n"
+        "     --io-uring       use io_uring for device reads and uinput\n"
+        "                      writes\n"
+        "     --threaded       read each device from its own thread\n"
+        "     --realtime       run as SCHED_FIFO with all memory locked\n"
+        "     --rt-priority N  SCHED_FIFO priority for --realtime\n"
+        "                      (default 50)\n"
+        "     --rt-cpu N       pin to cpu N for --realtime\n"
+        "\n"
+        "options specific to sdiol compile:\n"
+        " -o, --output FILE          where to write the compiled config\n"
+        "\n"
+        "options specific to sdiol replay:\n"
+        " --max-speed                replay without the original timing\n"
         "\n"
         "options specific to sdiol serve:\n"
         " --chown-socket USER:GROUP  set user and group of unix socket\n"
@@ -513,21 +1287,31 @@ void print_help(FILE *dst){
 // Separate positional args and options; return 0 on success or -1 on error
 int parse_opts(int argc, char **argv, int *nargs, char ***args, opts_t *opts){
     // configure cli options
-    char *optstring = "hc:v";
+    char *optstring = "hc:vo:";
     struct option longopts[] = {
         {.name="help", .has_arg=0, .flag=NULL, .val='h'},
         {.name="config", .has_arg=1, .flag=NULL, .val='c'},
         {.name="verbose", .has_arg=0, .flag=NULL, .val='v'},
+        {.name="cache-dir", .has_arg=1, .flag=NULL, .val='D'},
+        {.name="no-cache", .has_arg=0, .flag=NULL, .val='N'},
+        {.name="output", .has_arg=1, .flag=NULL, .val='o'},
         {.name="timeout", .has_arg=1, .flag=NULL, .val='t'},
         {.name="systemd", .has_arg=0, .flag=NULL, .val='d'},
-        {.name="chown-socket", .has_arg=1, .flag=NULL, .val='o'},
+        {.name="chown-socket", .has_arg=1, .flag=NULL, .val='U'},
         {.name="chmod-socket", .has_arg=1, .flag=NULL, .val='p'},
+        {.name="io-uring", .has_arg=0, .flag=NULL, .val='u'},
+        {.name="threaded", .has_arg=0, .flag=NULL, .val='T'},
+        {.name="realtime", .has_arg=0, .flag=NULL, .val='R'},
+        {.name="rt-priority", .has_arg=1, .flag=NULL, .val='P'},
+        {.name="rt-cpu", .has_arg=1, .flag=NULL, .val='C'},
+        {.name="max-speed", .has_arg=0, .flag=NULL, .val='M'},
         {0},
     };
 
     // set default options
     *opts = (opts_t){
         .config="/etc/sdiol/conf.lua",
+        .cache_dir=CONFIG_CACHE_DIR,
     };
 
     // read all options
@@ -544,18 +1328,45 @@ int parse_opts(int argc, char **argv, int *nargs, char ***args, opts_t *opts){
             case 'v':
                 opts->verbose = true;
                 break;
+            case 'D':
+                opts->cache_dir = optarg;
+                break;
+            case 'N':
+                opts->no_cache = true;
+                break;
+            case 'o':
+                opts->output = optarg;
+                break;
             case 't':
                 opts->timeout = optarg;
                 break;
             case 'd':
                 opts->systemd = true;
                 break;
-            case 'o':
+            case 'U':
                 opts->user_group = optarg;
                 break;
             case 'm':
                 opts->mode = optarg;
                 break;
+            case 'u':
+                opts->io_uring = true;
+                break;
+            case 'T':
+                opts->threaded = true;
+                break;
+            case 'R':
+                opts->realtime = true;
+                break;
+            case 'P':
+                opts->rt_priority = optarg;
+                break;
+            case 'C':
+                opts->rt_cpu = optarg;
+                break;
+            case 'M':
+                opts->max_speed = true;
+                break;
             default:
                 fprintf(stderr, "invalid option during parsing\n");
                 return -1;
@@ -630,7 +1441,10 @@ int runopts_build(runopts_t *runopts, const opts_t *opts){
 
     // read config file
     if(opts->config){
-        runopts->config = config_new(opts->config);
+        runopts->config = config_open(
+            opts->config, opts->no_cache ? NULL : opts->cache_dir,
+            opts->verbose
+        );
         if(!runopts->config){
             goto fail_user_group;
         }
@@ -644,9 +1458,36 @@ int runopts_build(runopts_t *runopts, const opts_t *opts){
     runopts->systemd = opts->systemd;
     runopts->verbose = opts->verbose;
     runopts->mode = opts->mode;
+    runopts->io_uring = opts->io_uring;
+    runopts->threaded = opts->threaded;
+    runopts->max_speed = opts->max_speed;
+    if(runopts->io_uring && runopts->threaded){
+        fprintf(stderr, "--io-uring and --threaded cannot be combined\n");
+        goto fail_config;
+    }
+
+    runopts->realtime = opts->realtime;
+    runopts->rt_priority = RT_PRIORITY_DEFAULT;
+    if(opts->rt_priority){
+        runopts->rt_priority = atoi(opts->rt_priority);
+        if(runopts->rt_priority < 1 || runopts->rt_priority > 99){
+            fprintf(stderr, "--rt-priority must be between 1 and 99\n");
+            goto fail_config;
+        }
+    }
+    runopts->rt_cpu = -1;
+    if(opts->rt_cpu){
+        runopts->rt_cpu = atoi(opts->rt_cpu);
+        if(runopts->rt_cpu < 0){
+            fprintf(stderr, "--rt-cpu must not be negative\n");
+            goto fail_config;
+        }
+    }
 
     return 0;
 
+fail_config:
+    config_free(runopts->config);
 fail_user_group:
     free(runopts->user);
     free(runopts->group);
@@ -688,6 +1529,16 @@ int main(int argc, char **argv) {
         goto cu_names;
     }
 
+    // compiling a config doesn't need one loaded
+    if(nargs > 0 && !strcmp(args[0], "compile")){
+        if(nargs != 2 || !opts.output){
+            print_help(stderr);
+            goto cu_names;
+        }
+        retval = config_compile(args[1], opts.output) ? 1 : 0;
+        goto cu_names;
+    }
+
     runopts_t runopts;
     if(runopts_build(&runopts, &opts)){
         goto cu_names;
@@ -696,6 +1547,7 @@ int main(int argc, char **argv) {
     // prepare for signals
     signal(SIGINT, quit_on_signal);
     signal(SIGTERM, quit_on_signal);
+    signal(SIGUSR1, dump_stats_on_signal);
     signal(SIGPIPE, SIG_IGN);
 
     // interpret position arguments
@@ -707,7 +1559,23 @@ int main(int argc, char **argv) {
             if(nargs != 1){
                 goto help;
             }
-            retval = main_local(&runopts);
+            retval = main_local(&runopts, NULL);
+            goto cu_opts;
+        }
+
+        if(!strcmp(args[0], "record")){
+            if(nargs != 2){
+                goto help;
+            }
+            retval = main_record(&runopts, args[1]);
+            goto cu_opts;
+        }
+
+        if(!strcmp(args[0], "replay")){
+            if(nargs != 2){
+                goto help;
+            }
+            retval = main_replay(&runopts, args[1]);
             goto cu_opts;
         }
 
@@ -8,6 +8,15 @@
 #include <sys/socket.h>
 #include <arpa/inet.h>
 
+// toggle EPOLLOUT on the active client, depending on if we have data for it
+static void watch_active_client(kbd_server_t *s){
+    if(s->nclients == 0) return;
+    int fd = s->clients[s->active_client];
+    uint32_t events = EPOLLIN;
+    if(s->fc_len > 0) events |= EPOLLOUT;
+    epoll_watch(s->epfd, EPOLL_CTL_MOD, fd, events, EPOLL_TAG_APP, fd);
+}
+
 int server_send_event(void *app_data, struct input_event ev){
     kbd_server_t *s = app_data;
     // drop the event if we have no clients
@@ -31,36 +40,30 @@ int server_send_event(void *app_data, struct input_event ev){
     memcpy(&s->for_client[s->fc_len], buffer, len);
     s->fc_len += len;
 
+    // the buffer just became non-empty, so start watching for writability
+    if(s->fc_len == (size_t)len){
+        watch_active_client(s);
+    }
+
     return len;
 }
 
-int server_prep_select(void *app_data, fd_set *r_fds, fd_set *w_fds){
+int server_epoll_register(void *app_data, int epfd){
     kbd_server_t *s = app_data;
-    int max_fd = -1;
+    s->epfd = epfd;
 
     // watch for incoming connections
-    FD_SET(s->accept_fd, r_fds);
-    if(s->accept_fd > max_fd)
-        max_fd = s->accept_fd;
-
-    // monitor clients for broken connections
-    for(size_t i = 0; i < s->nclients; i++){
-        FD_SET(s->clients[i], r_fds);
-        if(s->clients[i] > max_fd)
-            max_fd = s->clients[i];
+    int ret = epoll_watch(epfd, EPOLL_CTL_ADD, s->accept_fd, EPOLLIN,
+            EPOLL_TAG_APP, s->accept_fd);
+    if(ret != 0){
+        perror("epoll_ctl");
+        return -1;
     }
-
-    // do we need to write to the active client?
-    if(s->nclients > 0 && s->fc_len > 0){
-        FD_SET(s->clients[s->active_client], w_fds);
-        if(s->clients[s->active_client] > max_fd)
-            max_fd = s->clients[s->active_client];
-    }
-
-    return max_fd;
+    return 0;
 }
 
 void server_close_client(kbd_server_t *s, size_t i){
+    // closing the fd also removes it from the epoll set
     close(s->clients[i]);
     size_t nafter = sizeof(s->clients)/sizeof(*s->clients) - i - 1;
     memmove(&s->clients[i], &s->clients[i+1],
@@ -75,59 +78,85 @@ void server_close_client(kbd_server_t *s, size_t i){
     s->nclients--;
 }
 
-void server_handle_select(void *app_data, fd_set *r_fds, fd_set *w_fds){
-    kbd_server_t *s = app_data;
+static void server_accept(kbd_server_t *s){
+    int client = accept(s->accept_fd, NULL, 0);
+    if(client < 0){
+        perror("accept");
+        exit(7);
+    }
 
-    // check if we can write to the active client
-    if(s->nclients > 0 && FD_ISSET(s->clients[s->active_client], w_fds)){
-        ssize_t len = send(s->clients[s->active_client], s->for_client,
-                s->fc_len, 0);
-        if(len <= 0){
-            fprintf(stderr, "failed to write to active client\n");
-            server_close_client(s, s->active_client);
-        }else{
-            s->fc_len -= len;
-        }
+    if(s->nclients + 1 > sizeof(s->clients) / sizeof(*s->clients)){
+        fprintf(stderr, "too many clients\n");
+        // too many clients already
+        close(client);
+        return;
     }
 
-    // check for any disconnected clients
-    for(size_t i = 0; i < s->nclients; i++){
-        if(FD_ISSET(s->clients[i], r_fds)){
-            char buffer[4096];
-            ssize_t len = read(s->clients[i], buffer, sizeof(buffer));
-            // we never actually expect to read from a client
-            if(len > 1){
-                fprintf(stderr, "read unexpected bytes from a client\n");
-            }else{
-                fprintf(stderr, "client connection terminated\n");
-                server_close_client(s, i);
-                i--;
-            }
-        }
+    // monitor the client for broken connections
+    int ret = epoll_watch(s->epfd, EPOLL_CTL_ADD, client, EPOLLIN,
+            EPOLL_TAG_APP, client);
+    if(ret != 0){
+        perror("epoll_ctl");
+        close(client);
+        return;
     }
 
+    s->clients[s->nclients++] = client;
+
+    // ui hack: make the latest client active and kick the previous client.
+    if(s->nclients > 1){
+        close(s->clients[0]);
+        s->nclients--;
+        s->clients[0] = client;
+    }
+
+    // there may already be data waiting for the active client
+    watch_active_client(s);
+}
+
+void server_epoll_handle(void *app_data, uint32_t val, uint32_t events){
+    kbd_server_t *s = app_data;
+    int fd = (int)val;
+
     // handle accept
-    if(FD_ISSET(s->accept_fd, r_fds)){
-        int client = accept(s->accept_fd, NULL, 0);
-        if(client < 0){
-            perror("accept");
-            exit(7);
-        }
+    if(fd == s->accept_fd){
+        server_accept(s);
+        return;
+    }
+
+    // find which client this is
+    size_t i;
+    for(i = 0; i < s->nclients; i++){
+        if(s->clients[i] == fd) break;
+    }
+    // the client must have been closed earlier in this batch of events
+    if(i == s->nclients) return;
 
-        if(s->nclients + 1 > sizeof(s->clients) / sizeof(*s->clients)){
-            fprintf(stderr, "too many clients\n");
-            // too many clients already
-            close(client);
+    // check if we can write to the active client
+    if(i == s->active_client && (events & EPOLLOUT)){
+        ssize_t len = send(fd, s->for_client, s->fc_len, 0);
+        if(len <= 0){
+            fprintf(stderr, "failed to write to active client\n");
+            server_close_client(s, i);
             return;
         }
+        s->fc_len -= len;
+        memmove(s->for_client, &s->for_client[len], s->fc_len);
+        if(s->fc_len == 0){
+            watch_active_client(s);
+        }
+    }
 
-        s->clients[s->nclients++] = client;
-
-        // ui hack: make the latest client active and kick the previous client.
-        if(s->nclients > 1){
-            close(s->clients[0]);
-            s->nclients--;
-            s->clients[0] = client;
+    // check for a disconnected client
+    if(events & (EPOLLIN | EPOLLHUP | EPOLLERR)){
+        char buffer[4096];
+        ssize_t len = read(fd, buffer, sizeof(buffer));
+        // we never actually expect to read from a client
+        if(len > 1){
+            fprintf(stderr, "read unexpected bytes from a client\n");
+        }else{
+            fprintf(stderr, "client connection terminated\n");
+            server_close_client(s, i);
         }
     }
 }
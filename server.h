@@ -11,11 +11,13 @@ typedef struct {
     char for_client[8192];
     size_t fc_len;
     int accept_fd;
+    // the serve_loop's epoll set, set by server_epoll_register()
+    int epfd;
 } kbd_server_t;
 
 int server_send_event(void *app_data, struct input_event ev);
-int server_prep_select(void *app_data, fd_set *r_fds, fd_set *w_fds);
+int server_epoll_register(void *app_data, int epfd);
 void server_close_client(kbd_server_t *s, size_t i);
-void server_handle_select(void *app_data, fd_set *r_fds, fd_set *w_fds);
+void server_epoll_handle(void *app_data, uint32_t val, uint32_t events);
 
 #endif // SERVER_H
@@ -0,0 +1,71 @@
+#ifndef SPSC_H
+#define SPSC_H
+
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <linux/input.h>
+
+/* A wait-free single-producer/single-consumer ring of input_events.  The
+   producer only writes tail and the consumer only writes head; each side
+   publishes with a release store and observes the other with an acquire
+   load, so neither ever blocks or retries. */
+
+// must be a power of two
+#define SPSC_SIZE 4096
+
+typedef struct {
+    // consumer-owned, on its own cache line to avoid false sharing
+    _Alignas(64) _Atomic size_t head;
+    // producer-owned
+    _Alignas(64) _Atomic size_t tail;
+    _Alignas(64) struct input_event buf[SPSC_SIZE];
+} spsc_ring_t;
+
+static inline void spsc_init(spsc_ring_t *q){
+    atomic_init(&q->head, 0);
+    atomic_init(&q->tail, 0);
+}
+
+// producer side: push up to n events, returning how many fit
+static inline size_t spsc_push(spsc_ring_t *q, const struct input_event *evs,
+        size_t n){
+    size_t tail = atomic_load_explicit(&q->tail, memory_order_relaxed);
+    size_t head = atomic_load_explicit(&q->head, memory_order_acquire);
+    size_t space = SPSC_SIZE - (tail - head);
+    if(n > space) n = space;
+    for(size_t i = 0; i < n; i++){
+        q->buf[(tail + i) & (SPSC_SIZE - 1)] = evs[i];
+    }
+    atomic_store_explicit(&q->tail, tail + n, memory_order_release);
+    return n;
+}
+
+// consumer side: pop up to max events, returning how many were popped
+static inline size_t spsc_pop(spsc_ring_t *q, struct input_event *out,
+        size_t max){
+    size_t head = atomic_load_explicit(&q->head, memory_order_relaxed);
+    size_t tail = atomic_load_explicit(&q->tail, memory_order_acquire);
+    size_t n = tail - head;
+    if(n > max) n = max;
+    for(size_t i = 0; i < n; i++){
+        out[i] = q->buf[(head + i) & (SPSC_SIZE - 1)];
+    }
+    atomic_store_explicit(&q->head, head + n, memory_order_release);
+    return n;
+}
+
+// consumer side
+static inline bool spsc_empty(spsc_ring_t *q){
+    size_t head = atomic_load_explicit(&q->head, memory_order_relaxed);
+    return atomic_load_explicit(&q->tail, memory_order_acquire) == head;
+}
+
+// producer side
+static inline bool spsc_full(spsc_ring_t *q){
+    size_t tail = atomic_load_explicit(&q->tail, memory_order_relaxed);
+    size_t head = atomic_load_explicit(&q->head, memory_order_acquire);
+    return tail - head == SPSC_SIZE;
+}
+
+#endif // SPSC_H
@@ -0,0 +1,236 @@
+/* Combos, driven the way the serve_loop drives the resolver, on the virtual
+   clock which `sdiol replay` uses.  With J+K and J+K+L configured, a chord
+   fires when all of its keys are pressed, when the timeout passes with a
+   shorter chord complete, or when one of its keys is released; a key outside
+   the chord or a key pressed too late types the keys as themselves.  Every
+   burst of output must end in a SYN_REPORT. */
+
+#include "combo.h"
+#include "resolver.h"
+#include "time_util.h"
+
+#include <stdbool.h>
+#include <stdio.h>
+
+#define TIMEOUT_MS 40
+
+static struct resolver r;
+
+// a dense root keymap, where every key is itself
+static key_action_t keys[KEY_MAX];
+static key_action_t *lookup[KEY_MAX];
+static key_action_t root = { .type = KT_MAP };
+
+static combos_t combos;
+
+static struct input_event sent[64];
+static size_t n_sent;
+
+static int record(void *data, struct input_event ev){
+    if(n_sent < sizeof(sent) / sizeof(*sent)) sent[n_sent] = ev;
+    n_sent++;
+    return sizeof(ev);
+}
+
+// the index in sent of a key event, or -1
+static int sent_at(uint16_t code, int32_t value){
+    for(size_t i = 0; i < n_sent; i++){
+        if(sent[i].type == EV_KEY && sent[i].code == code
+                && sent[i].value == value){
+            return (int)i;
+        }
+    }
+    return -1;
+}
+
+static void build_config(void){
+    for(int i = 0; i < KEY_MAX; i++){
+        keys[i] = (key_action_t){ .type = KT_SIMPLE, .key = { .simple = i } };
+        lookup[i] = &keys[i];
+    }
+    root.key.lookup = lookup;
+
+    combos.combos[0] = (struct combo){
+        .action = { .type = KT_SIMPLE, .key = { .simple = KEY_ESC } },
+        .timeout = msec_to_ns(TIMEOUT_MS),
+        .n_keys = 2,
+    };
+    combos.combos[1] = (struct combo){
+        .action = { .type = KT_SIMPLE, .key = { .simple = KEY_TAB } },
+        .timeout = msec_to_ns(TIMEOUT_MS),
+        .n_keys = 3,
+    };
+    combos.n = 2;
+    combos.key_masks[KEY_J] = 0x3;
+    combos.key_masks[KEY_K] = 0x3;
+    combos.key_masks[KEY_L] = 0x2;
+    combos.size_masks[2] = 0x1;
+    combos.size_masks[3] = 0x2;
+}
+
+static void start(void){
+    resolver_init(&r, &root, record, NULL);
+    resolver_set_combos(&r, &combos);
+    n_sent = 0;
+}
+
+static void push(nstime_t t, uint16_t type, uint16_t code, int32_t value){
+    struct input_event ev = {
+        .time = {
+            .tv_sec = t / NS_PER_SEC,
+            .tv_usec = (t % NS_PER_SEC) / NS_PER_USEC,
+        },
+        .type = type,
+        .code = code,
+        .value = value,
+    };
+    nstime_set_virtual(t);
+    resolver_push(&r, ev);
+}
+
+// a key event in a frame of its own, as evdev sends it
+static void push_key(nstime_t t, uint16_t code, int32_t value){
+    push(t, EV_KEY, code, value);
+    push(t, EV_SYN, SYN_REPORT, 0);
+}
+
+// let the timer fire, if one is due; returns false if none is
+static bool fire_timer(void){
+    nstime_t deadline;
+    if(!resolve_deadline(&r, &deadline)) return false;
+    nstime_set_virtual(deadline);
+    while(resolve(&r));
+    resolver_tick(&r, deadline);
+    return true;
+}
+
+// anything sent must be followed by a SYN_REPORT; returns 0 or -1
+static int check_framed(const char *name){
+    if(n_sent && sent[n_sent - 1].type != EV_SYN){
+        fprintf(stderr, "%s: output doesn't end with a SYN_REPORT\n", name);
+        return -1;
+    }
+    return 0;
+}
+
+// every key of a chord taps the combo's action, released with the first key
+static int check_all_keys(void){
+    start();
+    nstime_t t = 1000 * NS_PER_SEC;
+    push_key(t, KEY_J, 1);
+    push_key(t + msec_to_ns(10), KEY_K, 1);
+    push_key(t + msec_to_ns(20), KEY_L, 1);
+    if(sent_at(KEY_TAB, 1) < 0 || check_framed("all keys")) return -1;
+    push_key(t + msec_to_ns(100), KEY_K, 0);
+    push_key(t + msec_to_ns(110), KEY_L, 0);
+    if(sent_at(KEY_TAB, 0) >= 0){
+        fprintf(stderr, "all keys: released before the first key\n");
+        return -1;
+    }
+    push_key(t + msec_to_ns(120), KEY_J, 0);
+    if(sent_at(KEY_TAB, 0) < 0 || check_framed("all keys")) return -1;
+    for(size_t i = 0; i < n_sent; i++){
+        if(sent[i].type == EV_KEY && sent[i].code != KEY_TAB){
+            fprintf(stderr, "all keys: sent a chord key as itself\n");
+            return -1;
+        }
+    }
+    return 0;
+}
+
+// J+K, with J+K+L still possible, fires when the timeout passes
+static int check_timeout(void){
+    start();
+    nstime_t t = 1000 * NS_PER_SEC;
+    push_key(t, KEY_J, 1);
+    push_key(t + msec_to_ns(10), KEY_K, 1);
+    if(n_sent){
+        fprintf(stderr, "timeout: fired while a longer chord could follow\n");
+        return -1;
+    }
+    if(!fire_timer() || sent_at(KEY_ESC, 1) < 0 || sent_at(KEY_TAB, 1) >= 0){
+        fprintf(stderr, "timeout: J+K didn't fire when the timeout passed\n");
+        return -1;
+    }
+    return check_framed("timeout");
+}
+
+// releasing a key of a complete chord fires it without waiting
+static int check_release(void){
+    start();
+    nstime_t t = 1000 * NS_PER_SEC;
+    push_key(t, KEY_J, 1);
+    push_key(t + msec_to_ns(10), KEY_K, 1);
+    push_key(t + msec_to_ns(20), KEY_K, 0);
+    if(sent_at(KEY_ESC, 1) < 0){
+        fprintf(stderr, "release: J+K didn't fire on K's release\n");
+        return -1;
+    }
+    push_key(t + msec_to_ns(30), KEY_J, 0);
+    if(sent_at(KEY_ESC, 0) < 0 || sent_at(KEY_J, 1) >= 0
+            || sent_at(KEY_K, 1) >= 0){
+        fprintf(stderr, "release: chord keys leaked out\n");
+        return -1;
+    }
+    return check_framed("release");
+}
+
+// a key outside every chord breaks it, and the keys type as themselves
+static int check_broken(void){
+    start();
+    nstime_t t = 1000 * NS_PER_SEC;
+    push_key(t, KEY_J, 1);
+    push_key(t + msec_to_ns(10), KEY_A, 1);
+    int j = sent_at(KEY_J, 1), a = sent_at(KEY_A, 1);
+    if(j < 0 || a < j || sent_at(KEY_ESC, 1) >= 0){
+        fprintf(stderr, "broken: expected J then A\n");
+        return -1;
+    }
+    return check_framed("broken");
+}
+
+// the rest of a chord pressed after the timeout types as itself
+static int check_too_slow(void){
+    start();
+    nstime_t t = 1000 * NS_PER_SEC;
+    push_key(t, KEY_J, 1);
+    // the serve_loop's timer fires before the second key
+    if(!fire_timer() || sent_at(KEY_J, 1) < 0 || check_framed("too slow")){
+        fprintf(stderr, "too slow: J wasn't typed when the timeout passed\n");
+        return -1;
+    }
+    // K might start a chord of its own, so it waits for its own timeout
+    push_key(t + msec_to_ns(TIMEOUT_MS + 10), KEY_K, 1);
+    fire_timer();
+    if(sent_at(KEY_K, 1) < 0 || sent_at(KEY_ESC, 1) >= 0){
+        fprintf(stderr, "too slow: a late K completed the chord\n");
+        return -1;
+    }
+
+    // or, with no timer in between, a late key still breaks the chord
+    start();
+    push_key(t, KEY_J, 1);
+    push_key(t + msec_to_ns(TIMEOUT_MS + 10), KEY_K, 1);
+    if(sent_at(KEY_J, 1) < 0){
+        fprintf(stderr, "too slow: a late K didn't break the chord\n");
+        return -1;
+    }
+    fire_timer();
+    int j = sent_at(KEY_J, 1), k = sent_at(KEY_K, 1);
+    if(j < 0 || k < j || sent_at(KEY_ESC, 1) >= 0){
+        fprintf(stderr, "too slow: expected J then K\n");
+        return -1;
+    }
+    return check_framed("too slow");
+}
+
+int main(void){
+    build_config();
+    int retval = 0;
+    if(check_all_keys()) retval = 1;
+    if(check_timeout()) retval = 1;
+    if(check_release()) retval = 1;
+    if(check_broken()) retval = 1;
+    if(check_too_slow()) retval = 1;
+    return retval;
+}
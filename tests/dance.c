@@ -0,0 +1,256 @@
+/* Tap dances, driven the way the serve_loop drives the resolver, on the
+   virtual clock which `sdiol replay` uses.  KEY_D dances X, Y and Z for one,
+   two and three taps, and holding it on the second tap holds LEFTSHIFT.  This
+   checks each count, the hold variant and a hold without one, a dance cut
+   short by another key, and a press which comes after the dance timed out.
+   Whatever a timeout decides must go out in frames of its own, with a
+   SYN_REPORT after each press and each release. */
+
+#include "resolver.h"
+#include "time_util.h"
+
+#include <stdbool.h>
+#include <stdio.h>
+
+#define TAPPING_MS 200
+
+static struct resolver r;
+
+// a dense root keymap, where every key is itself except for KEY_D
+static key_action_t keys[KEY_MAX];
+static key_action_t *lookup[KEY_MAX];
+static key_action_t root = { .type = KT_MAP };
+
+static key_action_t taps[3] = {
+    { .type = KT_SIMPLE, .key = { .simple = KEY_X } },
+    { .type = KT_SIMPLE, .key = { .simple = KEY_Y } },
+    { .type = KT_SIMPLE, .key = { .simple = KEY_Z } },
+};
+static key_action_t holds[3] = {
+    { .type = KT_NONE },
+    { .type = KT_SIMPLE, .key = { .simple = KEY_LEFTSHIFT } },
+    { .type = KT_NONE },
+};
+static key_dance_t dance = {
+    .refs = 1,
+    .n = 3,
+    .tapping_ms = TAPPING_MS,
+    .taps = taps,
+    .holds = holds,
+};
+
+static struct input_event sent[64];
+static size_t n_sent;
+
+static int record(void *data, struct input_event ev){
+    if(n_sent < sizeof(sent) / sizeof(*sent)) sent[n_sent] = ev;
+    n_sent++;
+    return sizeof(ev);
+}
+
+// the index in sent of the nth (from 0) such key event, or -1
+static int sent_nth(uint16_t code, int32_t value, int nth){
+    for(size_t i = 0; i < n_sent; i++){
+        if(sent[i].type == EV_KEY && sent[i].code == code
+                && sent[i].value == value && nth-- == 0){
+            return (int)i;
+        }
+    }
+    return -1;
+}
+
+static int sent_at(uint16_t code, int32_t value){
+    return sent_nth(code, value, 0);
+}
+
+static size_t keys_sent(void){
+    size_t n = 0;
+    for(size_t i = 0; i < n_sent; i++){
+        if(sent[i].type == EV_KEY) n++;
+    }
+    return n;
+}
+
+static bool syn_between(int from, int to){
+    for(int i = from + 1; i < to; i++){
+        if(sent[i].type == EV_SYN) return true;
+    }
+    return false;
+}
+
+/* code was pressed and released, with a SYN_REPORT after each; returns 0 or
+   -1 */
+static int check_tap(const char *name, uint16_t code){
+    int press = sent_at(code, 1), release = sent_at(code, 0);
+    if(press < 0 || release < press){
+        fprintf(stderr, "%s: key %d wasn't tapped\n", name, code);
+        return -1;
+    }
+    if(!syn_between(press, release) || !syn_between(release, (int)n_sent)){
+        fprintf(stderr, "%s: key %d wasn't tapped in frames of its own\n",
+                name, code);
+        return -1;
+    }
+    return 0;
+}
+
+static void build_keymap(void){
+    for(int i = 0; i < KEY_MAX; i++){
+        keys[i] = (key_action_t){ .type = KT_SIMPLE, .key = { .simple = i } };
+        lookup[i] = &keys[i];
+    }
+    keys[KEY_D] = (key_action_t){
+        .type = KT_DANCE, .key = { .dance = &dance },
+    };
+    root.key.lookup = lookup;
+}
+
+static void start(void){
+    resolver_init(&r, &root, record, NULL);
+    n_sent = 0;
+}
+
+static void push(nstime_t t, uint16_t type, uint16_t code, int32_t value){
+    struct input_event ev = {
+        .time = {
+            .tv_sec = t / NS_PER_SEC,
+            .tv_usec = (t % NS_PER_SEC) / NS_PER_USEC,
+        },
+        .type = type,
+        .code = code,
+        .value = value,
+    };
+    nstime_set_virtual(t);
+    resolver_push(&r, ev);
+}
+
+// a key event in a frame of its own, as evdev sends it
+static void push_key(nstime_t t, uint16_t code, int32_t value){
+    push(t, EV_KEY, code, value);
+    push(t, EV_SYN, SYN_REPORT, 0);
+}
+
+// tap KEY_D n times, 50ms apart, starting at t; returns when the last ended
+static nstime_t tap_d(nstime_t t, int n){
+    for(int i = 0; i < n; i++){
+        push_key(t, KEY_D, 1);
+        push_key(t + msec_to_ns(20), KEY_D, 0);
+        t += msec_to_ns(50);
+    }
+    return t - msec_to_ns(30);
+}
+
+// let the timer fire, if one is due; returns false if none is
+static bool fire_timer(void){
+    nstime_t deadline;
+    if(!resolve_deadline(&r, &deadline)) return false;
+    nstime_set_virtual(deadline);
+    while(resolve(&r));
+    resolver_tick(&r, deadline);
+    return true;
+}
+
+// n taps, decided by the timeout unless there are as many as the dance has
+static int check_taps(int n, uint16_t code){
+    static const char *names[] = { "", "1 tap", "2 taps", "3 taps" };
+    start();
+    tap_d(1000 * NS_PER_SEC, n);
+    if(n < 3){
+        if(keys_sent()){
+            fprintf(stderr, "%s: decided before the timeout\n", names[n]);
+            return -1;
+        }
+        if(!fire_timer()){
+            fprintf(stderr, "%s: no deadline for the dance\n", names[n]);
+            return -1;
+        }
+    }
+    if(check_tap(names[n], code)) return -1;
+    if(keys_sent() != 2){
+        fprintf(stderr, "%s: typed more than one tap\n", names[n]);
+        return -1;
+    }
+    return 0;
+}
+
+// held on the second tap: the hold variant, released with the key
+static int check_hold(void){
+    start();
+    nstime_t t = tap_d(1000 * NS_PER_SEC, 1) + msec_to_ns(30);
+    push_key(t, KEY_D, 1);
+    if(!fire_timer()){
+        fprintf(stderr, "hold: no deadline for the dance\n");
+        return -1;
+    }
+    int press = sent_at(KEY_LEFTSHIFT, 1);
+    if(press < 0 || !syn_between(press, (int)n_sent)){
+        fprintf(stderr, "hold: LEFTSHIFT wasn't pressed in a frame\n");
+        return -1;
+    }
+    if(sent_at(KEY_LEFTSHIFT, 0) >= 0 || sent_at(KEY_Y, 1) >= 0){
+        fprintf(stderr, "hold: expected LEFTSHIFT held down\n");
+        return -1;
+    }
+    push_key(t + msec_to_ns(1000), KEY_D, 0);
+    if(check_tap("hold", KEY_LEFTSHIFT)) return -1;
+
+    // with no hold variant, the tap action is held instead
+    start();
+    t = 1000 * NS_PER_SEC;
+    push_key(t, KEY_D, 1);
+    fire_timer();
+    press = sent_at(KEY_X, 1);
+    if(press < 0 || sent_at(KEY_X, 0) >= 0
+            || !syn_between(press, (int)n_sent)){
+        fprintf(stderr, "hold: X wasn't held down in a frame\n");
+        return -1;
+    }
+    push_key(t + msec_to_ns(1000), KEY_D, 0);
+    return check_tap("hold", KEY_X);
+}
+
+// another key ends the dance at the taps so far, before that key
+static int check_interrupted(void){
+    start();
+    nstime_t t = tap_d(1000 * NS_PER_SEC, 2);
+    push_key(t + msec_to_ns(10), KEY_A, 1);
+    push_key(t + msec_to_ns(20), KEY_A, 0);
+    if(check_tap("interrupted", KEY_Y) || check_tap("interrupted", KEY_A)){
+        return -1;
+    }
+    if(sent_at(KEY_A, 1) < sent_at(KEY_Y, 0)){
+        fprintf(stderr, "interrupted: A came before the dance\n");
+        return -1;
+    }
+    return 0;
+}
+
+// a press after the dance timed out, before the timer fired, starts anew
+static int check_late(void){
+    start();
+    nstime_t t = tap_d(1000 * NS_PER_SEC, 1);
+    tap_d(t + msec_to_ns(TAPPING_MS + 100), 1);
+    fire_timer();
+    if(sent_at(KEY_Y, 1) >= 0){
+        fprintf(stderr, "late: counted as a second tap\n");
+        return -1;
+    }
+    int first = sent_nth(KEY_X, 1, 0), second = sent_nth(KEY_X, 1, 1);
+    if(first < 0 || second < first){
+        fprintf(stderr, "late: expected two single taps\n");
+        return -1;
+    }
+    return check_tap("late", KEY_X);
+}
+
+int main(void){
+    build_keymap();
+    int retval = 0;
+    if(check_taps(1, KEY_X)) retval = 1;
+    if(check_taps(2, KEY_Y)) retval = 1;
+    if(check_taps(3, KEY_Z)) retval = 1;
+    if(check_hold()) retval = 1;
+    if(check_interrupted()) retval = 1;
+    if(check_late()) retval = 1;
+    return retval;
+}
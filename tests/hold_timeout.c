@@ -0,0 +1,179 @@
+/* A lone dual key, held while nothing else happens, must turn into its HOLD
+   action as soon as hold_ms runs out, not whenever the next event arrives.
+   A hold long after a tap must not be mistaken for a double tap, either.
+   This drives the resolver the way the serve_loop does, on the virtual clock
+   which `sdiol replay` uses, so the result doesn't depend on how busy the
+   machine is. */
+
+#include "resolver.h"
+#include "time_util.h"
+
+#include <stdbool.h>
+#include <stdio.h>
+
+#define HOLD_MS 200
+
+// the most HOLD may come after hold_ms
+#define TOLERANCE NS_PER_MSEC
+
+static struct resolver r;
+
+/* a dense root keymap, where every key is itself except for KEY_F and KEY_J,
+   which is like KEY_F but can be double-tapped */
+static key_action_t keys[KEY_MAX];
+static key_action_t *lookup[KEY_MAX];
+static key_action_t f_tap = { .type = KT_SIMPLE, .key = { .simple = KEY_F } };
+static key_action_t j_tap = { .type = KT_SIMPLE, .key = { .simple = KEY_J } };
+static key_action_t root = { .type = KT_MAP };
+
+static struct input_event sent[16];
+static size_t n_sent;
+
+static int record(void *data, struct input_event ev){
+    if(n_sent < sizeof(sent) / sizeof(*sent)) sent[n_sent] = ev;
+    n_sent++;
+    return sizeof(ev);
+}
+
+static bool was_sent(uint16_t code, int32_t value){
+    for(size_t i = 0; i < n_sent; i++){
+        if(sent[i].type == EV_KEY && sent[i].code == code
+                && sent[i].value == value){
+            return true;
+        }
+    }
+    return false;
+}
+
+static void build_keymap(void){
+    for(int i = 0; i < KEY_MAX; i++){
+        keys[i] = (key_action_t){ .type = KT_SIMPLE, .key = { .simple = i } };
+        lookup[i] = &keys[i];
+    }
+    keys[KEY_F] = (key_action_t){
+        .type = KT_DUAL,
+        .key = { .dual = {
+            .tap = &f_tap,
+            .hold = &keys[KEY_LEFTCTRL],
+            .mode = DUAL_MODE_TAP_ON_ROLLOVER,
+            .hold_ms = HOLD_MS,
+            .double_tap_ms = -1,
+        } },
+    };
+    keys[KEY_J] = keys[KEY_F];
+    keys[KEY_J].key.dual.tap = &j_tap;
+    keys[KEY_J].key.dual.double_tap_ms = 150;
+    root.key.lookup = lookup;
+}
+
+static void push(nstime_t t, uint16_t type, uint16_t code, int32_t value){
+    struct input_event ev = {
+        .time = {
+            .tv_sec = t / NS_PER_SEC,
+            .tv_usec = (t % NS_PER_SEC) / NS_PER_USEC,
+        },
+        .type = type,
+        .code = code,
+        .value = value,
+    };
+    nstime_set_virtual(t);
+    resolver_push(&r, ev);
+}
+
+// press KEY_F at time pressed and hold it; returns 0 on success or -1
+static int check_hold(nstime_t pressed){
+    resolver_init(&r, &root, record, NULL);
+    n_sent = 0;
+
+    push(pressed, EV_KEY, KEY_F, 1);
+    push(pressed, EV_SYN, SYN_REPORT, 0);
+    if(n_sent){
+        fprintf(stderr, "key resolved before it could time out\n");
+        return -1;
+    }
+
+    // the serve_loop arms its timer for the earliest deadline
+    nstime_t deadline;
+    if(!resolve_deadline(&r, &deadline)){
+        fprintf(stderr, "no deadline for a held dual key\n");
+        return -1;
+    }
+    nstime_t late = deadline - (pressed + msec_to_ns(HOLD_MS));
+    if(late < 0 || late > TOLERANCE){
+        fprintf(stderr, "deadline is %lldns after hold_ms\n", (long long)late);
+        return -1;
+    }
+
+    // just before the deadline, the key must still be waiting
+    nstime_set_virtual(deadline - 1);
+    while(resolve(&r));
+    if(n_sent){
+        fprintf(stderr, "key resolved %lldns before the deadline\n",
+                (long long)(deadline - nstime_now()));
+        return -1;
+    }
+
+    // the timer fires, with no other input at all
+    nstime_set_virtual(deadline);
+    while(resolve(&r));
+    if(!was_sent(KEY_LEFTCTRL, 1) || was_sent(KEY_F, 1)){
+        fprintf(stderr, "timer did not resolve the key as HOLD\n");
+        return -1;
+    }
+
+    // and releasing the key releases the HOLD action
+    push(deadline + msec_to_ns(50), EV_KEY, KEY_F, 0);
+    if(!was_sent(KEY_LEFTCTRL, 0)){
+        fprintf(stderr, "releasing the key did not release its HOLD\n");
+        return -1;
+    }
+    return 0;
+}
+
+/* tap KEY_J, then hold it again gap later, with nothing in between; returns 0
+   on success or -1 */
+static int check_tap_then_hold(nstime_t gap){
+    resolver_init(&r, &root, record, NULL);
+    nstime_t t = 1000 * NS_PER_SEC;
+    push(t, EV_KEY, KEY_J, 1);
+    push(t + msec_to_ns(20), EV_KEY, KEY_J, 0);
+    n_sent = 0;
+
+    push(t + gap, EV_KEY, KEY_J, 1);
+    nstime_t deadline;
+    if(!resolve_deadline(&r, &deadline)){
+        fprintf(stderr, "no deadline for a held dual key\n");
+        return -1;
+    }
+    nstime_set_virtual(deadline);
+    while(resolve(&r));
+    if(!was_sent(KEY_LEFTCTRL, 1) || was_sent(KEY_J, 1)){
+        fprintf(stderr, "hold %llds after a tap was a double tap\n",
+                (long long)(gap / NS_PER_SEC));
+        return -1;
+    }
+    return 0;
+}
+
+int main(void){
+    build_keymap();
+
+    // presses at various offsets within a millisecond
+    static const long offsets_us[] = { 0, 1, 250, 499, 500, 999 };
+    int retval = 0;
+    for(size_t i = 0; i < sizeof(offsets_us) / sizeof(*offsets_us); i++){
+        nstime_t pressed = 1000 * NS_PER_SEC + offsets_us[i] * NS_PER_USEC;
+        if(check_hold(pressed)){
+            fprintf(stderr, "failed for a press at +%ldus\n", offsets_us[i]);
+            retval = 1;
+        }
+    }
+
+    /* the gaps which wrap a 32-bit microsecond difference negative, or all the
+       way around to a small positive one */
+    static const long gaps_s[] = { 1, 2200, 3000, 4295 };
+    for(size_t i = 0; i < sizeof(gaps_s) / sizeof(*gaps_s); i++){
+        if(check_tap_then_hold(gaps_s[i] * NS_PER_SEC)) retval = 1;
+    }
+    return retval;
+}
@@ -0,0 +1,459 @@
+/* Compare what the epoll and io_uring backends cost per event.  A trace (from
+   `sdiol record`, or a synthetic one of typing and mouse motion) is replayed
+   into pipes which stand in for the evdev devices, a frame per write() as
+   evdev delivers them.  Every event goes through a resolver and out to a
+   pipe which stands in for uinput.  For each backend, this reports the
+   syscalls per event made by the thread running the backend, counted with
+   the raw_syscalls:sys_enter tracepoint, and that thread's CPU use.
+
+   usage: io_bench [--max-speed] [TRACE] */
+
+#define _GNU_SOURCE
+#include "resolver.h"
+#include "time_util.h"
+#include "trace.h"
+#include "uring.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+
+// as in devices.h
+#define MAX_DEVS 16
+#define READ_BATCH 64
+
+// the most events a frame may have before it is written anyway
+#define FRAME_MAX 64
+
+// the synthetic trace
+#define SYNTH_SECS 20
+#define MOUSE_HZ 1000
+
+typedef struct {
+    int dev;
+    struct input_event ev;
+} bench_ev_t;
+
+static bench_ev_t *evs;
+static size_t n_evs;
+static size_t cap_evs;
+static int n_devs;
+static bool max_speed;
+
+static int add_event(int dev, nstime_t t, uint16_t type, uint16_t code,
+        int32_t value){
+    if(n_evs == cap_evs){
+        size_t cap = cap_evs ? cap_evs * 2 : 4096;
+        bench_ev_t *new = realloc(evs, cap * sizeof(*evs));
+        if(!new){
+            perror("realloc");
+            return -1;
+        }
+        evs = new;
+        cap_evs = cap;
+    }
+    evs[n_evs++] = (bench_ev_t){
+        .dev = dev,
+        .ev = {
+            .time = {
+                .tv_sec = t / NS_PER_SEC,
+                .tv_usec = (t % NS_PER_SEC) / NS_PER_USEC,
+            },
+            .type = type,
+            .code = code,
+            .value = value,
+        },
+    };
+    return 0;
+}
+
+static int load_trace(const char *path){
+    trace_t *trace = trace_open(path);
+    if(!trace) return -1;
+    // trace device ids are mapped onto our pipes in order
+    int devs[TRACE_MAX_DEVICES];
+    int retval = 0;
+    while(true){
+        int dev;
+        const char *name;
+        struct input_event ev;
+        trace_rec_t rec = trace_read(trace, &dev, &name, &ev);
+        if(rec == TRACE_END) break;
+        if(rec == TRACE_ERROR){
+            retval = -1;
+            break;
+        }
+        if(rec == TRACE_DEVICE){
+            devs[dev] = n_devs < MAX_DEVS ? n_devs++ : -1;
+            continue;
+        }
+        if(devs[dev] < 0) continue;
+        if(add_event(devs[dev], nstime_from_timeval(ev.time), ev.type,
+                    ev.code, ev.value)){
+            retval = -1;
+            break;
+        }
+    }
+    trace_close(trace);
+    return retval;
+}
+
+/* a keyboard typing at about 8 keys per second, and a mouse which moves at
+   MOUSE_HZ for one second out of every two */
+static int synthesize(void){
+    static const uint16_t keys[] = {
+        KEY_A, KEY_S, KEY_D, KEY_F, KEY_J, KEY_K, KEY_L, KEY_SPACE,
+    };
+    n_devs = 2;
+    srand(1);
+    nstime_t end = SYNTH_SECS * NS_PER_SEC;
+    nstime_t next_key = 0;
+    nstime_t next_mouse = 0;
+    int ret = 0;
+    while(next_key < end || next_mouse < end){
+        if(next_key <= next_mouse){
+            nstime_t t = next_key;
+            uint16_t code = keys[rand() % 8];
+            nstime_t up = t + msec_to_ns(40 + rand() % 60);
+            for(int v = 1; v >= 0; v--){
+                nstime_t when = v ? t : up;
+                ret |= add_event(0, when, EV_MSC, MSC_SCAN, code);
+                ret |= add_event(0, when, EV_KEY, code, v);
+                ret |= add_event(0, when, EV_SYN, SYN_REPORT, 0);
+            }
+            next_key = t + msec_to_ns(80 + rand() % 90);
+        }else{
+            nstime_t t = next_mouse;
+            ret |= add_event(1, t, EV_REL, REL_X, rand() % 7 - 3);
+            ret |= add_event(1, t, EV_REL, REL_Y, rand() % 7 - 3);
+            ret |= add_event(1, t, EV_SYN, SYN_REPORT, 0);
+            next_mouse = t + NS_PER_SEC / MOUSE_HZ;
+            // the mouse rests every other second
+            if((next_mouse / NS_PER_SEC) % 2) next_mouse += NS_PER_SEC;
+        }
+        if(ret) return -1;
+    }
+    return 0;
+}
+
+// one run of one backend
+typedef struct {
+    int in[MAX_DEVS][2];
+    int out[2];
+    int n_open;
+    struct resolver r;
+    unsigned long emitted;
+    unsigned long received;
+    unsigned long wakeups;
+    // the epoll backend's output buffer
+    struct input_event buf[1024];
+    size_t len;
+} run_t;
+
+static void *feeder(void *arg){
+    run_t *run = arg;
+    struct input_event frames[MAX_DEVS][FRAME_MAX];
+    size_t lens[MAX_DEVS] = {0};
+    nstime_t start = nstime_monotonic();
+    nstime_t t0 = n_evs ? nstime_from_timeval(evs[0].ev.time) : 0;
+    for(size_t i = 0; i < n_evs; i++){
+        int dev = evs[i].dev;
+        struct input_event ev = evs[i].ev;
+        nstime_t now;
+        if(max_speed){
+            now = nstime_monotonic();
+        }else{
+            now = start + (nstime_from_timeval(ev.time) - t0);
+            struct timespec ts = nstime_to_timespec(now);
+            while(clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL)
+                    == EINTR);
+        }
+        // stamped like the kernel would, with the time it was "read"
+        ev.time.tv_sec = now / NS_PER_SEC;
+        ev.time.tv_usec = (now % NS_PER_SEC) / NS_PER_USEC;
+        frames[dev][lens[dev]++] = ev;
+        if(ev.type != EV_SYN && lens[dev] < FRAME_MAX) continue;
+        write(run->in[dev][1], frames[dev], lens[dev] * sizeof(ev));
+        lens[dev] = 0;
+    }
+    for(int i = 0; i < n_devs; i++){
+        close(run->in[i][1]);
+    }
+    return NULL;
+}
+
+static void *sink(void *arg){
+    run_t *run = arg;
+    struct input_event buf[READ_BATCH];
+    size_t bytes = 0;
+    ssize_t ret;
+    while((ret = read(run->out[0], buf, sizeof(buf))) != 0){
+        if(ret < 0 && errno == EINTR) continue;
+        if(ret < 0){
+            perror("read");
+            break;
+        }
+        bytes += ret;
+    }
+    run->received = bytes / sizeof(*buf);
+    return NULL;
+}
+
+static void feed_resolver(run_t *run, const struct input_event *evs,
+        size_t n){
+    for(size_t i = 0; i < n; i++){
+        resolver_push(&run->r, evs[i]);
+    }
+}
+
+static void flush_epoll(run_t *run){
+    if(!run->len) return;
+    write(run->out[1], run->buf, run->len * sizeof(*run->buf));
+    run->len = 0;
+}
+
+static int send_epoll(void *data, struct input_event ev){
+    run_t *run = data;
+    run->emitted++;
+    if(run->len == sizeof(run->buf) / sizeof(*run->buf)){
+        flush_epoll(run);
+    }
+    run->buf[run->len++] = ev;
+    return sizeof(ev);
+}
+
+// like the serve_loop without --io-uring
+static void run_epoll(run_t *run){
+    int epfd = epoll_create1(EPOLL_CLOEXEC);
+    for(int i = 0; i < n_devs; i++){
+        struct epoll_event ev = { .events = EPOLLIN, .data = { .u32 = i } };
+        epoll_ctl(epfd, EPOLL_CTL_ADD, run->in[i][0], &ev);
+    }
+    struct input_event buf[READ_BATCH];
+    while(run->n_open > 0){
+        struct epoll_event ready[MAX_DEVS];
+        int n = epoll_wait(epfd, ready, MAX_DEVS, -1);
+        if(n < 0) continue;
+        run->wakeups++;
+        for(int i = 0; i < n; i++){
+            int fd = run->in[ready[i].data.u32][0];
+            while(true){
+                ssize_t ret = read(fd, buf, sizeof(buf));
+                if(ret < 0) break;
+                if(ret == 0){
+                    close(fd);
+                    run->n_open--;
+                    break;
+                }
+                size_t got = ret / sizeof(*buf);
+                feed_resolver(run, buf, got);
+                if(got < READ_BATCH) break;
+            }
+        }
+        // one write() per wakeup, as with local_out_flush()
+        flush_epoll(run);
+    }
+    close(epfd);
+}
+
+#ifdef SDIOL_IO_URING
+
+static int send_uring(void *data, struct input_event ev){
+    run_t *run = data;
+    run->emitted++;
+    return uring_write(run->out[1], ev);
+}
+
+static void uring_read(void *arg, int fd, const struct input_event *evs,
+        size_t n){
+    run_t *run = arg;
+    if(!evs){
+        close(fd);
+        run->n_open--;
+        return;
+    }
+    feed_resolver(run, evs, n);
+}
+
+// like the serve_loop with --io-uring
+static void run_uring(run_t *run){
+    int epfd = epoll_create1(EPOLL_CLOEXEC);
+    if(uring_init(epfd)){
+        close(epfd);
+        return;
+    }
+    for(int i = 0; i < n_devs; i++){
+        uring_add_input(run->in[i][0]);
+    }
+    uring_submit();
+    while(run->n_open > 0){
+        struct epoll_event ready;
+        if(epoll_wait(epfd, &ready, 1, -1) < 1) continue;
+        run->wakeups++;
+        uring_handle(uring_read, run);
+        uring_submit();
+    }
+    // let the last write complete
+    for(int i = 0; i < 100; i++){
+        struct epoll_event ready;
+        if(epoll_wait(epfd, &ready, 1, 1) < 1) break;
+        uring_handle(uring_read, run);
+        uring_submit();
+    }
+    uring_exit();
+    close(epfd);
+}
+
+#endif // SDIOL_IO_URING
+
+// count the calling thread's syscalls, or return -1 if we can't
+static int syscall_counter(void){
+    static const char *paths[] = {
+        "/sys/kernel/tracing/events/raw_syscalls/sys_enter/id",
+        "/sys/kernel/debug/tracing/events/raw_syscalls/sys_enter/id",
+    };
+    long id = -1;
+    for(size_t i = 0; i < sizeof(paths) / sizeof(*paths) && id < 0; i++){
+        FILE *f = fopen(paths[i], "r");
+        if(!f) continue;
+        if(fscanf(f, "%ld", &id) != 1) id = -1;
+        fclose(f);
+    }
+    if(id < 0) return -1;
+    struct perf_event_attr attr = {
+        .type = PERF_TYPE_TRACEPOINT,
+        .size = sizeof(attr),
+        .config = id,
+        .disabled = 1,
+    };
+    return syscall(SYS_perf_event_open, &attr, 0, -1, -1, PERF_FLAG_FD_CLOEXEC);
+}
+
+static nstime_t thread_cpu(void){
+    struct timespec ts;
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+    return (nstime_t)ts.tv_sec * NS_PER_SEC + ts.tv_nsec;
+}
+
+// returns 0 on success or -1 on error
+static int bench(const char *name, send_t send, void (*loop)(run_t*)){
+    static key_action_t keys[KEY_MAX];
+    static key_action_t *lookup[KEY_MAX];
+    static key_action_t root = { .type = KT_MAP };
+    for(int i = 0; i < KEY_MAX; i++){
+        keys[i] = (key_action_t){ .type = KT_SIMPLE, .key = { .simple = i } };
+        lookup[i] = &keys[i];
+    }
+    root.key.lookup = lookup;
+
+    static run_t run;
+    memset(&run, 0, sizeof(run));
+    for(int i = 0; i < n_devs; i++){
+        if(pipe2(run.in[i], O_CLOEXEC)){
+            perror("pipe2");
+            return -1;
+        }
+        fcntl(run.in[i][0], F_SETFL, O_NONBLOCK);
+    }
+    if(pipe2(run.out, O_CLOEXEC)){
+        perror("pipe2");
+        return -1;
+    }
+    // so the output never pushes back, like uinput
+    fcntl(run.out[1], F_SETPIPE_SZ, 1 << 20);
+    run.n_open = n_devs;
+    resolver_init(&run.r, &root, send, &run);
+
+    int counter = syscall_counter();
+    pthread_t feed, drain;
+    pthread_create(&drain, NULL, sink, &run);
+    pthread_create(&feed, NULL, feeder, &run);
+
+    nstime_t wall = nstime_monotonic();
+    nstime_t cpu = thread_cpu();
+    if(counter > -1) ioctl(counter, PERF_EVENT_IOC_ENABLE, 0);
+    loop(&run);
+    if(counter > -1) ioctl(counter, PERF_EVENT_IOC_DISABLE, 0);
+    cpu = thread_cpu() - cpu;
+    wall = nstime_monotonic() - wall;
+
+    pthread_join(feed, NULL);
+    close(run.out[1]);
+    pthread_join(drain, NULL);
+    close(run.out[0]);
+
+    uint64_t syscalls = 0;
+    if(counter > -1){
+        read(counter, &syscalls, sizeof(syscalls));
+        close(counter);
+    }
+    double per = (double)syscalls / n_evs;
+    printf("%-8s %lu events in %lu wakeups, ", name, (unsigned long)n_evs,
+            run.wakeups);
+    if(counter > -1){
+        printf("%.3f syscalls/event, ", per);
+    }else{
+        printf("syscalls not counted, ");
+    }
+    printf("%.2f%% CPU (%.1fns/event)\n", 100.0 * cpu / wall,
+            (double)cpu / n_evs);
+    if(run.received != run.emitted){
+        fprintf(stderr, "%s: emitted %lu events but %lu arrived\n", name,
+                run.emitted, run.received);
+        return -1;
+    }
+    return 0;
+}
+
+static bool later(const bench_ev_t *a, const bench_ev_t *b){
+    return nstime_from_timeval(a->ev.time) > nstime_from_timeval(b->ev.time);
+}
+
+/* a stable insertion sort by time, which keeps each frame in order.  Events
+   are only slightly out of order, where the devices interleave. */
+static void sort_events(void){
+    for(size_t i = 1; i < n_evs; i++){
+        bench_ev_t ev = evs[i];
+        size_t j = i;
+        while(j > 0 && later(&evs[j - 1], &ev)){
+            evs[j] = evs[j - 1];
+            j--;
+        }
+        evs[j] = ev;
+    }
+}
+
+int main(int argc, char **argv){
+    const char *path = NULL;
+    for(int i = 1; i < argc; i++){
+        if(!strcmp(argv[i], "--max-speed")){
+            max_speed = true;
+        }else if(argv[i][0] == '-' || path){
+            fprintf(stderr, "usage: io_bench [--max-speed] [TRACE]\n");
+            return 1;
+        }else{
+            path = argv[i];
+        }
+    }
+    if(path ? load_trace(path) : synthesize()) return 1;
+    sort_events();
+
+    int retval = 0;
+    if(bench("epoll", send_epoll, run_epoll)) retval = 1;
+#ifdef SDIOL_IO_URING
+    if(bench("io_uring", send_uring, run_uring)) retval = 1;
+#else
+    printf("io_uring not built; configure with -DUSE_IO_URING=ON\n");
+#endif
+    free(evs);
+    return retval;
+}
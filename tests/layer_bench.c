@@ -0,0 +1,152 @@
+/* Measure what a key press costs with 1, 4 and 16 keymap layers held.  The
+   keymaps are nested 16 deep and compacted the way a config's are, so each
+   layer is a small sparse keymap which falls through to the one holding it.
+   This times key_action_get() for a key bound in the top layer and for one
+   only the root binds, and a press and release through resolver_push().
+
+   usage: layer_bench */
+
+#define _GNU_SOURCE
+#include "key_action.h"
+#include "resolver.h"
+#include "time_util.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#define DEPTH 16
+#define LOOKUPS 20000000
+#define TAPS 2000000
+
+// the key which holds each layer, from the keymap below it
+static const int layer_keys[DEPTH] = {
+    KEY_Q, KEY_W, KEY_E, KEY_R, KEY_T, KEY_Y, KEY_U, KEY_I,
+    KEY_O, KEY_P, KEY_A, KEY_S, KEY_D, KEY_F, KEY_G, KEY_H,
+};
+
+// the keys each layer binds for itself
+static const int layer_binds[] = { KEY_1, KEY_2, KEY_3, KEY_4, KEY_5 };
+#define N_BINDS (sizeof(layer_binds) / sizeof(*layer_binds))
+
+static struct resolver r;
+
+static int discard(void *data, struct input_event ev){
+    (void)data;
+    return sizeof(ev);
+}
+
+/* the keymap at depth (0 is the root) and everything nested in it, as a
+   config would build it */
+static key_map_t *build_map(int depth){
+    size_t n = (depth ? N_BINDS : 0) + (depth < DEPTH ? 1 : 0);
+    key_map_t *map = key_map_new(n);
+    if(!map){
+        perror("malloc");
+        exit(1);
+    }
+    if(depth){
+        for(size_t i = 0; i < N_BINDS; i++){
+            map->keys[map->n++] = (struct key_binding){
+                .code = layer_binds[i],
+                .action = {
+                    .type = KT_SIMPLE,
+                    .key = { .simple = KEY_F1 + depth - 1 },
+                },
+            };
+        }
+    }
+    if(depth < DEPTH){
+        map->keys[map->n++] = (struct key_binding){
+            .code = layer_keys[depth],
+            .action = {
+                .type = KT_MAP,
+                .key = { .map = build_map(depth + 1) },
+            },
+        };
+    }
+    key_map_sort(map);
+    return map;
+}
+
+// measure, then fill, an arena with the compacted keymaps
+static key_action_t *compact(const key_action_t *in){
+    arena_t a = {0};
+    key_compact_t kc = {0};
+    key_compact_init(&kc, &a);
+    arena_alloc(&a, sizeof(key_action_t));
+    key_action_compact(&kc, in, NULL);
+    a.size = a.used;
+    a.used = 0;
+    a.base = calloc(1, a.size);
+    if(!a.base || kc.failed){
+        fprintf(stderr, "failed to compact the keymaps\n");
+        exit(1);
+    }
+    key_compact_init(&kc, &a);
+    key_action_t *out = arena_alloc(&a, sizeof(*out));
+    key_action_compact(&kc, in, out);
+    key_compact_free(&kc);
+    return out;
+}
+
+static void push(nstime_t t, uint16_t code, int32_t value){
+    struct input_event ev = {
+        .time = {
+            .tv_sec = t / NS_PER_SEC,
+            .tv_usec = (t % NS_PER_SEC) / NS_PER_USEC,
+        },
+        .type = EV_KEY,
+        .code = code,
+        .value = value,
+    };
+    resolver_push(&r, ev);
+}
+
+static nstime_t wall_now(void){
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (nstime_t)ts.tv_sec * NS_PER_SEC + ts.tv_nsec;
+}
+
+// the mean time of one key_action_get() of code in the current keymap
+static double bench_lookup(int code){
+    volatile int sink = 0;
+    nstime_t start = wall_now();
+    for(int i = 0; i < LOOKUPS; i++){
+        sink += key_action_get(r.current_keymap, code)->type;
+    }
+    (void)sink;
+    return (double)(wall_now() - start) / LOOKUPS;
+}
+
+// the mean time of a press and release of a key bound in the top layer
+static double bench_tap(nstime_t t){
+    nstime_t start = wall_now();
+    for(int i = 0; i < TAPS; i++){
+        push(t, layer_binds[0], 1);
+        push(t, layer_binds[0], 0);
+    }
+    return (double)(wall_now() - start) / TAPS;
+}
+
+int main(void){
+    key_action_t loaded = { .type = KT_MAP, .key = { .map = build_map(0) } };
+    key_action_t *root = compact(&loaded);
+
+    static const int helds[] = { 1, 4, DEPTH };
+    printf("%11s  %14s  %14s  %14s\n",
+            "layers held", "get top (ns)", "get root (ns)", "tap (ns)");
+    for(size_t i = 0; i < sizeof(helds) / sizeof(*helds); i++){
+        resolver_init(&r, root, discard, NULL);
+        nstime_t t = 1000 * NS_PER_SEC;
+        nstime_set_virtual(t);
+        for(int j = 0; j < helds[i]; j++){
+            push(t, layer_keys[j], 1);
+        }
+        printf("%11d  %14.2f  %14.2f  %14.1f\n", helds[i],
+                bench_lookup(layer_binds[0]), bench_lookup(KEY_Z),
+                bench_tap(t));
+    }
+    return 0;
+}
@@ -0,0 +1,261 @@
+/* Leader sequences, driven the way the serve_loop drives the resolver, on the
+   virtual clock which `sdiol replay` uses.  With CAPSLOCK leading "a" -> X,
+   "a b" -> Y and "c d" -> Z, this checks a full sequence, a prefix which
+   times out into its own action, an abandoned prefix being typed out, a key
+   which comes after the sequence timed out, and a leader alone.  Whatever a
+   timeout decides must go out in frames of its own, with a SYN_REPORT after
+   each press and each release. */
+
+#include "leader.h"
+#include "resolver.h"
+#include "time_util.h"
+
+#include <stdbool.h>
+#include <stdio.h>
+
+#define TIMEOUT_MS 500
+
+static struct resolver r;
+
+// a dense root keymap, where every key is itself
+static key_action_t keys[KEY_MAX];
+static key_action_t *lookup[KEY_MAX];
+static key_action_t root = { .type = KT_MAP };
+
+static leaders_t leaders;
+// the trie: 1 is "a", 2 is "a b", 3 is "c" and 4 is "c d"
+static struct leader_node nodes[5];
+static uint16_t next[5 * 4];
+
+static struct input_event sent[64];
+static size_t n_sent;
+
+static int record(void *data, struct input_event ev){
+    if(n_sent < sizeof(sent) / sizeof(*sent)) sent[n_sent] = ev;
+    n_sent++;
+    return sizeof(ev);
+}
+
+// the index in sent of a key event, or -1
+static int sent_at(uint16_t code, int32_t value){
+    for(size_t i = 0; i < n_sent; i++){
+        if(sent[i].type == EV_KEY && sent[i].code == code
+                && sent[i].value == value){
+            return (int)i;
+        }
+    }
+    return -1;
+}
+
+static size_t keys_sent(void){
+    size_t n = 0;
+    for(size_t i = 0; i < n_sent; i++){
+        if(sent[i].type == EV_KEY) n++;
+    }
+    return n;
+}
+
+static bool syn_between(int from, int to){
+    for(int i = from + 1; i < to; i++){
+        if(sent[i].type == EV_SYN) return true;
+    }
+    return false;
+}
+
+/* code was pressed and released, with a SYN_REPORT after each; returns 0 or
+   -1 */
+static int check_tap(const char *name, uint16_t code){
+    int press = sent_at(code, 1), release = sent_at(code, 0);
+    if(press < 0 || release < press){
+        fprintf(stderr, "%s: key %d wasn't tapped\n", name, code);
+        return -1;
+    }
+    if(!syn_between(press, release) || !syn_between(release, (int)n_sent)){
+        fprintf(stderr, "%s: key %d wasn't tapped in frames of its own\n",
+                name, code);
+        return -1;
+    }
+    return 0;
+}
+
+static void build_config(void){
+    for(int i = 0; i < KEY_MAX; i++){
+        keys[i] = (key_action_t){ .type = KT_SIMPLE, .key = { .simple = i } };
+        lookup[i] = &keys[i];
+    }
+    root.key.lookup = lookup;
+
+    nodes[1] = (struct leader_node){
+        .action = { .type = KT_SIMPLE, .key = { .simple = KEY_X } },
+        .has_next = true,
+    };
+    nodes[2].action = (key_action_t){
+        .type = KT_SIMPLE, .key = { .simple = KEY_Y },
+    };
+    nodes[3].has_next = true;
+    nodes[4].action = (key_action_t){
+        .type = KT_SIMPLE, .key = { .simple = KEY_Z },
+    };
+
+    leader_t *l = &leaders.leaders[0];
+    l->key = KEY_CAPSLOCK;
+    l->timeout = msec_to_ns(TIMEOUT_MS);
+    l->alpha[KEY_A] = 1;
+    l->alpha[KEY_B] = 2;
+    l->alpha[KEY_C] = 3;
+    l->alpha[KEY_D] = 4;
+    l->n_alpha = 4;
+    l->n_nodes = 5;
+    next[0 * 4 + 0] = 1;
+    next[1 * 4 + 1] = 2;
+    next[0 * 4 + 2] = 3;
+    next[3 * 4 + 3] = 4;
+    l->next = next;
+    l->nodes = nodes;
+    leaders.n = 1;
+    leaders.by_key[KEY_CAPSLOCK] = 1;
+}
+
+static void start(void){
+    resolver_init(&r, &root, record, NULL);
+    resolver_set_leaders(&r, &leaders);
+    n_sent = 0;
+}
+
+static void push(nstime_t t, uint16_t type, uint16_t code, int32_t value){
+    struct input_event ev = {
+        .time = {
+            .tv_sec = t / NS_PER_SEC,
+            .tv_usec = (t % NS_PER_SEC) / NS_PER_USEC,
+        },
+        .type = type,
+        .code = code,
+        .value = value,
+    };
+    nstime_set_virtual(t);
+    resolver_push(&r, ev);
+}
+
+// press and release a key, each in a frame of its own as evdev sends them
+static void tap(nstime_t t, uint16_t code){
+    push(t, EV_KEY, code, 1);
+    push(t, EV_SYN, SYN_REPORT, 0);
+    push(t + msec_to_ns(5), EV_KEY, code, 0);
+    push(t + msec_to_ns(5), EV_SYN, SYN_REPORT, 0);
+}
+
+// let the timer fire, if one is due; returns false if none is
+static bool fire_timer(void){
+    nstime_t deadline;
+    if(!resolve_deadline(&r, &deadline)) return false;
+    nstime_set_virtual(deadline);
+    while(resolve(&r));
+    resolver_tick(&r, deadline);
+    return true;
+}
+
+static int check_full(void){
+    start();
+    nstime_t t = 1000 * NS_PER_SEC;
+    tap(t, KEY_CAPSLOCK);
+    tap(t + msec_to_ns(100), KEY_A);
+    tap(t + msec_to_ns(200), KEY_B);
+    if(check_tap("full", KEY_Y)) return -1;
+    if(sent_at(KEY_A, 1) >= 0 || sent_at(KEY_B, 1) >= 0
+            || sent_at(KEY_X, 1) >= 0 || sent_at(KEY_CAPSLOCK, 1) >= 0){
+        fprintf(stderr, "full: sequence keys leaked out\n");
+        return -1;
+    }
+    return 0;
+}
+
+static int check_prefix_timeout(void){
+    start();
+    nstime_t t = 1000 * NS_PER_SEC;
+    tap(t, KEY_CAPSLOCK);
+    tap(t + msec_to_ns(100), KEY_A);
+    if(keys_sent()){
+        fprintf(stderr, "prefix: finished while \"a b\" was possible\n");
+        return -1;
+    }
+    if(!fire_timer()){
+        fprintf(stderr, "prefix: no deadline for the sequence\n");
+        return -1;
+    }
+    if(check_tap("prefix", KEY_X)) return -1;
+    if(sent_at(KEY_A, 1) >= 0){
+        fprintf(stderr, "prefix: typed a as itself\n");
+        return -1;
+    }
+    return 0;
+}
+
+static int check_abandoned(void){
+    // a key no sequence continues with
+    start();
+    nstime_t t = 1000 * NS_PER_SEC;
+    tap(t, KEY_CAPSLOCK);
+    tap(t + msec_to_ns(100), KEY_C);
+    tap(t + msec_to_ns(200), KEY_E);
+    if(check_tap("abandoned", KEY_C) || check_tap("abandoned", KEY_E)){
+        return -1;
+    }
+    if(sent_at(KEY_E, 1) < sent_at(KEY_C, 0)){
+        fprintf(stderr, "abandoned: e came before c\n");
+        return -1;
+    }
+
+    // or the timeout, on a prefix with no action of its own
+    start();
+    tap(t, KEY_CAPSLOCK);
+    tap(t + msec_to_ns(100), KEY_C);
+    if(!fire_timer() || check_tap("abandoned by timeout", KEY_C)) return -1;
+    return 0;
+}
+
+static int check_late(void){
+    // the timer hasn't fired when b arrives, too late for "a b"
+    start();
+    nstime_t t = 1000 * NS_PER_SEC;
+    tap(t, KEY_CAPSLOCK);
+    tap(t + msec_to_ns(100), KEY_A);
+    tap(t + msec_to_ns(100 + TIMEOUT_MS + 1), KEY_B);
+    if(sent_at(KEY_Y, 1) >= 0){
+        fprintf(stderr, "late: b continued a timed-out sequence\n");
+        return -1;
+    }
+    if(check_tap("late", KEY_X) || check_tap("late", KEY_B)) return -1;
+    if(sent_at(KEY_B, 1) < sent_at(KEY_X, 0)){
+        fprintf(stderr, "late: b came before x\n");
+        return -1;
+    }
+    return 0;
+}
+
+static int check_bare(void){
+    start();
+    nstime_t t = 1000 * NS_PER_SEC;
+    tap(t, KEY_CAPSLOCK);
+    if(!fire_timer()){
+        fprintf(stderr, "bare: no deadline for the leader\n");
+        return -1;
+    }
+    if(keys_sent()){
+        fprintf(stderr, "bare: a leader alone typed something\n");
+        return -1;
+    }
+    // and the next key is itself again
+    tap(t + msec_to_ns(1000), KEY_A);
+    return check_tap("bare", KEY_A);
+}
+
+int main(void){
+    build_config();
+    int retval = 0;
+    if(check_full()) retval = 1;
+    if(check_prefix_timeout()) retval = 1;
+    if(check_abandoned()) retval = 1;
+    if(check_late()) retval = 1;
+    if(check_bare()) retval = 1;
+    return retval;
+}
@@ -0,0 +1,155 @@
+/* Several reader threads push millions of events through their rings at once,
+   while the consumer drains them the way the serve_loop's handle_rings() does.
+   Every event must arrive exactly once and in order, including the ones
+   pushed just before a device goes away. */
+
+#define _GNU_SOURCE
+
+#include "reader.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <limits.h>
+#include <sys/eventfd.h>
+
+#define N_DEVICES 4
+#define N_EVENTS 2000000
+
+// writes to a pipe of at most PIPE_BUF bytes are atomic, so no partial events
+#define WRITE_BATCH (PIPE_BUF / sizeof(struct input_event))
+
+// as many events as handle_rings() drains at once
+#define DRAIN_BATCH 64
+
+// give up if nothing arrives for this long (ms)
+#define STALL_MS 10000
+
+typedef struct {
+    int rfd;
+    int wfd;
+    reader_t *reader;
+    pthread_t producer;
+    // the next sequence number the consumer expects
+    int32_t next;
+    bool done;
+} device_t;
+
+static device_t devs[N_DEVICES];
+
+// write N_EVENTS numbered events for one device, then hang up
+static void *producer_main(void *arg){
+    device_t *dev = arg;
+    uint16_t code = dev - devs;
+    struct input_event evs[WRITE_BATCH];
+    int32_t seq = 0;
+    while(seq < N_EVENTS){
+        // vary the batch size so batches don't line up with the ring
+        size_t n = 1 + (size_t)seq % WRITE_BATCH;
+        if(n > (size_t)(N_EVENTS - seq)) n = N_EVENTS - seq;
+        for(size_t i = 0; i < n; i++){
+            evs[i] = (struct input_event){
+                .type = EV_MSC, .code = code, .value = seq++,
+            };
+        }
+        ssize_t len = write(dev->wfd, evs, n * sizeof(*evs));
+        if(len != (ssize_t)(n * sizeof(*evs))){
+            perror("write");
+            exit(1);
+        }
+    }
+    close(dev->wfd);
+    return NULL;
+}
+
+// check one drained batch; returns 0 on success or -1
+static int check_events(device_t *dev, const struct input_event *evs,
+        size_t n){
+    for(size_t i = 0; i < n; i++){
+        if(evs[i].code != dev - devs || evs[i].value != dev->next){
+            fprintf(stderr, "device %d: expected event %d, got %d:%d\n",
+                    (int)(dev - devs), dev->next, evs[i].code, evs[i].value);
+            return -1;
+        }
+        dev->next++;
+    }
+    return 0;
+}
+
+int main(void){
+    int wake = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if(wake < 0){
+        perror("eventfd");
+        return 1;
+    }
+
+    for(int i = 0; i < N_DEVICES; i++){
+        int fds[2];
+        // the reader expects a non-blocking device fd
+        if(pipe2(fds, O_CLOEXEC)){
+            perror("pipe2");
+            return 1;
+        }
+        fcntl(fds[0], F_SETFL, O_NONBLOCK);
+        devs[i].rfd = fds[0];
+        devs[i].wfd = fds[1];
+        devs[i].reader = reader_new(fds[0], wake);
+        if(!devs[i].reader) return 1;
+    }
+    for(int i = 0; i < N_DEVICES; i++){
+        pthread_create(&devs[i].producer, NULL, producer_main, &devs[i]);
+    }
+
+    struct input_event evs[DRAIN_BATCH];
+    struct pollfd pfd = { .fd = wake, .events = POLLIN };
+    int n_done = 0;
+    while(n_done < N_DEVICES){
+        int ret = poll(&pfd, 1, STALL_MS);
+        if(ret < 0){
+            if(errno == EINTR) continue;
+            perror("poll");
+            return 1;
+        }
+        if(ret == 0){
+            fprintf(stderr, "no events for %dms\n", STALL_MS);
+            return 1;
+        }
+        uint64_t count;
+        read(wake, &count, sizeof(count));
+
+        for(int i = 0; i < N_DEVICES; i++){
+            device_t *dev = &devs[i];
+            if(dev->done) continue;
+            // same order as handle_rings(): check for death, then drain
+            bool dead = reader_dead(dev->reader);
+            size_t n;
+            while((n = reader_drain(dev->reader, evs, DRAIN_BATCH)) > 0){
+                if(check_events(dev, evs, n)) return 1;
+            }
+            if(!dead) continue;
+            if(dev->next != N_EVENTS){
+                fprintf(stderr, "device %d: died after %d of %d events\n",
+                        i, dev->next, N_EVENTS);
+                return 1;
+            }
+            dev->done = true;
+            n_done++;
+        }
+    }
+    printf("%d devices x %d events, all in order\n", N_DEVICES, N_EVENTS);
+
+    for(int i = 0; i < N_DEVICES; i++){
+        pthread_join(devs[i].producer, NULL);
+        reader_free(devs[i].reader);
+        close(devs[i].rfd);
+    }
+    close(wake);
+    return 0;
+}
@@ -0,0 +1,98 @@
+/* Measure what it costs to queue an event behind a pending dual key, as the
+   queue grows toward URMAX.  Each push retries the dual key, and since the
+   waveform scan picks up where the last retry left off, the cost per event
+   should stay flat instead of growing with the depth of the queue.
+
+   usage: waveform_bench */
+
+#define _GNU_SOURCE
+#include "resolver.h"
+#include "time_util.h"
+
+#include <stdio.h>
+#include <time.h>
+
+// about this many queued events are timed at each depth
+#define EVENTS_PER_DEPTH 2000000
+
+static struct resolver r;
+
+// a dense root keymap, where every key is itself except for KEY_F
+static key_action_t keys[KEY_MAX];
+static key_action_t *lookup[KEY_MAX];
+static key_action_t f_tap = { .type = KT_SIMPLE, .key = { .simple = KEY_F } };
+static key_action_t root = { .type = KT_MAP };
+
+static int discard(void *data, struct input_event ev){
+    (void)data;
+    return sizeof(ev);
+}
+
+static void build_keymap(void){
+    for(int i = 0; i < KEY_MAX; i++){
+        keys[i] = (key_action_t){ .type = KT_SIMPLE, .key = { .simple = i } };
+        lookup[i] = &keys[i];
+    }
+    keys[KEY_F] = (key_action_t){
+        .type = KT_DUAL,
+        .key = { .dual = {
+            .tap = &f_tap,
+            .hold = &keys[KEY_LEFTCTRL],
+            .mode = DUAL_MODE_TAP_ON_ROLLOVER,
+            // never times out during the benchmark
+            .hold_ms = 1000000,
+            .double_tap_ms = -1,
+        } },
+    };
+    root.key.lookup = lookup;
+}
+
+static void push(nstime_t t, uint16_t type, uint16_t code, int32_t value){
+    struct input_event ev = {
+        .time = {
+            .tv_sec = t / NS_PER_SEC,
+            .tv_usec = (t % NS_PER_SEC) / NS_PER_USEC,
+        },
+        .type = type,
+        .code = code,
+        .value = value,
+    };
+    resolver_push(&r, ev);
+}
+
+static nstime_t wall_now(void){
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (nstime_t)ts.tv_sec * NS_PER_SEC + ts.tv_nsec;
+}
+
+// the mean time to queue one event behind a pending KEY_F, at this depth
+static double bench_depth(size_t depth){
+    size_t trials = EVENTS_PER_DEPTH / depth;
+    nstime_t t = 1000 * NS_PER_SEC;
+    nstime_set_virtual(t);
+    nstime_t spent = 0;
+    for(size_t i = 0; i < trials; i++){
+        resolver_init(&r, &root, discard, NULL);
+        push(t, EV_KEY, KEY_F, 1);
+        // mouse motion, which never decides the dual key
+        nstime_t start = wall_now();
+        for(size_t j = 0; j < depth; j++){
+            push(t, EV_REL, j % 2 ? REL_X : REL_Y, 1);
+        }
+        spent += wall_now() - start;
+        // the release lets everything drain, untimed
+        push(t, EV_KEY, KEY_F, 0);
+    }
+    return (double)spent / (double)(trials * depth);
+}
+
+int main(void){
+    build_keymap();
+    static const size_t depths[] = { 16, 64, 256, 512, URMAX - 1 };
+    printf("%8s  %s\n", "depth", "ns/event");
+    for(size_t i = 0; i < sizeof(depths) / sizeof(*depths); i++){
+        printf("%8zu  %8.1f\n", depths[i], bench_depth(depths[i]));
+    }
+    return 0;
+}
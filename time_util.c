@@ -1,34 +1,35 @@
 #include "time_util.h"
 
-struct timeval timeval_now(){
-    struct timespec now_timespec;
-    clock_gettime(CLOCK_REALTIME, &now_timespec);
-    struct timeval now;
-    TIMESPEC_TO_TIMEVAL(&now, &now_timespec);
-    return now;
+#include <stdbool.h>
+
+static bool virtual_clock = false;
+static nstime_t virtual_now;
+
+nstime_t nstime_monotonic(void){
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (nstime_t)now.tv_sec * NS_PER_SEC + now.tv_nsec;
 }
 
-// helper functions for difference of two struct timeval's (compute "a - b")
-long msec_diff(struct timeval a, struct timeval b){
-    long diff = (a.tv_usec / 1000) - (b.tv_usec / 1000);
-    return diff + (a.tv_sec - b.tv_sec) * 1000;
+nstime_t nstime_now(void){
+    if(virtual_clock) return virtual_now;
+    return nstime_monotonic();
 }
-struct timeval timeval_diff(struct timeval a, struct timeval b){
-    long usec_diff = a.tv_usec - b.tv_usec;
-    long usec_mod = usec_diff % 1000000;
-    if(usec_mod < 0) usec_mod += 1000000;
-    struct timeval out = {.tv_usec=usec_mod};
-    out.tv_sec = a.tv_sec - b.tv_sec + (usec_diff - usec_mod) / 1000000;
-    return out;
+
+void nstime_set_virtual(nstime_t now){
+    virtual_clock = true;
+    virtual_now = now;
+}
+
+nstime_t nstime_from_timeval(struct timeval tv){
+    return (nstime_t)tv.tv_sec * NS_PER_SEC
+        + (nstime_t)tv.tv_usec * NS_PER_USEC;
 }
 
-struct timeval msec_after(struct timeval tv, long millis){
-    // handle integer seconds
-    tv.tv_sec += millis / 1000;
-    // calculate msec
-    long msec = (millis % 1000) + (tv.tv_usec / 1000);
-    // handle msec overflow
-    tv.tv_sec += msec > 1000;
-    tv.tv_usec = (tv.tv_usec % 1000) + (msec % 1000) * 1000;
-    return tv;
+struct timespec nstime_to_timespec(nstime_t t){
+    struct timespec ts = {
+        .tv_sec = t / NS_PER_SEC,
+        .tv_nsec = t % NS_PER_SEC,
+    };
+    return ts;
 }
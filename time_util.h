@@ -2,15 +2,36 @@
 #define TIME_UTIL_H
 
 #define _GNU_SOURCE
+#include <stdint.h>
 #include <sys/time.h>
 #include <time.h>
 
-struct timeval timeval_now();
+/* All of the resolver's timing runs on a single base: nanoseconds of
+   CLOCK_MONOTONIC.  Grabbed devices are switched to CLOCK_MONOTONIC with
+   EVIOCSCLOCKID, so their event timestamps share this base. */
+typedef int64_t nstime_t;
 
-// helper functions for difference of two struct timeval's (compute "a - b")
-long msec_diff(struct timeval a, struct timeval b);
-struct timeval timeval_diff(struct timeval a, struct timeval b);
+#define NS_PER_USEC 1000LL
+#define NS_PER_MSEC 1000000LL
+#define NS_PER_SEC 1000000000LL
 
-struct timeval msec_after(struct timeval tv, long millis);
+nstime_t nstime_now(void);
+
+// the real CLOCK_MONOTONIC time, even when nstime_now() is virtual
+nstime_t nstime_monotonic(void);
+
+/* make nstime_now() return now until the next call, instead of reading the
+   clock.  `sdiol replay` uses this to drive the resolvers on trace time. */
+void nstime_set_virtual(nstime_t now);
+
+// convert an input_event timestamp
+nstime_t nstime_from_timeval(struct timeval tv);
+
+// for timerfd_settime() on a CLOCK_MONOTONIC timer
+struct timespec nstime_to_timespec(nstime_t t);
+
+static inline nstime_t msec_to_ns(long msec){
+    return (nstime_t)msec * NS_PER_MSEC;
+}
 
 #endif // TIME_UTIL_H
@@ -0,0 +1,180 @@
+#include "trace.h"
+#include "time_util.h"
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define TRACE_MAGIC "sdioltrc"
+#define TRACE_VERSION 1
+
+typedef struct __attribute__((packed)) {
+    char magic[8];
+    uint32_t version;
+} trace_header_t;
+
+enum {
+    REC_DEVICE = 1,
+    REC_EVENT,
+};
+
+// followed by name_len bytes of name, without a trailing nul
+typedef struct __attribute__((packed)) {
+    uint8_t kind;
+    uint8_t dev;
+    uint16_t name_len;
+} rec_device_t;
+
+typedef struct __attribute__((packed)) {
+    uint8_t kind;
+    uint8_t dev;
+    uint16_t type;
+    uint16_t code;
+    int32_t value;
+    int64_t time_ns;
+} rec_event_t;
+
+struct trace {
+    FILE *f;
+    const char *path;
+    int n_devices;
+    char name[UINT16_MAX + 1];
+};
+
+static trace_t *trace_new(const char *path, const char *mode){
+    trace_t *t = malloc(sizeof(*t));
+    if(!t){
+        perror("malloc");
+        return NULL;
+    }
+    t->path = path;
+    t->n_devices = 0;
+    t->f = fopen(path, mode);
+    if(!t->f){
+        fprintf(stderr, "%s: %s\n", path, strerror(errno));
+        free(t);
+        return NULL;
+    }
+    return t;
+}
+
+trace_t *trace_create(const char *path){
+    trace_t *t = trace_new(path, "wb");
+    if(!t) return NULL;
+    trace_header_t h = { .version = TRACE_VERSION };
+    memcpy(h.magic, TRACE_MAGIC, sizeof(h.magic));
+    if(fwrite(&h, sizeof(h), 1, t->f) != 1){
+        fprintf(stderr, "%s: failed to write header\n", path);
+        trace_close(t);
+        return NULL;
+    }
+    return t;
+}
+
+trace_t *trace_open(const char *path){
+    trace_t *t = trace_new(path, "rb");
+    if(!t) return NULL;
+    trace_header_t h;
+    if(fread(&h, sizeof(h), 1, t->f) != 1
+            || memcmp(h.magic, TRACE_MAGIC, sizeof(h.magic)) != 0){
+        fprintf(stderr, "%s: not an sdiol trace\n", path);
+        trace_close(t);
+        return NULL;
+    }
+    if(h.version != TRACE_VERSION){
+        fprintf(stderr, "%s: unsupported trace version %u\n", path,
+                (unsigned)h.version);
+        trace_close(t);
+        return NULL;
+    }
+    return t;
+}
+
+void trace_close(trace_t *t){
+    if(!t) return;
+    if(fclose(t->f)){
+        fprintf(stderr, "%s: %s\n", t->path, strerror(errno));
+    }
+    free(t);
+}
+
+int trace_add_device(trace_t *t, const char *name){
+    if(t->n_devices == TRACE_MAX_DEVICES){
+        fprintf(stderr, "%s: too many devices, not recording %s\n",
+                t->path, name);
+        return -1;
+    }
+    size_t len = strlen(name);
+    if(len > UINT16_MAX) len = UINT16_MAX;
+    rec_device_t rec = {
+        .kind = REC_DEVICE,
+        .dev = t->n_devices,
+        .name_len = len,
+    };
+    fwrite(&rec, sizeof(rec), 1, t->f);
+    fwrite(name, 1, len, t->f);
+    return t->n_devices++;
+}
+
+void trace_write_events(trace_t *t, int dev, const struct input_event *evs,
+        size_t n){
+    if(dev < 0) return;
+    for(size_t i = 0; i < n; i++){
+        rec_event_t rec = {
+            .kind = REC_EVENT,
+            .dev = dev,
+            .type = evs[i].type,
+            .code = evs[i].code,
+            .value = evs[i].value,
+            .time_ns = nstime_from_timeval(evs[i].time),
+        };
+        // stdio buffers these, so this isn't a syscall per event
+        fwrite(&rec, sizeof(rec), 1, t->f);
+    }
+}
+
+trace_rec_t trace_read(trace_t *t, int *dev, const char **name,
+        struct input_event *ev){
+    int kind = fgetc(t->f);
+    if(kind == EOF){
+        return ferror(t->f) ? TRACE_ERROR : TRACE_END;
+    }
+    // put the kind back so we can read whole records
+    ungetc(kind, t->f);
+
+    if(kind == REC_DEVICE){
+        rec_device_t rec;
+        if(fread(&rec, sizeof(rec), 1, t->f) != 1) goto truncated;
+        if(fread(t->name, 1, rec.name_len, t->f) != rec.name_len){
+            goto truncated;
+        }
+        t->name[rec.name_len] = '\0';
+        *dev = rec.dev;
+        *name = t->name;
+        return TRACE_DEVICE;
+    }
+
+    if(kind == REC_EVENT){
+        rec_event_t rec;
+        if(fread(&rec, sizeof(rec), 1, t->f) != 1) goto truncated;
+        *dev = rec.dev;
+        *ev = (struct input_event){
+            .type = rec.type,
+            .code = rec.code,
+            .value = rec.value,
+            .time = {
+                .tv_sec = rec.time_ns / NS_PER_SEC,
+                .tv_usec = (rec.time_ns % NS_PER_SEC) / NS_PER_USEC,
+            },
+        };
+        return TRACE_EVENT;
+    }
+
+    fprintf(stderr, "%s: invalid record kind %d\n", t->path, kind);
+    return TRACE_ERROR;
+
+truncated:
+    fprintf(stderr, "%s: truncated record\n", t->path);
+    return TRACE_ERROR;
+}
@@ -0,0 +1,44 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <linux/input.h>
+
+/* Binary traces of raw input events, written by `sdiol record` and read by
+   `sdiol replay`.  A trace is a header followed by records in native byte
+   order.  Device records name a device (by its evdev name) and assign it an
+   id; event records carry a device id, the event, and its CLOCK_MONOTONIC
+   timestamp in nanoseconds. */
+
+// device ids are one byte in the file
+#define TRACE_MAX_DEVICES 256
+
+typedef struct trace trace_t;
+
+typedef enum {
+    TRACE_END,
+    TRACE_DEVICE,
+    TRACE_EVENT,
+    TRACE_ERROR,
+} trace_rec_t;
+
+// open a trace for writing; returns NULL on error
+trace_t *trace_create(const char *path);
+// open a trace for reading; returns NULL on error
+trace_t *trace_open(const char *path);
+// flushes a trace being written
+void trace_close(trace_t *t);
+
+// record a new device by name; returns its id, or -1 on error
+int trace_add_device(trace_t *t, const char *name);
+void trace_write_events(trace_t *t, int dev, const struct input_event *evs,
+        size_t n);
+
+/* read the next record.  For TRACE_DEVICE, *name is valid until the next
+   call; for TRACE_EVENT, *ev is filled in. */
+trace_rec_t trace_read(trace_t *t, int *dev, const char **name,
+        struct input_event *ev);
+
+#endif // TRACE_H
@@ -0,0 +1,331 @@
+#include "uring.h"
+#include "app.h"
+#include "devices.h"
+
+#include <errno.h>
+#include <poll.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+
+#include <liburing.h>
+
+#define URING_ENTRIES 64
+
+// the most events we will buffer for uinput while a write is in flight
+#define URING_OUT_MAX 1024
+
+// the user_data of each sqe is a kind (upper half) and a slot (lower half)
+enum {
+    URING_READ = 1,
+    URING_WRITE,
+    URING_POLL,
+};
+#define URING_DATA(kind, slot) (((uint64_t)(kind) << 32) | (uint32_t)(slot))
+
+static struct io_uring ring;
+static bool enabled = false;
+static int efd = -1;
+
+// one read is always posted for each input device
+static struct {
+    // -1 when the slot is unused
+    int fd;
+    struct input_event buf[READ_BATCH];
+} inputs[MAX_KBS];
+
+/* uinput writes are double-buffered: one buffer may be in flight while we
+   fill the other.  Only one write is in flight at a time, which keeps the
+   events in order. */
+static struct {
+    int fd;
+    struct input_event buf[2][URING_OUT_MAX];
+    size_t len[2];
+    int filling;
+    bool in_flight;
+    size_t in_flight_len;
+    // a write hit EAGAIN, so wait for POLLOUT before the next one
+    bool blocked;
+} out;
+
+static unsigned long submits = 0;
+static unsigned long events_written = 0;
+
+static struct io_uring_sqe *get_sqe(void){
+    struct io_uring_sqe *sqe = io_uring_get_sqe(&ring);
+    if(!sqe){
+        // the submission queue is full, so submit it and try again
+        io_uring_submit(&ring);
+        submits++;
+        sqe = io_uring_get_sqe(&ring);
+    }
+    return sqe;
+}
+
+static int post_read(int slot){
+    struct io_uring_sqe *sqe = get_sqe();
+    if(!sqe){
+        fprintf(stderr, "io_uring submission queue is full\n");
+        return -1;
+    }
+    // offset of -1 means "the current file position", as for read()
+    io_uring_prep_read(sqe, inputs[slot].fd, inputs[slot].buf,
+            sizeof(inputs[slot].buf), (uint64_t)-1);
+    io_uring_sqe_set_data64(sqe, URING_DATA(URING_READ, slot));
+    return 0;
+}
+
+int uring_init(int epfd){
+    int ret = io_uring_queue_init(URING_ENTRIES, &ring, 0);
+    if(ret < 0){
+        fprintf(stderr, "io_uring_queue_init: %s\n", strerror(-ret));
+        return -1;
+    }
+
+    efd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if(efd < 0){
+        perror("eventfd");
+        goto fail_ring;
+    }
+
+    ret = io_uring_register_eventfd(&ring, efd);
+    if(ret < 0){
+        fprintf(stderr, "io_uring_register_eventfd: %s\n", strerror(-ret));
+        goto fail_efd;
+    }
+
+    // edge-triggered, so the eventfd never needs to be read to clear it
+    if(epoll_watch(epfd, EPOLL_CTL_ADD, efd, EPOLLIN | EPOLLET,
+                EPOLL_TAG_URING, 0)){
+        perror("epoll_ctl");
+        goto fail_efd;
+    }
+
+    for(size_t i = 0; i < MAX_KBS; i++){
+        inputs[i].fd = -1;
+    }
+    out.fd = -1;
+    out.len[0] = 0;
+    out.len[1] = 0;
+    out.filling = 0;
+    out.in_flight = false;
+    out.blocked = false;
+
+    enabled = true;
+    return 0;
+
+fail_efd:
+    close(efd);
+    efd = -1;
+fail_ring:
+    io_uring_queue_exit(&ring);
+    return -1;
+}
+
+void uring_exit(void){
+    if(!enabled) return;
+
+    // this cancels the posted reads and waits for any in-flight write
+    io_uring_queue_exit(&ring);
+    close(efd);
+    efd = -1;
+    enabled = false;
+
+    // don't lose any events which never made it into a write
+    size_t len = out.len[out.filling];
+    if(len > 0){
+        write(out.fd, out.buf[out.filling], len * sizeof(struct input_event));
+    }
+}
+
+bool uring_enabled(void){
+    return enabled;
+}
+
+int uring_add_input(int fd){
+    for(int i = 0; i < MAX_KBS; i++){
+        if(inputs[i].fd != -1) continue;
+        inputs[i].fd = fd;
+        if(post_read(i)){
+            inputs[i].fd = -1;
+            return -1;
+        }
+        return 0;
+    }
+    fprintf(stderr, "too many io_uring inputs\n");
+    return -1;
+}
+
+int uring_write(int fd, struct input_event ev){
+    out.fd = fd;
+    size_t *len = &out.len[out.filling];
+    // if there's not room to buffer the event, just drop it.
+    if(*len == URING_OUT_MAX){
+        fprintf(stderr, "Warning: full uinput buffer, dropping events\n");
+        return 0;
+    }
+    out.buf[out.filling][(*len)++] = ev;
+    return sizeof(ev);
+}
+
+static void handle_read(int slot, int res, uring_read_cb cb, void *arg){
+    int fd = inputs[slot].fd;
+    if(res == -EAGAIN || res == -EINTR){
+        post_read(slot);
+        return;
+    }
+    if(res <= 0){
+        // the device is gone; free the slot and let the caller close it
+        inputs[slot].fd = -1;
+        cb(arg, fd, NULL, 0);
+        return;
+    }
+    cb(arg, fd, inputs[slot].buf, res / sizeof(struct input_event));
+    post_read(slot);
+}
+
+/* put the events which the last write didn't get to back in front of the
+   ones buffered since, so they are the first to go out on the next submit */
+static void requeue_unwritten(size_t written){
+    struct input_event *sent = out.buf[out.filling ^ 1];
+    struct input_event *buf = out.buf[out.filling];
+    size_t *len = &out.len[out.filling];
+    size_t tail = out.in_flight_len - written;
+    if(*len + tail > URING_OUT_MAX){
+        fprintf(stderr, "Warning: full uinput buffer, dropping events\n");
+        *len = URING_OUT_MAX - tail;
+    }
+    memmove(&buf[tail], buf, *len * sizeof(*buf));
+    memcpy(buf, &sent[written], tail * sizeof(*buf));
+    *len += tail;
+    events_written -= tail;
+}
+
+static void handle_write(int res){
+    out.in_flight = false;
+    size_t written = 0;
+    if(res == -EAGAIN){
+        // if the uinput device pushed back, retry when it is writable
+        out.blocked = true;
+    }else if(res == -EINTR || res == -ECANCELED){
+        // interrupted, or its linked poll failed; just try again
+    }else if(res < 0){
+        // nothing we can do with these events
+        fprintf(stderr, "uinput write: %s\n", strerror(-res));
+        return;
+    }else{
+        out.blocked = false;
+        // uinput only writes whole events, but round down just in case
+        written = res / sizeof(struct input_event);
+    }
+    if(written < out.in_flight_len){
+        requeue_unwritten(written);
+    }
+}
+
+static void handle_poll(int res){
+    if(res < 0){
+        fprintf(stderr, "uinput poll: %s\n", strerror(-res));
+        // don't wait on a poll which can't succeed
+        out.blocked = false;
+    }
+}
+
+void uring_handle(uring_read_cb cb, void *arg){
+    struct io_uring_cqe *cqe;
+    while(io_uring_peek_cqe(&ring, &cqe) == 0){
+        uint64_t data = io_uring_cqe_get_data64(cqe);
+        int res = cqe->res;
+        io_uring_cqe_seen(&ring, cqe);
+        switch(data >> 32){
+            case URING_READ:
+                handle_read((uint32_t)data, res, cb, arg);
+                break;
+            case URING_WRITE:
+                handle_write(res);
+                break;
+            case URING_POLL:
+                handle_poll(res);
+                break;
+        }
+    }
+}
+
+// wake up the serve_loop to call uring_handle() and uring_submit() again
+static void wake_up(void){
+    uint64_t one = 1;
+    write(efd, &one, sizeof(one));
+}
+
+/* handle the completions which happened during the last submit, which the
+   eventfd didn't tell us about.  That is usually just the uinput write. */
+static void reap_inline(void){
+    struct io_uring_cqe *cqe;
+    while(io_uring_peek_cqe(&ring, &cqe) == 0){
+        uint64_t data = io_uring_cqe_get_data64(cqe);
+        if(data >> 32 == URING_READ){
+            // only uring_handle() can pass the events on
+            wake_up();
+            return;
+        }
+        int res = cqe->res;
+        io_uring_cqe_seen(&ring, cqe);
+        if(data >> 32 == URING_WRITE){
+            handle_write(res);
+        }else{
+            handle_poll(res);
+        }
+    }
+    // a write came back short, so it needs to be submitted again
+    if(!out.in_flight && out.len[out.filling] > 0){
+        wake_up();
+    }
+}
+
+void uring_submit(void){
+    // start writing the filled buffer, unless a write is still in flight
+    size_t len = out.len[out.filling];
+    if(!out.in_flight && len > 0){
+        // a linked poll and write must go in the same submission
+        if(out.blocked && io_uring_sq_space_left(&ring) < 2){
+            io_uring_submit(&ring);
+            submits++;
+        }
+        struct io_uring_sqe *poll = NULL;
+        if(out.blocked && (poll = get_sqe())){
+            // the write waits until uinput is writable again
+            io_uring_prep_poll_add(poll, out.fd, POLLOUT);
+            io_uring_sqe_set_flags(poll, IOSQE_IO_LINK);
+            io_uring_sqe_set_data64(poll, URING_DATA(URING_POLL, 0));
+        }
+        struct io_uring_sqe *sqe = get_sqe();
+        if(sqe){
+            io_uring_prep_write(sqe, out.fd, out.buf[out.filling],
+                    len * sizeof(struct input_event), (uint64_t)-1);
+            io_uring_sqe_set_data64(sqe, URING_DATA(URING_WRITE, 0));
+            out.in_flight = true;
+            out.in_flight_len = len;
+            events_written += len;
+            out.filling ^= 1;
+            out.len[out.filling] = 0;
+        }
+    }
+
+    // one syscall for all the new writes and re-posted reads
+    if(io_uring_sq_ready(&ring) > 0){
+        /* don't signal the eventfd for whatever completes during the submit,
+           which saves a wakeup for nearly every uinput write.  Kernels before
+           5.8 can't do this, and just wake us up for nothing. */
+        io_uring_cq_eventfd_toggle(&ring, false);
+        io_uring_submit(&ring);
+        io_uring_cq_eventfd_toggle(&ring, true);
+        submits++;
+        reap_inline();
+    }
+}
+
+void uring_print_stats(void){
+    printf("io_uring: %lu submits, %lu events written\n",
+            submits, events_written);
+}
@@ -0,0 +1,56 @@
+#ifndef URING_H
+#define URING_H
+
+#include <stdbool.h>
+#include <stdio.h>
+#include <linux/input.h>
+
+/* An optional io_uring backend for the serve_loop (sdiol --io-uring).  A read
+   stays posted on every input device, and uinput writes are buffered and
+   submitted together with the re-posted reads, once per wakeup.  The ring's
+   completions are signaled through an eventfd in the serve_loop's epoll set,
+   tagged with EPOLL_TAG_URING. */
+
+/* called for every completed device read.  On a read error evs is NULL,
+   the device's read is no longer posted, and the caller should close fd. */
+typedef void (*uring_read_cb)(void *arg, int fd, const struct input_event *evs,
+        size_t n);
+
+#ifdef SDIOL_IO_URING
+
+// returns 0 on success or -1 on error
+int uring_init(int epfd);
+void uring_exit(void);
+bool uring_enabled(void);
+
+// start reading from an input device; returns 0 on success or -1 on error
+int uring_add_input(int fd);
+
+// buffer an event for writing to fd, to be written on the next uring_submit()
+int uring_write(int fd, struct input_event ev);
+
+// process all completions (call when the eventfd is readable)
+void uring_handle(uring_read_cb cb, void *arg);
+
+// submit buffered writes and re-posted reads (call once per wakeup)
+void uring_submit(void);
+
+void uring_print_stats(void);
+
+#else // SDIOL_IO_URING
+
+static inline int uring_init(int epfd){
+    fprintf(stderr, "sdiol was built without io_uring support\n");
+    return -1;
+}
+static inline void uring_exit(void){}
+static inline bool uring_enabled(void){ return false; }
+static inline int uring_add_input(int fd){ return -1; }
+static inline int uring_write(int fd, struct input_event ev){ return -1; }
+static inline void uring_handle(uring_read_cb cb, void *arg){}
+static inline void uring_submit(void){}
+static inline void uring_print_stats(void){}
+
+#endif // SDIOL_IO_URING
+
+#endif // URING_H